@@ -0,0 +1,123 @@
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include "admission.h"
+#include "globals.h"
+#include "evloop.h"
+#include "pool.h"
+#include "iplimit.h"
+#include "registry.h"
+#include "listener.h"
+#include "metrics.h"
+#include "worker.h"
+#include "log.h"
+
+#define REPORT_INTERVAL 60
+
+/* Shared by all acceptors; only ever added to, and reported as deltas */
+static atomic_ullong reject_ns;
+static atomic_llong last_report;
+
+static unsigned long long reported_admitted;
+static unsigned long long reported_load;
+static unsigned long long reported_ip;
+static unsigned long long reported_ns;
+static unsigned long long reported_overflows;
+static unsigned long long reported_drops;
+
+static int has_capacity(struct globals_t* g, size_t shard)
+{
+	if (g->event_loops) {
+		return evloop_has_capacity(g, shard);
+	}
+
+	if (g->workers) {
+		return pool_has_capacity(g);
+	}
+
+	return registry_count(g->registry) < g->max_sessions;
+}
+
+/* Closes the connection with a RST: no FIN handshake and no TIME_WAIT for a client we do not want */
+static void reject_connection(int fd)
+{
+	struct linger lg = { 1, 0 };
+	setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+	close(fd);
+}
+
+/* Admitted connections check too: the listen queue may overflow without a single rejection */
+static void maybe_report(struct globals_t* g, uint64_t start)
+{
+	long long now  = (long long)(start / 1000000000);
+	long long last = atomic_load_explicit(&last_report, memory_order_relaxed);
+
+	if (now - last >= REPORT_INTERVAL && atomic_compare_exchange_strong(&last_report, &last, now)) {
+		admission_report(g);
+	}
+}
+
+/*
+ * Decides whether a freshly accepted socket becomes an SSH session.
+ * A rejected socket is closed here, before libssh allocates anything for it.
+ * Returns one of the IPLIMIT_* results, IPLIMIT_REJECTED for a rejected socket.
+ */
+int admit_connection(struct globals_t* g, int fd, const struct sockaddr_storage* addr, size_t shard)
+{
+	uint64_t start = monotonic_ns();
+	int full       = !has_capacity(g, shard);
+	int admitted   = full ? IPLIMIT_REJECTED : iplimit_admit(g, addr);
+
+	if (admitted != IPLIMIT_REJECTED) {
+		metrics_inc(METRIC_connections_accepted_total);
+		maybe_report(g, start);
+		return admitted;
+	}
+
+	reject_connection(fd);
+	metrics_inc(full ? METRIC_connections_rejected_capacity_total : METRIC_connections_rejected_per_ip_total);
+	atomic_fetch_add_explicit(&reject_ns, monotonic_ns() - start, memory_order_relaxed);
+	maybe_report(g, start);
+	return IPLIMIT_REJECTED;
+}
+
+/* Not reentrant: called by whichever acceptor wins the report slot, and at shutdown */
+void admission_report(struct globals_t* g)
+{
+	unsigned long long a   = metrics_get(METRIC_connections_accepted_total);
+	unsigned long long l   = metrics_get(METRIC_connections_rejected_capacity_total);
+	unsigned long long i   = metrics_get(METRIC_connections_rejected_per_ip_total);
+	unsigned long long ns  = atomic_load(&reject_ns);
+	unsigned long long rej = (l - reported_load) + (i - reported_ip);
+
+	if (rej) {
+		my_log(
+			LOG_DAEMON | LOG_WARNING,
+			"Admission: %llu connections admitted, %llu rejected (%llu over capacity, %llu over per-IP limits), %.1f us per rejection",
+			a - reported_admitted,
+			rej,
+			l - reported_load,
+			i - reported_ip,
+			(double)(ns - reported_ns) / 1000.0 / (double)rej
+		);
+	}
+
+	struct listen_stats_t ls;
+	if (listen_stats(&ls) == 0 && ls.overflows != reported_overflows) {
+		my_log(
+			LOG_DAEMON | LOG_WARNING,
+			"Listen queue overflowed %llu times (%llu connections dropped by listening sockets); consider a larger --backlog or more --acceptors",
+			ls.overflows - reported_overflows,
+			ls.drops - reported_drops
+		);
+
+		reported_overflows = ls.overflows;
+		reported_drops     = ls.drops;
+	}
+
+	reported_admitted = a;
+	reported_load     = l;
+	reported_ip       = i;
+	reported_ns       = ns;
+}
@@ -0,0 +1,10 @@
+#ifndef ADMISSION_H_
+#define ADMISSION_H_
+
+#include <sys/socket.h>
+#include "globals.h"
+
+int admit_connection(struct globals_t* g, int fd, const struct sockaddr_storage* addr, size_t shard);
+void admission_report(struct globals_t* g);
+
+#endif /* ADMISSION_H_ */
@@ -0,0 +1,272 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "aggregate.h"
+#include "globals.h"
+#include "events.h"
+#include "log.h"
+
+/* Average arena bytes reserved per entry; most credentials are short */
+#define ARENA_PER_ENTRY 64
+#define MAX_KEY         (2 * EVENT_STRING_LIMIT + INET6_ADDRSTRLEN + 2)
+
+struct aggregate_entry_t {
+	uint64_t hash;
+	const char* key;    /* user\0password\0ip\0 in the arena; NULL for a free slot */
+	unsigned long long count;
+	time_t first_seen;
+	time_t last_seen;
+};
+
+/*
+ * (user, password, source) -> number of attempts since the last rollup.
+ * Keys live in a bump arena; when either the table or the arena is full,
+ * every pending count is rolled up and the whole generation is dropped at once.
+ * Everything is guarded by the mutex.
+ */
+struct aggregate_t {
+	pthread_mutex_t mutex;
+	pthread_cond_t wakeup;
+	pthread_t flusher;
+	int stop;
+
+	struct aggregate_entry_t* table;
+	size_t mask;
+	size_t used;
+	size_t limit;
+
+	char* arena;
+	size_t arena_used;
+	size_t arena_size;
+
+	unsigned long long evictions;
+};
+
+static uint64_t hash_key(const char* key, size_t len)
+{
+	uint64_t h = 14695981039346656037ULL;
+	for (size_t i = 0; i < len; ++i) {
+		h = (h ^ (unsigned char)key[i]) * 1099511628211ULL;
+	}
+
+	return h;
+}
+
+/* Returns 0 when the user or the password does not fit into a key */
+static size_t build_key(char* key, const char* user, const char* pass, const char* ip)
+{
+	size_t ulen = strnlen(user, EVENT_STRING_LIMIT);
+	size_t plen = strnlen(pass, EVENT_STRING_LIMIT);
+	size_t ilen = strlen(ip);
+	char* p     = key;
+
+	if (ulen == EVENT_STRING_LIMIT || plen == EVENT_STRING_LIMIT) {
+		return 0;
+	}
+
+	memcpy(p, user, ulen);
+	p   += ulen;
+	*p++ = 0;
+	memcpy(p, pass, plen);
+	p   += plen;
+	*p++ = 0;
+	memcpy(p, ip, ilen);
+	p   += ilen;
+	*p++ = 0;
+	return (size_t)(p - key);
+}
+
+static void emit_entry(const struct aggregate_entry_t* e)
+{
+	const char* pass = e->key + strlen(e->key) + 1;
+	const char* ip   = pass + strlen(pass) + 1;
+
+	struct event_auth_rollup_t ev = {
+		e->key,
+		ip,
+		pass,
+		(int)e->count,
+		(int)e->first_seen,
+		(int)e->last_seen
+	};
+
+	emit_auth_rollup(&ev);
+}
+
+static void flush(struct aggregate_t* a)
+{
+	for (size_t i = 0; i <= a->mask; ++i) {
+		struct aggregate_entry_t* e = &a->table[i];
+		if (e->key && e->count) {
+			emit_entry(e);
+			e->count = 0;
+		}
+	}
+}
+
+static void reset(struct aggregate_t* a)
+{
+	flush(a);
+	memset(a->table, 0, (a->mask + 1) * sizeof(struct aggregate_entry_t));
+	a->used       = 0;
+	a->arena_used = 0;
+	++a->evictions;
+}
+
+static void* flusher(void* arg)
+{
+	struct aggregate_t* a = (struct aggregate_t*)arg;
+
+	pthread_mutex_lock(&a->mutex);
+	while (!a->stop) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += (time_t)globals.aggregate_interval;
+
+		while (!a->stop && pthread_cond_timedwait(&a->wakeup, &a->mutex, &deadline) != ETIMEDOUT) {
+			/* Spurious wakeup or stop request */
+		}
+
+		flush(a);
+	}
+
+	pthread_mutex_unlock(&a->mutex);
+	return NULL;
+}
+
+/*
+ * Returns 1 when the attempt is a repeat that has been counted for the next rollup,
+ * 0 when it is the first sighting and has to be logged by the caller.
+ * Over-long credentials are never aggregated: cut to a key, distinct ones would be merged.
+ */
+int aggregate_auth(struct connection_info_t* conn, const char* user, const char* pass)
+{
+	struct aggregate_t* a = globals.aggregate_table;
+	char key[MAX_KEY];
+	size_t len;
+	uint64_t h;
+	size_t i;
+	int repeat = 0;
+
+	if (!a) {
+		return 0;
+	}
+
+	len = build_key(key, user, pass, conn->ipstr);
+	if (!len) {
+		return 0;
+	}
+
+	h = hash_key(key, len);
+
+	pthread_mutex_lock(&a->mutex);
+	{
+		time_t now = time(NULL);
+
+		i = (size_t)h & a->mask;
+		while (a->table[i].key && (a->table[i].hash != h || memcmp(a->table[i].key, key, len))) {
+			i = (i + 1) & a->mask;
+		}
+
+		if (a->table[i].key) {
+			struct aggregate_entry_t* e = &a->table[i];
+			if (!e->count) {
+				e->first_seen = now;
+			}
+
+			++e->count;
+			e->last_seen = now;
+			repeat       = 1;
+		}
+		else {
+			if (a->used >= a->limit || a->arena_used + len > a->arena_size) {
+				reset(a);
+				i = (size_t)h & a->mask;
+			}
+
+			struct aggregate_entry_t* e = &a->table[i];
+			memcpy(a->arena + a->arena_used, key, len);
+			e->key         = a->arena + a->arena_used;
+			e->hash        = h;
+			e->count       = 0;
+			a->arena_used += len;
+			++a->used;
+		}
+	}
+	pthread_mutex_unlock(&a->mutex);
+
+	return repeat;
+}
+
+int aggregate_start(struct globals_t* g)
+{
+	struct aggregate_t* a = calloc(1, sizeof(struct aggregate_t));
+	pthread_condattr_t attr;
+	size_t size = 1;
+
+	if (!a) {
+		return -1;
+	}
+
+	/* Keep the load factor at or below 50% */
+	while (size < 2 * g->aggregate) {
+		size <<= 1;
+	}
+
+	a->mask       = size - 1;
+	a->limit      = g->aggregate;
+	a->arena_size = g->aggregate * ARENA_PER_ENTRY + MAX_KEY;
+	a->table      = calloc(size, sizeof(struct aggregate_entry_t));
+	a->arena      = malloc(a->arena_size);
+	if (!a->table || !a->arena) {
+		free(a->table);
+		free(a->arena);
+		free(a);
+		return -1;
+	}
+
+	pthread_mutex_init(&a->mutex, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&a->wakeup, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if (pthread_create(&a->flusher, NULL, flusher, a) != 0) {
+		pthread_cond_destroy(&a->wakeup);
+		pthread_mutex_destroy(&a->mutex);
+		free(a->table);
+		free(a->arena);
+		free(a);
+		return -1;
+	}
+
+	g->aggregate_table = a;
+	return 0;
+}
+
+void aggregate_stop(struct globals_t* g)
+{
+	struct aggregate_t* a = g->aggregate_table;
+
+	if (a) {
+		pthread_mutex_lock(&a->mutex);
+		a->stop = 1;
+		pthread_cond_signal(&a->wakeup);
+		pthread_mutex_unlock(&a->mutex);
+		pthread_join(a->flusher, NULL);
+
+		/* The flusher rolls up whatever is pending on its way out */
+		g->aggregate_table = NULL;
+		if (a->evictions) {
+			my_log(LOG_DAEMON | LOG_INFO, "Credential aggregation: the table was full %llu time(s), consider a larger --aggregate", a->evictions);
+		}
+
+		pthread_cond_destroy(&a->wakeup);
+		pthread_mutex_destroy(&a->mutex);
+		free(a->table);
+		free(a->arena);
+		free(a);
+	}
+}
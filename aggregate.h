@@ -0,0 +1,10 @@
+#ifndef AGGREGATE_H_
+#define AGGREGATE_H_
+
+#include "globals.h"
+
+int aggregate_start(struct globals_t* g);
+int aggregate_auth(struct connection_info_t* conn, const char* user, const char* pass);
+void aggregate_stop(struct globals_t* g);
+
+#endif /* AGGREGATE_H_ */
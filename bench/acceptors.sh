@@ -0,0 +1,37 @@
+#!/bin/sh
+#
+# How connection throughput scales with the number of SO_REUSEPORT acceptors (-R).
+# Sessions are handshake-only with the cheap profile, so that the daemon's time goes to
+# accepting and setting up sessions rather than to password attempts or expensive key exchanges.
+# BENCH_ACCEPTORS lists the acceptor counts to try (default: 1, 2, 4 ... up to the number of CPUs).
+# Prints a JSON array; BENCH_CONNECTIONS, BENCH_DURATION and BENCH_DAEMON_ARGS are honoured.
+#
+set -e
+
+cd "$(dirname "$0")/.."
+
+if [ -z "$BENCH_ACCEPTORS" ]; then
+	cpus=$(nproc)
+	n=1
+	while [ "$n" -lt "$cpus" ]; do
+		BENCH_ACCEPTORS="$BENCH_ACCEPTORS $n"
+		n=$((n * 2))
+	done
+
+	BENCH_ACCEPTORS="$BENCH_ACCEPTORS $cpus"
+fi
+
+sep=""
+echo "["
+for n in $BENCH_ACCEPTORS; do
+	printf '%s{ "acceptors": %s, "result":\n' "$sep" "$n"
+	BENCH_ATTEMPTS=0 \
+	BENCH_CONNECTIONS="${BENCH_CONNECTIONS:-64}" \
+	BENCH_DAEMON_ARGS="-c cheap -R $n $BENCH_DAEMON_ARGS" \
+		sh bench/run.sh
+	printf '}'
+	sep=",
+"
+done
+echo
+echo "]"
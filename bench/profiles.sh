@@ -0,0 +1,38 @@
+#!/bin/sh
+#
+# CPU time the daemon spends per completed handshake with every --crypto profile.
+# Sessions only connect and disconnect (no password attempts), so the daemon's CPU time
+# is almost entirely the key exchange. "compat, DH client" is the compat profile against
+# a client that prefers the most expensive choices the profile allows - what the cheap profile rules out.
+# Prints a JSON array; BENCH_CONNECTIONS, BENCH_DURATION and BENCH_DAEMON_ARGS are honoured.
+#
+set -e
+
+cd "$(dirname "$0")/.."
+
+DH_CLIENT="-k diffie-hellman-group16-sha512,diffie-hellman-group14-sha256 -K rsa-sha2-512,rsa-sha2-256"
+
+run()
+{
+	label=$1
+	profile_args=$2
+	load_args=$3
+
+	printf '{ "profile": "%s", "result":\n' "$label"
+	BENCH_ATTEMPTS=0 \
+	BENCH_DAEMON_ARGS="$BENCH_DAEMON_ARGS $profile_args" \
+	BENCH_LOAD_ARGS="$load_args" \
+		sh bench/run.sh
+	printf '}'
+}
+
+echo "["
+run "default"          "-c default"         ""
+echo ","
+run "cheap"            "-c cheap"           ""
+echo ","
+run "compat"           "-c compat -y rsa"   ""
+echo ","
+run "compat, DH client" "-c compat -y rsa"  "$DH_CLIENT"
+echo
+echo "]"
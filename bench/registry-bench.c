@@ -0,0 +1,134 @@
+/*
+ * Connect/disconnect contention: the mutex-guarded doubly linked list
+ * that used to track connections versus the lock-free slot registry.
+ *
+ * Usage: registry-bench [THREADS] [OPERATIONS PER THREAD]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#include "../registry.h"
+
+struct connection_info_t {
+	struct connection_info_t* prev;
+	struct connection_info_t* next;
+	long int slot;
+};
+
+static pthread_mutex_t list_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct connection_info_t* head;
+static struct connection_info_t* tail;
+static volatile size_t n_threads;
+
+static struct registry_t* registry;
+static size_t operations;
+
+static void list_add(struct connection_info_t* conn)
+{
+	pthread_mutex_lock(&list_mutex);
+	if (!head) {
+		head = conn;
+	}
+
+	if (tail) {
+		tail->next = conn;
+	}
+
+	conn->prev = tail;
+	conn->next = NULL;
+	tail       = conn;
+	++n_threads;
+	pthread_mutex_unlock(&list_mutex);
+}
+
+static void list_remove(struct connection_info_t* conn)
+{
+	pthread_mutex_lock(&list_mutex);
+	if (conn->prev) {
+		conn->prev->next = conn->next;
+	}
+
+	if (conn->next) {
+		conn->next->prev = conn->prev;
+	}
+
+	if (tail == conn) {
+		tail = conn->prev;
+	}
+
+	if (head == conn) {
+		head = conn->next;
+	}
+
+	--n_threads;
+	pthread_mutex_unlock(&list_mutex);
+}
+
+static void* list_worker(void* arg)
+{
+	struct connection_info_t conn;
+
+	for (size_t i = 0; i < operations; ++i) {
+		list_add(&conn);
+		list_remove(&conn);
+	}
+
+	return NULL;
+}
+
+static void* registry_worker(void* arg)
+{
+	struct connection_info_t conn;
+
+	for (size_t i = 0; i < operations; ++i) {
+		conn.slot = registry_add(registry);
+		if (conn.slot >= 0) {
+			registry_remove(registry, conn.slot);
+		}
+	}
+
+	return NULL;
+}
+
+static double run(void* (*fn)(void*), size_t threads)
+{
+	pthread_t* tids = calloc(threads, sizeof(pthread_t));
+	struct timespec start;
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (size_t i = 0; i < threads; ++i) {
+		pthread_create(&tids[i], NULL, fn, NULL);
+	}
+
+	for (size_t i = 0; i < threads; ++i) {
+		pthread_join(tids[i], NULL);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	free(tids);
+	return (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+int main(int argc, char** argv)
+{
+	size_t threads = argc > 1 ? strtoul(argv[1], NULL, 10) : 8;
+	double list_time;
+	double registry_time;
+	double total;
+
+	operations = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000;
+	registry   = registry_new(threads);
+	total      = (double)threads * (double)operations;
+
+	list_time     = run(list_worker, threads);
+	registry_time = run(registry_worker, threads);
+
+	printf("threads: %zu, connect/disconnect pairs per thread: %zu\n", threads, operations);
+	printf("mutex list: %8.1f ns/pair, %6.2f M pairs/s\n", list_time * 1e9 / total, total / list_time / 1e6);
+	printf("registry:   %8.1f ns/pair, %6.2f M pairs/s\n", registry_time * 1e9 / total, total / registry_time / 1e6);
+
+	registry_free(registry);
+	return 0;
+}
@@ -0,0 +1,39 @@
+#!/bin/sh
+#
+# Starts ./ssh-honeypotd on a loopback port, runs bench/ssh-load against it
+# and prints the JSON summary. Knobs (environment):
+#   BENCH_PORT, BENCH_CONNECTIONS, BENCH_DURATION, BENCH_RATE, BENCH_ATTEMPTS - passed to ssh-load
+#   BENCH_DAEMON_ARGS - extra ssh-honeypotd options, e.g. "-E 4" or "-W 64"
+#   BENCH_LOAD_ARGS   - extra ssh-load options, e.g. "-k diffie-hellman-group16-sha512"
+#   BENCH_OUTPUT      - also write the summary to this file
+#
+set -e
+
+cd "$(dirname "$0")/.."
+
+PORT=${BENCH_PORT:-22022}
+LOG=$(mktemp)
+trap 'kill "$PID" 2>/dev/null; wait "$PID" 2>/dev/null; rm -f "$LOG"' EXIT
+
+# shellcheck disable=SC2086
+./ssh-honeypotd -f -x -b 127.0.0.1 -p "$PORT" $BENCH_DAEMON_ARGS 2>"$LOG" &
+PID=$!
+
+i=0
+until grep -q "Accepting connections" "$LOG"; do
+	i=$((i + 1))
+	if [ $i -gt 100 ] || ! kill -0 "$PID" 2>/dev/null; then
+		echo "ssh-honeypotd did not start:" >&2
+		cat "$LOG" >&2
+		exit 1
+	fi
+
+	sleep 0.1
+done
+
+# shellcheck disable=SC2086
+bench/ssh-load -H 127.0.0.1 -p "$PORT" -P "$PID" $BENCH_LOAD_ARGS \
+	-c "${BENCH_CONNECTIONS:-16}" \
+	-d "${BENCH_DURATION:-10}" \
+	-r "${BENCH_RATE:-0}" \
+	-a "${BENCH_ATTEMPTS:-3}" | tee "${BENCH_OUTPUT:-/dev/null}"
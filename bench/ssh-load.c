@@ -0,0 +1,375 @@
+/*
+ * SSH load generator: keeps CONNECTIONS client sessions busy against a running ssh-honeypotd,
+ * each one connecting, completing the key exchange and trying passwords, then reconnecting.
+ * Prints a JSON summary: handshakes/s, password attempts/s, latency percentiles
+ * and, given the PID of the daemon, its RSS and CPU usage over the run.
+ *
+ * Usage: ssh-load [-H HOST] [-p PORT] [-c CONNECTIONS] [-d SECONDS] [-r RATE] [-a ATTEMPTS] [-P PID]
+ *                 [-k KEX] [-K HOSTKEYS] [-C CIPHERS]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <libssh/libssh.h>
+#include <libssh/callbacks.h>
+
+struct samples_t {
+	uint64_t* v;
+	size_t n;
+	size_t cap;
+};
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+struct client_t {
+	pthread_t tid;
+	size_t id;
+	struct samples_t handshake;
+	struct samples_t auth;
+	unsigned long int failures;
+};
+#pragma clang diagnostic pop
+
+struct proc_usage_t {
+	double cpu;
+	long int rss_kb;
+	long int hwm_kb;
+};
+
+static const char* host     = "127.0.0.1";
+static int port             = 2222;
+static size_t clients       = 16;
+static double duration      = 10.0;
+static double rate          = 0.0;
+static int attempts         = 3;
+static pid_t daemon_pid     = 0;
+static const char* kex      = NULL;
+static const char* hostkeys = NULL;
+static const char* ciphers  = NULL;
+static uint64_t deadline;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t t)
+{
+	struct timespec ts = { (time_t)(t / 1000000000ULL), (long int)(t % 1000000000ULL) };
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0) {
+		;
+	}
+}
+
+static void add_sample(struct samples_t* s, uint64_t ns)
+{
+	if (s->n == s->cap) {
+		size_t cap = s->cap ? s->cap * 2 : 1024;
+		uint64_t* v = realloc(s->v, cap * sizeof(uint64_t));
+		if (!v) {
+			return;
+		}
+
+		s->v   = v;
+		s->cap = cap;
+	}
+
+	s->v[s->n++] = ns;
+}
+
+static int cmp_u64(const void* a, const void* b)
+{
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+static double percentile_ms(const struct samples_t* s, double p)
+{
+	if (!s->n) {
+		return 0.0;
+	}
+
+	size_t idx = (size_t)(p / 100.0 * (double)s->n);
+	if (idx >= s->n) {
+		idx = s->n - 1;
+	}
+
+	return (double)s->v[idx] / 1e6;
+}
+
+static ssh_session new_session(void)
+{
+	ssh_session session = ssh_new();
+	long int timeout    = 10;
+	int no              = 0;
+
+	if (session) {
+		ssh_options_set(session, SSH_OPTIONS_HOST, host);
+		ssh_options_set(session, SSH_OPTIONS_PORT, &port);
+		ssh_options_set(session, SSH_OPTIONS_USER, "root");
+		ssh_options_set(session, SSH_OPTIONS_TIMEOUT, &timeout);
+		ssh_options_set(session, SSH_OPTIONS_STRICTHOSTKEYCHECK, &no);
+		ssh_options_set(session, SSH_OPTIONS_KNOWNHOSTS, "/dev/null");
+
+		/* The client's preferences win the negotiation: these pick what the daemon has to compute */
+		if (kex) {
+			ssh_options_set(session, SSH_OPTIONS_KEY_EXCHANGE, kex);
+		}
+
+		if (hostkeys) {
+			ssh_options_set(session, SSH_OPTIONS_HOSTKEYS, hostkeys);
+		}
+
+		if (ciphers) {
+			ssh_options_set(session, SSH_OPTIONS_CIPHERS_C_S, ciphers);
+			ssh_options_set(session, SSH_OPTIONS_CIPHERS_S_C, ciphers);
+		}
+	}
+
+	return session;
+}
+
+static void* client(void* arg)
+{
+	struct client_t* c  = (struct client_t*)arg;
+	uint64_t interval   = rate > 0 ? (uint64_t)(1e9 / rate) : 0;
+	unsigned long int k = 0;
+	char password[64];
+
+	while (now_ns() < deadline) {
+		ssh_session session = new_session();
+		uint64_t start      = now_ns();
+
+		if (!session || ssh_connect(session) != SSH_OK) {
+			++c->failures;
+			if (session) {
+				ssh_free(session);
+			}
+
+			sleep_until(now_ns() + 10000000);
+			continue;
+		}
+
+		add_sample(&c->handshake, now_ns() - start);
+
+		uint64_t next = now_ns();
+		for (int i = 0; i < attempts && next < deadline; ++i) {
+			if (interval) {
+				sleep_until(next);
+				next += interval;
+			}
+
+			snprintf(password, sizeof(password), "bench-%zu-%lu", c->id, k++);
+			start = now_ns();
+			if (ssh_userauth_password(session, NULL, password) == SSH_AUTH_ERROR) {
+				break;
+			}
+
+			add_sample(&c->auth, now_ns() - start);
+		}
+
+		ssh_disconnect(session);
+		ssh_free(session);
+	}
+
+	return NULL;
+}
+
+static void merge(struct samples_t* dst, const struct samples_t* src)
+{
+	for (size_t i = 0; i < src->n; ++i) {
+		add_sample(dst, src->v[i]);
+	}
+}
+
+static int proc_usage(pid_t pid, struct proc_usage_t* u)
+{
+	char path[64];
+	char buf[1024];
+	FILE* f;
+
+	memset(u, 0, sizeof(struct proc_usage_t));
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	f = fopen(path, "r");
+	if (!f) {
+		return -1;
+	}
+
+	if (fgets(buf, sizeof(buf), f)) {
+		/* Fields after the parenthesized command name: utime and stime are the 12th and 13th */
+		char* p = strrchr(buf, ')');
+		unsigned long int utime;
+		unsigned long int stime;
+		if (p && sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) == 2) {
+			u->cpu = (double)(utime + stime) / (double)sysconf(_SC_CLK_TCK);
+		}
+	}
+
+	fclose(f);
+
+	snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+	f = fopen(path, "r");
+	if (!f) {
+		return -1;
+	}
+
+	while (fgets(buf, sizeof(buf), f)) {
+		sscanf(buf, "VmRSS: %ld", &u->rss_kb);
+		sscanf(buf, "VmHWM: %ld", &u->hwm_kb);
+	}
+
+	fclose(f);
+	return 0;
+}
+
+static void print_latency(const char* name, const struct samples_t* s, const char* sep)
+{
+	printf(
+		"  \"%s_ms\": { \"p50\": %.3f, \"p99\": %.3f, \"p999\": %.3f, \"max\": %.3f }%s\n",
+		name,
+		percentile_ms(s, 50.0),
+		percentile_ms(s, 99.0),
+		percentile_ms(s, 99.9),
+		s->n ? (double)s->v[s->n - 1] / 1e6 : 0.0,
+		sep
+	);
+}
+
+static void usage(const char* name)
+{
+	fprintf(
+		stderr,
+		"Usage: %s [options]\n"
+		"  -H HOST         daemon address (default: 127.0.0.1)\n"
+		"  -p PORT         daemon port (default: 2222)\n"
+		"  -c CONNECTIONS  concurrent client sessions (default: 16)\n"
+		"  -d SECONDS      duration of the run (default: 10)\n"
+		"  -r RATE         password attempts per second per session, 0 for no limit (default: 0)\n"
+		"  -a ATTEMPTS     password attempts per session before reconnecting (default: 3)\n"
+		"  -P PID          PID of the daemon, to report its RSS and CPU usage\n"
+		"  -k KEX          key exchange methods the client offers, in order of preference\n"
+		"  -K HOSTKEYS     host key algorithms the client offers\n"
+		"  -C CIPHERS      ciphers the client offers\n",
+		name
+	);
+}
+
+int main(int argc, char** argv)
+{
+	struct client_t* c;
+	struct samples_t handshake = { NULL, 0, 0 };
+	struct samples_t auth      = { NULL, 0, 0 };
+	struct proc_usage_t before;
+	struct proc_usage_t after;
+	unsigned long int failures = 0;
+	uint64_t start;
+	double elapsed;
+	int have_proc = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "H:p:c:d:r:a:P:k:K:C:h")) != -1) {
+		switch (opt) {
+			case 'H': host       = optarg; break;
+			case 'p': port       = atoi(optarg); break;
+			case 'c': clients    = strtoul(optarg, NULL, 10); break;
+			case 'd': duration   = atof(optarg); break;
+			case 'r': rate       = atof(optarg); break;
+			case 'a': attempts   = atoi(optarg); break;
+			case 'P': daemon_pid = (pid_t)atoi(optarg); break;
+			case 'k': kex        = optarg; break;
+			case 'K': hostkeys   = optarg; break;
+			case 'C': ciphers    = optarg; break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+
+	if (!clients || duration <= 0 || attempts < 0 || port <= 0 || port > 65535) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	ssh_threads_set_callbacks(ssh_threads_get_pthread());
+	ssh_init();
+
+	c = calloc(clients, sizeof(struct client_t));
+	if (!c) {
+		perror("calloc");
+		return EXIT_FAILURE;
+	}
+
+	if (daemon_pid) {
+		have_proc = proc_usage(daemon_pid, &before) == 0;
+	}
+
+	start    = now_ns();
+	deadline = start + (uint64_t)(duration * 1e9);
+	for (size_t i = 0; i < clients; ++i) {
+		c[i].id = i;
+		if (pthread_create(&c[i].tid, NULL, client, &c[i]) != 0) {
+			perror("pthread_create");
+			return EXIT_FAILURE;
+		}
+	}
+
+	for (size_t i = 0; i < clients; ++i) {
+		pthread_join(c[i].tid, NULL);
+		merge(&handshake, &c[i].handshake);
+		merge(&auth, &c[i].auth);
+		failures += c[i].failures;
+		free(c[i].handshake.v);
+		free(c[i].auth.v);
+	}
+
+	elapsed = (double)(now_ns() - start) / 1e9;
+	if (have_proc) {
+		have_proc = proc_usage(daemon_pid, &after) == 0;
+	}
+
+	qsort(handshake.v, handshake.n, sizeof(uint64_t), cmp_u64);
+	qsort(auth.v, auth.n, sizeof(uint64_t), cmp_u64);
+
+	printf("{\n");
+	printf("  \"connections\": %zu,\n", clients);
+	printf("  \"duration\": %.3f,\n", elapsed);
+	printf("  \"rate\": %g,\n", rate);
+	printf("  \"attempts_per_session\": %d,\n", attempts);
+	printf("  \"handshakes\": %zu,\n", handshake.n);
+	printf("  \"handshake_failures\": %lu,\n", failures);
+	printf("  \"handshakes_per_sec\": %.1f,\n", (double)handshake.n / elapsed);
+	printf("  \"auth_attempts\": %zu,\n", auth.n);
+	printf("  \"auth_attempts_per_sec\": %.1f,\n", (double)auth.n / elapsed);
+	print_latency("handshake", &handshake, ",");
+	print_latency("auth", &auth, have_proc ? "," : "");
+	if (have_proc) {
+		printf(
+			"  \"daemon\": { \"pid\": %d, \"rss_kb\": %ld, \"max_rss_kb\": %ld, \"cpu_seconds\": %.2f, \"cpu_percent\": %.1f, \"cpu_us_per_handshake\": %.0f }\n",
+			(int)daemon_pid,
+			after.rss_kb,
+			after.hwm_kb,
+			after.cpu - before.cpu,
+			(after.cpu - before.cpu) * 100.0 / elapsed,
+			handshake.n ? (after.cpu - before.cpu) * 1e6 / (double)handshake.n : 0.0
+		);
+	}
+
+	printf("}\n");
+
+	free(handshake.v);
+	free(auth.v);
+	free(c);
+	ssh_finalize();
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,465 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#define CAPTURE_FORMAT_ONLY
+#include "capture.h"
+
+enum group_t {
+	GROUP_NONE,
+	GROUP_USER,
+	GROUP_PASSWORD,
+	GROUP_CREDENTIALS,
+	GROUP_SOURCE
+};
+
+struct options_t {
+	const char* user;
+	const char* pass;
+	const char* addr;
+	int64_t from;
+	int64_t to;
+	int count;
+	enum group_t group;
+	size_t top;
+};
+
+struct group_entry_t {
+	char* key;
+	size_t len;
+	unsigned long long count;
+};
+
+/* Open-addressing table for --group; grows at 50% fill */
+struct group_table_t {
+	struct group_entry_t* entries;
+	size_t size;
+	size_t used;
+};
+
+static struct options_t options;
+static struct group_table_t groups;
+static unsigned long long matched;
+
+static struct option long_options[] = {
+	{ "user",     required_argument, 0, 'u' },
+	{ "password", required_argument, 0, 'p' },
+	{ "address",  required_argument, 0, 'a' },
+	{ "from",     required_argument, 0, 'f' },
+	{ "to",       required_argument, 0, 't' },
+	{ "count",    no_argument,       0, 'c' },
+	{ "group",    required_argument, 0, 'g' },
+	{ "top",      required_argument, 0, 'n' },
+	{ "help",     no_argument,       0, 'h' },
+	{ 0,          0,                 0, 0   }
+};
+
+#if defined(__GNUC__) || defined(__clang__)
+__attribute__((noreturn))
+#endif
+static void usage(int code)
+{
+	printf(
+		"Usage: ssh-honeypotd-capture [options]... FILE...\n"
+		"Query ssh-honeypotd capture files\n\n"
+		"Mandatory arguments to long options are mandatory for short options too.\n"
+		"  -u, --user USER       only attempts with this username\n"
+		"  -p, --password PASS   only attempts with this password\n"
+		"  -a, --address ADDRESS only attempts from this IP address\n"
+		"  -f, --from TIME       only attempts at or after TIME (UNIX timestamp)\n"
+		"  -t, --to TIME         only attempts before TIME (UNIX timestamp)\n"
+		"  -c, --count           print only the number of matching attempts\n"
+		"  -g, --group KEY       count matching attempts by user, password,\n"
+		"                        credentials or source\n"
+		"  -n, --top N           with --group, print only the N most frequent keys\n"
+		"  -h, --help            display this help and exit\n"
+	);
+
+	exit(code);
+}
+
+static int64_t parse_time(const char* s, const char* option)
+{
+	char* end;
+	long long value;
+
+	errno = 0;
+	value = strtoll(s, &end, 10);
+	if (errno || !*s || *end) {
+		fprintf(stderr, "ERROR: invalid value for %s: %s\n", option, s);
+		exit(EXIT_FAILURE);
+	}
+
+	return (int64_t)value * 1000000000;
+}
+
+static void parse_options(int argc, char** argv)
+{
+	options.to = INT64_MAX;
+
+	while (1) {
+		int option_index = 0;
+		int c = getopt_long(argc, argv, "u:p:a:f:t:cg:n:h", long_options, &option_index);
+		if (-1 == c) {
+			break;
+		}
+
+		switch (c) {
+			case 'u': options.user = optarg; break;
+			case 'p': options.pass = optarg; break;
+			case 'a': options.addr = optarg; break;
+			case 'f': options.from = parse_time(optarg, "--from"); break;
+			case 't': options.to   = parse_time(optarg, "--to"); break;
+			case 'c': options.count = 1; break;
+			case 'n': options.top  = (size_t)strtoul(optarg, NULL, 10); break;
+
+			case 'g':
+				if (!strcmp(optarg, "user")) {
+					options.group = GROUP_USER;
+				}
+				else if (!strcmp(optarg, "password")) {
+					options.group = GROUP_PASSWORD;
+				}
+				else if (!strcmp(optarg, "credentials")) {
+					options.group = GROUP_CREDENTIALS;
+				}
+				else if (!strcmp(optarg, "source")) {
+					options.group = GROUP_SOURCE;
+				}
+				else {
+					fprintf(stderr, "ERROR: invalid value for --group: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+
+				break;
+
+			case 'h':
+				usage(EXIT_SUCCESS);
+				/* unreachable */
+				/* no break */
+
+			case '?':
+			default:
+				usage(EXIT_FAILURE);
+		}
+	}
+
+	if (optind >= argc) {
+		usage(EXIT_FAILURE);
+	}
+}
+
+static int string_equals(const char* s, const char* p, uint16_t len)
+{
+	return strlen(s) == len && !memcmp(s, p, len);
+}
+
+static void format_address(const struct capture_record_t* r, const uint8_t* addr, char* buf)
+{
+	if (!inet_ntop(r->family == AF_INET6 ? AF_INET6 : AF_INET, addr, buf, INET6_ADDRSTRLEN)) {
+		strcpy(buf, "?");
+	}
+}
+
+static uint64_t hash(const char* s, size_t len)
+{
+	uint64_t h = 14695981039346656037ULL;
+	for (size_t i = 0; i < len; ++i) {
+		h = (h ^ (unsigned char)s[i]) * 1099511628211ULL;
+	}
+
+	return h;
+}
+
+static struct group_entry_t* group_slot(struct group_entry_t* entries, size_t size, const char* key, size_t len)
+{
+	size_t i = hash(key, len) & (size - 1);
+	while (entries[i].key && (entries[i].len != len || memcmp(entries[i].key, key, len))) {
+		i = (i + 1) & (size - 1);
+	}
+
+	return &entries[i];
+}
+
+static void group_add(const char* key, size_t len)
+{
+	struct group_entry_t* e;
+
+	if (2 * (groups.used + 1) > groups.size) {
+		size_t size = groups.size ? 2 * groups.size : 1024;
+		struct group_entry_t* entries = calloc(size, sizeof(struct group_entry_t));
+		if (!entries) {
+			perror("calloc");
+			exit(EXIT_FAILURE);
+		}
+
+		for (size_t i = 0; i < groups.size; ++i) {
+			if (groups.entries[i].key) {
+				*group_slot(entries, size, groups.entries[i].key, groups.entries[i].len) = groups.entries[i];
+			}
+		}
+
+		free(groups.entries);
+		groups.entries = entries;
+		groups.size    = size;
+	}
+
+	e = group_slot(groups.entries, groups.size, key, len);
+	if (!e->key) {
+		e->key = malloc(len);
+		if (!e->key) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
+
+		memcpy(e->key, key, len);
+		e->len = len;
+		++groups.used;
+	}
+
+	++e->count;
+}
+
+static void group_record(const struct capture_record_t* r, const char* user, const char* pass)
+{
+	char key[2 * CAPTURE_MAX_STRING + 1];
+	size_t len = 0;
+
+	switch (options.group) {
+		case GROUP_USER:
+			memcpy(key, user, r->user_len);
+			len = r->user_len;
+			break;
+
+		case GROUP_PASSWORD:
+			memcpy(key, pass, r->pass_len);
+			len = r->pass_len;
+			break;
+
+		case GROUP_CREDENTIALS:
+			/* NUL cannot appear in the strings libssh hands over, so it separates the two */
+			memcpy(key, user, r->user_len);
+			key[r->user_len] = 0;
+			memcpy(key + r->user_len + 1, pass, r->pass_len);
+			len = (size_t)r->user_len + 1 + r->pass_len;
+			break;
+
+		case GROUP_SOURCE:
+			format_address(r, r->src_addr, key);
+			len = strlen(key);
+			break;
+
+		case GROUP_NONE:
+		default:
+			return;
+	}
+
+	group_add(key, len);
+}
+
+/* The strings are whatever the client has sent: control characters and backslashes are escaped as in the log */
+static void print_string(const char* s, size_t len)
+{
+	for (size_t i = 0; i < len; ++i) {
+		unsigned char c = (unsigned char)s[i];
+
+		if (c < 0x20 || c == 0x7F || c == '\\') {
+			printf("\\x%02x", c);
+		}
+		else {
+			putchar(c);
+		}
+	}
+}
+
+static void print_record(const struct capture_record_t* r, const char* user, const char* pass)
+{
+	char src[INET6_ADDRSTRLEN];
+	char dst[INET6_ADDRSTRLEN];
+	char timestring[32];
+	struct tm tm;
+	time_t t = (time_t)(r->time_ns / 1000000000);
+
+	format_address(r, r->src_addr, src);
+	format_address(r, r->dst_addr, dst);
+	gmtime_r(&t, &tm);
+	strftime(timestring, sizeof(timestring), "%Y-%m-%dT%H:%M:%SZ", &tm);
+	printf("%s %s:%u -> %s:%u user=", timestring, src, r->src_port, dst, r->dst_port);
+	print_string(user, r->user_len);
+	printf(" password=");
+	print_string(pass, r->pass_len);
+	putchar('\n');
+}
+
+static int matches(const struct capture_record_t* r, const char* user, const char* pass)
+{
+	if (r->time_ns < options.from || r->time_ns >= options.to) {
+		return 0;
+	}
+
+	if (options.user && !string_equals(options.user, user, r->user_len)) {
+		return 0;
+	}
+
+	if (options.pass && !string_equals(options.pass, pass, r->pass_len)) {
+		return 0;
+	}
+
+	if (options.addr) {
+		char src[INET6_ADDRSTRLEN];
+		format_address(r, r->src_addr, src);
+		if (strcmp(options.addr, src)) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* Walks the records of one segment; the mapping is read strictly front to back */
+static void scan(const char* data, size_t size, const char* name)
+{
+	const struct capture_file_header_t* header = (const struct capture_file_header_t*)data;
+	size_t pos;
+
+	if (size < sizeof(*header) || memcmp(header->magic, CAPTURE_MAGIC, sizeof(header->magic))) {
+		fprintf(stderr, "WARNING: %s is not a capture file\n", name);
+		return;
+	}
+
+	if (header->version != CAPTURE_VERSION) {
+		fprintf(stderr, "WARNING: %s: unsupported capture version %u\n", name, header->version);
+		return;
+	}
+
+	if (header->header_size < sizeof(*header) || header->header_size % CAPTURE_ALIGN || header->header_size > size) {
+		fprintf(stderr, "WARNING: %s: corrupt capture header\n", name);
+		return;
+	}
+
+	pos = header->header_size;
+	while (size - pos >= sizeof(struct capture_record_t)) {
+		const struct capture_record_t* r = (const struct capture_record_t*)(data + pos);
+		const char* user = (const char*)(r + 1);
+		const char* pass = user + r->user_len;
+
+		if (r->length < sizeof(*r) || r->length % CAPTURE_ALIGN || r->length > size - pos) {
+			/* The daemon may be in the middle of appending this record */
+			break;
+		}
+
+		/* The daemon never writes longer strings: anything else is a corrupt record, and is skipped */
+		if (
+			   r->type == CAPTURE_AUTH_PASSWORD
+			&& r->user_len <= CAPTURE_MAX_STRING
+			&& r->pass_len <= CAPTURE_MAX_STRING
+			&& sizeof(*r) + r->user_len + r->pass_len <= r->length
+			&& matches(r, user, pass)
+		) {
+			++matched;
+			if (options.group != GROUP_NONE) {
+				group_record(r, user, pass);
+			}
+			else if (!options.count) {
+				print_record(r, user, pass);
+			}
+		}
+
+		pos += r->length;
+	}
+}
+
+static void process_file(const char* name)
+{
+	struct stat st;
+	void* data;
+	int fd = open(name, O_RDONLY | O_CLOEXEC);
+
+	if (fd == -1) {
+		fprintf(stderr, "WARNING: failed to open %s: %s\n", name, strerror(errno));
+		return;
+	}
+
+	if (fstat(fd, &st) == -1 || st.st_size == 0) {
+		close(fd);
+		return;
+	}
+
+	data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		fprintf(stderr, "WARNING: failed to map %s: %s\n", name, strerror(errno));
+		return;
+	}
+
+	madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+	scan((const char*)data, (size_t)st.st_size, name);
+	munmap(data, (size_t)st.st_size);
+}
+
+static int by_count(const void* a, const void* b)
+{
+	const struct group_entry_t* x = (const struct group_entry_t*)a;
+	const struct group_entry_t* y = (const struct group_entry_t*)b;
+	return x->count < y->count ? 1 : (x->count > y->count ? -1 : 0);
+}
+
+static void print_groups(void)
+{
+	size_t n = 0;
+
+	for (size_t i = 0; i < groups.size; ++i) {
+		if (groups.entries[i].key) {
+			groups.entries[n++] = groups.entries[i];
+		}
+	}
+
+	qsort(groups.entries, n, sizeof(struct group_entry_t), by_count);
+	if (options.top && options.top < n) {
+		n = options.top;
+	}
+
+	for (size_t i = 0; i < n; ++i) {
+		const struct group_entry_t* e = &groups.entries[i];
+		printf("%llu\t", e->count);
+		if (options.group == GROUP_CREDENTIALS) {
+			size_t ulen = strlen(e->key);
+			print_string(e->key, ulen);
+			putchar('\t');
+			print_string(e->key + ulen + 1, e->len - ulen - 1);
+		}
+		else {
+			print_string(e->key, e->len);
+		}
+
+		putchar('\n');
+	}
+}
+
+int main(int argc, char** argv)
+{
+	parse_options(argc, argv);
+
+	for (int i = optind; i < argc; ++i) {
+		process_file(argv[i]);
+	}
+
+	if (options.group != GROUP_NONE) {
+		print_groups();
+	}
+	else if (options.count) {
+		printf("%llu\n", matched);
+	}
+
+	return 0;
+}
@@ -0,0 +1,189 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "capture.h"
+#include "globals.h"
+#include "log.h"
+
+struct capture_t {
+	pthread_mutex_t mutex;
+	int fd;
+	int failed;
+	int open_failed;
+	size_t written;
+};
+
+static int64_t realtime_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int open_segment(struct globals_t* g, struct capture_t* c)
+{
+	char path[PATH_MAX];
+	struct capture_file_header_t header;
+	int64_t id = realtime_ns();
+	int fd;
+
+	/* Segments are named after their creation time, so that they sort chronologically */
+	do {
+		snprintf(path, sizeof(path), "%s/capture-%020lld.hpcap", g->capture_dir, (long long int)id++);
+		fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	} while (fd == -1 && errno == EEXIST);
+
+	/* Retried with every record while there is no segment: report once per streak of failures */
+	if (fd == -1) {
+		if (!c->open_failed) {
+			c->open_failed = 1;
+			my_log(LOG_DAEMON | LOG_ERR, "Failed to create the capture segment %s: %s", path, strerror(errno));
+		}
+
+		return -1;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+	header.version     = CAPTURE_VERSION;
+	header.header_size = sizeof(header);
+	if (write(fd, &header, sizeof(header)) != (ssize_t)sizeof(header)) {
+		if (!c->open_failed) {
+			c->open_failed = 1;
+			my_log(LOG_DAEMON | LOG_ERR, "Failed to write to the capture segment %s: %s", path, strerror(errno));
+		}
+
+		close(fd);
+		unlink(path);
+		return -1;
+	}
+
+	if (c->fd != -1) {
+		close(c->fd);
+	}
+
+	c->fd          = fd;
+	c->written     = sizeof(header);
+	c->open_failed = 0;
+	return 0;
+}
+
+static void copy_address(const struct sockaddr_storage* addr, uint8_t* dst, uint16_t* port)
+{
+	if (addr->ss_family == AF_INET) {
+		const struct sockaddr_in* s = (const struct sockaddr_in*)addr;
+		memcpy(dst, &s->sin_addr, sizeof(s->sin_addr));
+		*port = ntohs(s->sin_port);
+	}
+	else if (addr->ss_family == AF_INET6) {
+		const struct sockaddr_in6* s = (const struct sockaddr_in6*)addr;
+		memcpy(dst, &s->sin6_addr, sizeof(s->sin6_addr));
+		*port = ntohs(s->sin6_port);
+	}
+}
+
+int capture_open(struct globals_t* g)
+{
+	struct capture_t* c = calloc(1, sizeof(struct capture_t));
+	if (!c) {
+		return -1;
+	}
+
+	c->fd = -1;
+	if (open_segment(g, c)) {
+		free(c);
+		return -1;
+	}
+
+	pthread_mutex_init(&c->mutex, NULL);
+	g->capture = c;
+	return 0;
+}
+
+void capture_auth_password(struct connection_info_t* conn, const char* user, const char* pass)
+{
+	struct capture_t* c = globals.capture;
+	uint64_t storage[(sizeof(struct capture_record_t) + 2 * CAPTURE_MAX_STRING + CAPTURE_ALIGN) / sizeof(uint64_t)];
+	struct capture_record_t* r = (struct capture_record_t*)storage;
+	size_t user_len;
+	size_t pass_len;
+	size_t length;
+
+	if (!c) {
+		return;
+	}
+
+	user_len = strnlen(user, CAPTURE_MAX_STRING);
+	pass_len = strnlen(pass, CAPTURE_MAX_STRING);
+	length   = (sizeof(struct capture_record_t) + user_len + pass_len + CAPTURE_ALIGN - 1) & ~(size_t)(CAPTURE_ALIGN - 1);
+
+	memset(r, 0, sizeof(struct capture_record_t));
+	r->length   = (uint32_t)length;
+	r->type     = CAPTURE_AUTH_PASSWORD;
+	r->family   = conn->addr.ss_family;
+	r->time_ns  = realtime_ns();
+	r->user_len = (uint16_t)user_len;
+	r->pass_len = (uint16_t)pass_len;
+	copy_address(&conn->addr, r->src_addr, &r->src_port);
+	copy_address(&conn->my_addr, r->dst_addr, &r->dst_port);
+
+	char* p = (char*)(r + 1);
+	memcpy(p, user, user_len);
+	memcpy(p + user_len, pass, pass_len);
+	memset(p + user_len + pass_len, 0, length - sizeof(struct capture_record_t) - user_len - pass_len);
+
+	pthread_mutex_lock(&c->mutex);
+	{
+		/* No segment after a torn record that could not be cut off: try a new one with every record */
+		if (c->fd == -1 || (c->written + length > globals.capture_segment && c->written > sizeof(struct capture_file_header_t))) {
+			open_segment(&globals, c);
+		}
+
+		/* Without a segment, the record is lost; open_segment() has reported why */
+		ssize_t n = c->fd != -1 ? write(c->fd, r, length) : -1;
+
+		if (n == (ssize_t)length) {
+			c->written += length;
+			c->failed   = 0;
+		}
+		else if (c->fd != -1) {
+			int error = n < 0 ? errno : ENOSPC;
+
+			/* Readers stop at a torn record: cut it off, so that the next record follows the last whole one */
+			if (n > 0 && ftruncate(c->fd, (off_t)c->written) == -1) {
+				my_log(LOG_DAEMON | LOG_ERR, "Failed to truncate a partial capture record: %s", strerror(errno));
+				close(c->fd);
+				c->fd = -1;
+			}
+
+			/* Report once per streak of failures */
+			if (!c->failed) {
+				c->failed = 1;
+				my_log(LOG_DAEMON | LOG_ERR, "Failed to write to the capture segment: %s", strerror(error));
+			}
+		}
+	}
+	pthread_mutex_unlock(&c->mutex);
+}
+
+void capture_close(struct globals_t* g)
+{
+	struct capture_t* c = g->capture;
+
+	if (c) {
+		g->capture = NULL;
+		if (c->fd != -1) {
+			close(c->fd);
+		}
+
+		pthread_mutex_destroy(&c->mutex);
+		free(c);
+	}
+}
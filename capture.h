@@ -0,0 +1,54 @@
+#ifndef CAPTURE_H_
+#define CAPTURE_H_
+
+#include <stdint.h>
+
+/*
+ * Capture segment layout (host byte order):
+ *   struct capture_file_header_t
+ *   struct capture_record_t, followed by user_len bytes of the username
+ *   and pass_len bytes of the password, padded to CAPTURE_ALIGN bytes
+ *   ... repeated until the end of the file
+ * A segment is only ever appended to; a truncated last record is ignored by readers.
+ */
+
+#define CAPTURE_MAGIC        "HPCAP\r\n\032"
+#define CAPTURE_VERSION      1
+#define CAPTURE_ALIGN        8
+#define CAPTURE_MAX_STRING   1024
+
+#define CAPTURE_AUTH_PASSWORD 1
+
+struct capture_file_header_t {
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;
+};
+
+struct capture_record_t {
+	uint32_t length;        /* the whole record including padding */
+	uint16_t type;
+	uint16_t family;        /* AF_INET or AF_INET6 */
+	int64_t  time_ns;       /* CLOCK_REALTIME */
+	uint8_t  src_addr[16];  /* IPv4 addresses use the first 4 bytes */
+	uint8_t  dst_addr[16];
+	uint16_t src_port;
+	uint16_t dst_port;
+	uint16_t user_len;
+	uint16_t pass_len;
+};
+
+_Static_assert(sizeof(struct capture_record_t) == 56, "capture record header must be 56 bytes");
+
+#ifndef CAPTURE_FORMAT_ONLY
+
+struct globals_t;
+struct connection_info_t;
+
+int capture_open(struct globals_t* g);
+void capture_auth_password(struct connection_info_t* conn, const char* user, const char* pass);
+void capture_close(struct globals_t* g);
+
+#endif
+
+#endif /* CAPTURE_H_ */
@@ -11,14 +11,50 @@
 #include <limits.h>
 #include "cmdline.h"
 #include "globals.h"
+#include "log.h"
+#include "crypto.h"
 
 static struct option long_options[] = {
 	{ "rsa-key",    required_argument, 0, 'r' },
 	{ "dsa-key",    required_argument, 0, 'd' },
 	{ "ecdsa-key",  required_argument, 0, 'e' },
 	{ "host-key",   required_argument, 0, 'k' },
+	{ "key-cache",  required_argument, 0, 'K' },
+	{ "key-type",   required_argument, 0, 'y' },
+	{ "crypto",     required_argument, 0, 'c' },
 	{ "address",    required_argument, 0, 'b' },
 	{ "port",       required_argument, 0, 'p' },
+	{ "event-loops", required_argument, 0, 'E' },
+	{ "acceptors",  required_argument, 0, 'R' },
+	{ "reuseport-bpf", no_argument,    0, 'B' },
+	{ "backlog",    required_argument, 0, 'l' },
+	{ "defer-accept", required_argument, 0, 'a' },
+	{ "busy-poll",  required_argument, 0, 'U' },
+	{ "sniff-timeout", required_argument, 0, 'S' },
+	{ "idle-timeout", required_argument, 0, 'i' },
+	{ "auth-timeout", required_argument, 0, 'G' },
+	{ "session-lifetime", required_argument, 0, 'H' },
+	{ "shutdown-timeout", required_argument, 0, 's' },
+	{ "max-sessions", required_argument, 0, 'o' },
+	{ "max-kex",    required_argument, 0, 'X' },
+	{ "kex-wait",   required_argument, 0, 'w' },
+	{ "workers",    required_argument, 0, 'W' },
+	{ "queue-depth", required_argument, 0, 'Q' },
+	{ "overflow",   required_argument, 0, 'O' },
+	{ "log-queue",  required_argument, 0, 'L' },
+	{ "log-overflow", required_argument, 0, 'D' },
+	{ "log-format", required_argument, 0, 'F' },
+	{ "capture",    required_argument, 0, 'C' },
+	{ "capture-segment", required_argument, 0, 'Z' },
+	{ "aggregate",  required_argument, 0, 'A' },
+	{ "aggregate-interval", required_argument, 0, 'I' },
+	{ "max-per-ip", required_argument, 0, 'm' },
+	{ "ip-rate",    required_argument, 0, 't' },
+	{ "ip-burst",   required_argument, 0, 'T' },
+	{ "metrics",    required_argument, 0, 'M' },
+	{ "tarpit",     required_argument, 0, 'j' },
+	{ "tarpit-delay", required_argument, 0, 'J' },
+	{ "tarpit-max", required_argument, 0, 'N' },
 #ifndef MINIMALISTIC_BUILD
 	{ "pid",        required_argument, 0, 'P' },
 	{ "name",       required_argument, 0, 'n' },
@@ -42,8 +78,81 @@ static void usage(struct globals_t* g)
 		"Low-interaction SSH honeypot\n\n"
 		"Mandatory arguments to long options are mandatory for short options too.\n"
 		"  -k, --host-key FILE   the file containing the private host key (RSA, DSA, ECDSA, ED25519)\n"
-		"  -b, --address ADDRESS the IP address to bind to (default: 0.0.0.0)\n"
-		"  -p, --port PORT       the port to bind to (default: 22)\n"
+		"  -K, --key-cache FILE  when no -k is given, keep the generated host key in FILE\n"
+		"                        and reuse it on the next start\n"
+		"  -y, --key-type TYPE   the type of the generated host key: rsa or ed25519\n"
+		"                        (default: ed25519 with --crypto cheap, rsa otherwise)\n"
+		"  -c, --crypto PROFILE  the algorithms to offer: default (those of libssh), cheap\n"
+		"                        (curve25519, ed25519, chacha20 / AES-GCM: the least CPU\n"
+		"                        per handshake) or compat (everything OpenSSH offers)\n"
+		"  -b, --address ADDRESS the IP address to bind to (default: 0.0.0.0); may be\n"
+		"                        repeated\n"
+		"  -p, --port PORT       the port to bind to (default: 22); may be repeated, every\n"
+		"                        address is bound on every port\n"
+		"  -E, --event-loops N   multiplex sessions over N event-loop threads instead of\n"
+		"                        running one thread per connection (default: 0, disabled);\n"
+		"                        auto: one per CPU available to the cgroup\n"
+		"  -R, --acceptors N     accept connections on N SO_REUSEPORT sockets, each served\n"
+		"                        by its own thread pinned to its own CPU (default: 1)\n"
+		"  -B, --reuseport-bpf   distribute connections between the acceptors by the hash\n"
+		"                        of the source address instead of the kernel's default\n"
+		"  -l, --backlog N       the size of the listen queue (default: 1024, capped by\n"
+		"                        net.core.somaxconn)\n"
+		"  -a, --defer-accept SEC  accept connections only once the client has sent data,\n"
+		"                        or after SEC seconds (default: 0, accept immediately)\n"
+		"  -U, --busy-poll USEC  busy-poll the device queue for up to USEC microseconds\n"
+		"                        when reading from sessions (default: 0, disabled)\n"
+		"  -S, --sniff-timeout MS  drop clients that send nothing for MS milliseconds, and\n"
+		"                        clients that speak another protocol (default: 5000;\n"
+		"                        0 disables the check)\n"
+		"  -i, --idle-timeout SEC  close sessions idle for SEC seconds (default: 120;\n"
+		"                        0 disables the limit)\n"
+		"  -G, --auth-timeout SEC  close sessions in which no password has been tried\n"
+		"                        within SEC seconds (default: 120; 0 disables the limit)\n"
+		"  -H, --session-lifetime SEC  close sessions after SEC seconds, however busy\n"
+		"                        (default: 0, unlimited)\n"
+		"  -s, --shutdown-timeout SEC  on shutdown, give sessions SEC seconds to close\n"
+		"                        before force-closing them (default: 10)\n"
+		"  -o, --max-sessions N  serve at most N sessions at once (default: auto, what the\n"
+		"                        cgroup memory limit allows, or 100 without an event loop)\n"
+		"  -X, --max-kex N       run at most N key exchanges at once, queueing the rest\n"
+		"                        (default: auto, 4 per CPU under a cgroup CPU quota, else 0,\n"
+		"                        unlimited)\n"
+		"  -w, --kex-wait MS     drop sessions that have waited MS milliseconds for a key\n"
+		"                        exchange slot; 0 drops them at once (default: 10000)\n"
+		"  -W, --workers N       serve sessions from a pool of N long-lived worker threads\n"
+		"                        instead of one thread per connection (default: 0, disabled);\n"
+		"                        auto: as many as the cgroup memory limit allows\n"
+		"  -Q, --queue-depth N   the number of accepted sessions that may wait for a pooled\n"
+		"                        worker (default: twice the number of workers)\n"
+		"  -O, --overflow POLICY what to do when the queue is full: drop the connection\n"
+		"                        (drop, default) or wait up to MS milliseconds (wait:MS)\n"
+		"  -L, --log-queue N     write log messages from a dedicated thread through a queue\n"
+		"                        of N messages (default: 0, log synchronously)\n"
+		"  -D, --log-overflow POLICY  what to do when the log queue is full: drop the\n"
+		"                        message (drop, default) or wait for the writer (wait)\n"
+		"  -F, --log-format FORMAT  log events as plain text (text, default)\n"
+		"                        or as one JSON object per line (json)\n"
+		"  -C, --capture DIR     also append every login attempt to binary capture files\n"
+		"                        in DIR (read them with ssh-honeypotd-capture)\n"
+		"  -Z, --capture-segment MB  start a new capture file after MB megabytes\n"
+		"                        (default: 64)\n"
+		"  -A, --aggregate N     log only the first attempt with the same user, password\n"
+		"                        and source, and roll up the repeats, tracking at most\n"
+		"                        N combinations (default: 0, log every attempt)\n"
+		"  -I, --aggregate-interval SEC  how often to log the rollups (default: 60)\n"
+		"  -m, --max-per-ip N    allow at most N concurrent sessions from one IP address\n"
+		"                        (default: 0, unlimited)\n"
+		"  -t, --ip-rate N       allow at most N new connections per minute from one IP\n"
+		"                        address (default: 0, unlimited)\n"
+		"  -T, --ip-burst N      allow bursts of up to N connections above --ip-rate\n"
+		"                        (default: the value of --ip-rate)\n"
+		"  -M, --metrics ADDRESS serve Prometheus metrics on a unix socket (an absolute\n"
+		"                        path) or on a TCP port of 127.0.0.1 (a port number)\n"
+		"  -j, --tarpit PORT     also listen on PORT and hold the clients there with an\n"
+		"                        endless stream of lines before the SSH banner\n"
+		"  -J, --tarpit-delay SEC  send a tarpit line every SEC seconds (default: 10)\n"
+		"  -N, --tarpit-max N    hold at most N tarpit clients at once (default: 4096)\n"
 #ifndef MINIMALISTIC_BUILD
 		"  -P, --pid FILE        the PID file\n"
 		"                        (if not specified, the daemon will run in the foreground)\n"
@@ -106,6 +215,63 @@ static char* my_strdup(const char *s)
 	return retval;
 }
 
+/* -b and -p may be repeated */
+static void append(char*** list, size_t* n, const char* value)
+{
+	char** p = realloc(*list, (*n + 1) * sizeof(char*));
+	check_alloc(p, "realloc");
+	p[(*n)++] = my_strdup(value);
+	*list     = p;
+}
+
+static unsigned long parse_number(const char* s, const char* option, unsigned long max)
+{
+	char* end;
+	unsigned long value;
+
+	errno = 0;
+	value = strtoul(s, &end, 10);
+	if (errno || !*s || *s == '-' || *end || value > max) {
+		fprintf(stderr, "ERROR: invalid value for %s: %s\n", option, s);
+		exit(EXIT_FAILURE);
+	}
+
+	return value;
+}
+
+/* For options where 0 has no meaning: it is what tells set_defaults() that the option has not been given */
+static unsigned long parse_positive(const char* s, const char* option, unsigned long max)
+{
+	unsigned long value = parse_number(s, option, max);
+	if (!value) {
+		fprintf(stderr, "ERROR: invalid value for %s: %s\n", option, s);
+		exit(EXIT_FAILURE);
+	}
+
+	return value;
+}
+
+/* A number, or "auto" to derive the limit from the resources of the process */
+static size_t parse_limit(const char* s, const char* option, unsigned long max)
+{
+	return !strcmp(s, "auto") ? AUTO_SIZE : parse_number(s, option, max);
+}
+
+static void handle_overflow_policy(const char* policy, struct globals_t* g)
+{
+	if (!strcmp(policy, "drop")) {
+		g->overflow_wait = 0;
+	}
+	else if (!strncmp(policy, "wait:", 5)) {
+		g->overflow_wait    = 1;
+		g->overflow_timeout = (long int)parse_number(policy + 5, "--overflow", 3600000);
+	}
+	else {
+		fprintf(stderr, "ERROR: invalid value for --overflow: %s\n", policy);
+		exit(EXIT_FAILURE);
+	}
+}
+
 static void resolve_pid_file(struct globals_t* g)
 {
 #ifndef MINIMALISTIC_BUILD
@@ -160,12 +326,76 @@ static void resolve_pid_file(struct globals_t* g)
 
 static void set_defaults(struct globals_t* g)
 {
-	if (!g->bind_address) {
-		g->bind_address = my_strdup("0.0.0.0");
+	if (!g->n_bind_addresses) {
+		append(&g->bind_addresses, &g->n_bind_addresses, "0.0.0.0");
+	}
+
+	if (!g->n_bind_ports) {
+		append(&g->bind_ports, &g->n_bind_ports, "22");
+	}
+
+	if (!g->crypto_profile) {
+		g->crypto_profile = find_crypto_profile("default");
+	}
+
+	if (!g->key_type) {
+		g->key_type = !strcmp(g->crypto_profile->name, "cheap") ? SSH_KEYTYPE_ED25519 : SSH_KEYTYPE_RSA;
+	}
+
+	if (!strcmp(g->crypto_profile->name, "cheap") && (g->rsa_key || g->dsa_key || g->ecdsa_key) && !g->ed25519_key) {
+		fprintf(stderr, "WARNING: the cheap crypto profile offers only ED25519 host keys, but none has been given with -k\n");
+	}
+
+	if (!g->acceptors) {
+		g->acceptors = 1;
+	}
+
+	if (!g->backlog) {
+		g->backlog = 1024;
+	}
+
+	if (g->sniff_timeout < 0) {
+		g->sniff_timeout = 5000;
+	}
+
+	if (g->idle_timeout < 0) {
+		g->idle_timeout = 120;
+	}
+
+	if (g->auth_timeout < 0) {
+		g->auth_timeout = 120;
+	}
+
+	if (g->shutdown_timeout < 0) {
+		g->shutdown_timeout = 10;
+	}
+
+	if (g->kex_wait < 0) {
+		g->kex_wait = 10000;
+	}
+
+	if (g->workers && g->workers != AUTO_SIZE && !g->queue_depth) {
+		g->queue_depth = 2 * g->workers;
+	}
+
+	if (!g->ip_burst) {
+		g->ip_burst = g->ip_rate;
+	}
+
+	if (!g->tarpit_delay) {
+		g->tarpit_delay = 10;
 	}
 
-	if (!g->bind_port) {
-		g->bind_port = my_strdup("22");
+	if (!g->tarpit_max) {
+		g->tarpit_max = 4096;
+	}
+
+	if (!g->aggregate_interval) {
+		g->aggregate_interval = 60;
+	}
+
+	if (!g->capture_segment) {
+		g->capture_segment = (size_t)64 << 20;
 	}
 
 #ifndef MINIMALISTIC_BUILD
@@ -231,9 +461,9 @@ void parse_options(int argc, char** argv, struct globals_t* g)
 			argc,
 			argv,
 #ifndef MINIMALISTIC_BUILD
-			"r:d:e:k:b:p:P:n:u:g:xfvh",
+			"r:d:e:k:K:y:c:b:p:E:R:Bl:a:U:S:i:G:H:s:o:X:w:W:Q:O:L:D:F:C:Z:A:I:m:t:T:M:j:J:N:P:n:u:g:xfvh",
 #else
-			"r:d:e:k:b:p:vh",
+			"r:d:e:k:K:y:c:b:p:E:R:Bl:a:U:S:i:G:H:s:o:X:w:W:Q:O:L:D:F:C:Z:A:I:m:t:T:M:j:J:N:vh",
 #endif
 			long_options,
 			&option_index
@@ -251,14 +481,197 @@ void parse_options(int argc, char** argv, struct globals_t* g)
 				handle_server_key(optarg, g);
 				break;
 
+			case 'K':
+				free(g->key_cache);
+				g->key_cache = my_strdup(optarg);
+				break;
+
+			case 'c':
+				g->crypto_profile = find_crypto_profile(optarg);
+				if (!g->crypto_profile) {
+					fprintf(stderr, "ERROR: invalid value for --crypto: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+
+				break;
+
+			case 'y':
+				if (!strcmp(optarg, "rsa")) {
+					g->key_type = SSH_KEYTYPE_RSA;
+				}
+				else if (!strcmp(optarg, "ed25519")) {
+					g->key_type = SSH_KEYTYPE_ED25519;
+				}
+				else {
+					fprintf(stderr, "ERROR: invalid value for --key-type: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+
+				break;
+
 			case 'b':
-				free(g->bind_address);
-				g->bind_address = my_strdup(optarg);
+				append(&g->bind_addresses, &g->n_bind_addresses, optarg);
 				break;
 
 			case 'p':
-				free(g->bind_port);
-				g->bind_port = my_strdup(optarg);
+				append(&g->bind_ports, &g->n_bind_ports, optarg);
+				break;
+
+			case 'E':
+				g->event_loops = parse_limit(optarg, "--event-loops", 1024);
+				break;
+
+			case 'R':
+				g->acceptors = parse_positive(optarg, "--acceptors", 1024);
+				break;
+
+			case 'B':
+				g->reuseport_bpf = 1;
+				break;
+
+			case 'l':
+				g->backlog = (int)parse_positive(optarg, "--backlog", 65535);
+				break;
+
+			case 'a':
+				g->defer_accept = (int)parse_number(optarg, "--defer-accept", 3600);
+				break;
+
+			case 'U':
+				g->busy_poll = (int)parse_number(optarg, "--busy-poll", 1000000);
+				break;
+
+			case 'S':
+				g->sniff_timeout = (long int)parse_number(optarg, "--sniff-timeout", 120000);
+				break;
+
+			case 'i':
+				g->idle_timeout = (long int)parse_number(optarg, "--idle-timeout", 86400);
+				break;
+
+			case 'G':
+				g->auth_timeout = (long int)parse_number(optarg, "--auth-timeout", 86400);
+				break;
+
+			case 'H':
+				g->session_lifetime = (long int)parse_number(optarg, "--session-lifetime", 604800);
+				break;
+
+			case 's':
+				g->shutdown_timeout = (long int)parse_number(optarg, "--shutdown-timeout", 3600);
+				break;
+
+			case 'o':
+				g->max_sessions = parse_limit(optarg, "--max-sessions", 1048576);
+				if (!g->max_sessions) {
+					fprintf(stderr, "ERROR: invalid value for --max-sessions: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+
+				break;
+
+			case 'X':
+				g->max_kex = parse_limit(optarg, "--max-kex", 65536);
+				break;
+
+			case 'w':
+				g->kex_wait = (long int)parse_number(optarg, "--kex-wait", 120000);
+				break;
+
+			case 'W':
+				g->workers = parse_limit(optarg, "--workers", 65536);
+				break;
+
+			case 'Q':
+				g->queue_depth = parse_positive(optarg, "--queue-depth", 1048576);
+				break;
+
+			case 'O':
+				handle_overflow_policy(optarg, g);
+				break;
+
+			case 'L':
+				g->log_queue = parse_number(optarg, "--log-queue", 1048576);
+				break;
+
+			case 'D':
+				if (!strcmp(optarg, "drop") || !strcmp(optarg, "wait")) {
+					g->log_overflow_wait = optarg[0] == 'w';
+				}
+				else {
+					fprintf(stderr, "ERROR: invalid value for --log-overflow: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+
+				break;
+
+			case 'F':
+				if (!strcmp(optarg, "text") || !strcmp(optarg, "json")) {
+					g->log_format = optarg[0] == 'j' ? LOG_FORMAT_JSON : LOG_FORMAT_TEXT;
+				}
+				else {
+					fprintf(stderr, "ERROR: invalid value for --log-format: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+
+				break;
+
+			case 'C':
+				/* Segments are created after daemon() has changed to / */
+				free(g->capture_dir);
+				g->capture_dir = realpath(optarg, NULL);
+				if (!g->capture_dir) {
+					fprintf(stderr, "ERROR: invalid value for --capture: %s: %s\n", optarg, strerror(errno));
+					exit(EXIT_FAILURE);
+				}
+
+				break;
+
+			case 'Z':
+				g->capture_segment = (size_t)parse_positive(optarg, "--capture-segment", 4096) << 20;
+				break;
+
+			case 'A':
+				g->aggregate = parse_number(optarg, "--aggregate", 16777216);
+				break;
+
+			case 'I':
+				g->aggregate_interval = parse_positive(optarg, "--aggregate-interval", 86400);
+				break;
+
+			case 'm':
+				g->max_per_ip = parse_number(optarg, "--max-per-ip", 65536);
+				break;
+
+			case 't':
+				g->ip_rate = parse_number(optarg, "--ip-rate", 1000000);
+				break;
+
+			case 'T':
+				g->ip_burst = parse_positive(optarg, "--ip-burst", 1000000);
+				break;
+
+			case 'M':
+				if (optarg[0] != '/') {
+					parse_number(optarg, "--metrics", 65535);
+				}
+
+				free(g->metrics_address);
+				g->metrics_address = my_strdup(optarg);
+				break;
+
+			case 'j':
+				parse_number(optarg, "--tarpit", 65535);
+				free(g->tarpit_port);
+				g->tarpit_port = my_strdup(optarg);
+				break;
+
+			case 'J':
+				g->tarpit_delay = (int)parse_positive(optarg, "--tarpit-delay", 255);
+				break;
+
+			case 'N':
+				g->tarpit_max = parse_positive(optarg, "--tarpit-max", 1048576);
 				break;
 
 #ifndef MINIMALISTIC_BUILD
@@ -332,6 +745,11 @@ void parse_options(int argc, char** argv, struct globals_t* g)
 		++optind;
 	}
 
+	if (g->event_loops && g->workers) {
+		fprintf(stderr, "ERROR: --event-loops and --workers are mutually exclusive\n");
+		exit(EXIT_FAILURE);
+	}
+
 	set_defaults(g);
 	resolve_pid_file(g);
 
@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <string.h>
+#include <libssh/libssh.h>
+#include <libssh/server.h>
+#include "crypto.h"
+
+/*
+ * NULL leaves libssh's defaults. Algorithms unknown to the libssh in use are dropped by libssh itself,
+ * so the lists can name everything a profile should offer.
+ */
+static const struct crypto_profile_t profiles[] = {
+	{ "default", NULL, NULL, NULL, NULL },
+
+	/*
+	 * One X25519 exchange, one Ed25519 signature and an AEAD cipher (no separate MAC pass):
+	 * the least CPU per handshake. Clients that support none of these fail the key exchange.
+	 */
+	{
+		"cheap",
+		"curve25519-sha256,curve25519-sha256@libssh.org",
+		"ssh-ed25519",
+		"chacha20-poly1305@openssh.com,aes128-gcm@openssh.com",
+		"hmac-sha2-256-etm@openssh.com,hmac-sha2-256"
+	},
+
+	/* What a stock OpenSSH server offers, legacy algorithms included: realistic, but clients may pick expensive DH groups */
+	{
+		"compat",
+		"curve25519-sha256,curve25519-sha256@libssh.org,ecdh-sha2-nistp256,ecdh-sha2-nistp384,ecdh-sha2-nistp521,"
+		"diffie-hellman-group-exchange-sha256,diffie-hellman-group16-sha512,diffie-hellman-group18-sha512,"
+		"diffie-hellman-group14-sha256,diffie-hellman-group14-sha1,diffie-hellman-group1-sha1",
+		"ssh-ed25519,ecdsa-sha2-nistp256,ecdsa-sha2-nistp384,ecdsa-sha2-nistp521,rsa-sha2-512,rsa-sha2-256,ssh-rsa,ssh-dss",
+		"chacha20-poly1305@openssh.com,aes128-ctr,aes192-ctr,aes256-ctr,aes128-gcm@openssh.com,aes256-gcm@openssh.com,"
+		"aes256-cbc,aes192-cbc,aes128-cbc,3des-cbc",
+		"hmac-sha2-256-etm@openssh.com,hmac-sha2-512-etm@openssh.com,hmac-sha1-etm@openssh.com,hmac-sha2-256,hmac-sha2-512,hmac-sha1"
+	}
+};
+
+const struct crypto_profile_t* find_crypto_profile(const char* name)
+{
+	for (size_t i = 0; i < sizeof(profiles) / sizeof(profiles[0]); ++i) {
+		if (!strcmp(name, profiles[i].name)) {
+			return &profiles[i];
+		}
+	}
+
+	return NULL;
+}
+
+#if LIBSSH_VERSION_INT >= SSH_VERSION_INT(0, 9, 0)
+static int set_list(ssh_bind sshbind, enum ssh_bind_options_e option, const char* list, const char* what)
+{
+	if (list && ssh_bind_options_set(sshbind, option, list) != SSH_OK) {
+		fprintf(stderr, "ERROR: none of the %s of the crypto profile is supported by libssh: %s\n", what, ssh_get_error(sshbind));
+		return -1;
+	}
+
+	return 0;
+}
+#endif
+
+int apply_crypto_profile(ssh_bind sshbind, const struct crypto_profile_t* profile)
+{
+#if LIBSSH_VERSION_INT >= SSH_VERSION_INT(0, 9, 0)
+	return
+		   set_list(sshbind, SSH_BIND_OPTIONS_KEY_EXCHANGE,       profile->kex,      "key exchange methods")
+		|| set_list(sshbind, SSH_BIND_OPTIONS_HOSTKEY_ALGORITHMS, profile->hostkeys, "host key algorithms")
+		|| set_list(sshbind, SSH_BIND_OPTIONS_CIPHERS_C_S,        profile->ciphers,  "ciphers")
+		|| set_list(sshbind, SSH_BIND_OPTIONS_CIPHERS_S_C,        profile->ciphers,  "ciphers")
+		|| set_list(sshbind, SSH_BIND_OPTIONS_HMAC_C_S,           profile->macs,     "MACs")
+		|| set_list(sshbind, SSH_BIND_OPTIONS_HMAC_S_C,           profile->macs,     "MACs")
+		? -1 : 0;
+#else
+	(void)sshbind;
+	if (profile->kex) {
+		fprintf(stderr, "ERROR: crypto profiles require libssh 0.9.0 or newer\n");
+		return -1;
+	}
+
+	return 0;
+#endif
+}
@@ -0,0 +1,17 @@
+#ifndef CRYPTO_H_
+#define CRYPTO_H_
+
+#include <libssh/server.h>
+
+struct crypto_profile_t {
+	const char* name;
+	const char* kex;
+	const char* hostkeys;
+	const char* ciphers;
+	const char* macs;
+};
+
+const struct crypto_profile_t* find_crypto_profile(const char* name);
+int apply_crypto_profile(ssh_bind sshbind, const struct crypto_profile_t* profile);
+
+#endif /* CRYPTO_H_ */
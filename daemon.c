@@ -1,14 +1,40 @@
 #include <stddef.h>
+#include <stdint.h>
+#include <errno.h>
 #include <signal.h>
 #include <unistd.h>
 #include <pwd.h>
 #include <grp.h>
 #include "daemon.h"
 #include "globals.h"
+#include "handover.h"
 
-static void signal_handler(int signal)
+static void signal_handler(int signal, siginfo_t* info, void* context)
 {
-	globals.terminate = 1;
+	if (signal == SIGTERM && info && handover_signal(info)) {
+		handover_confirmed(&globals);
+	}
+
+	request_shutdown(&globals);
+}
+
+/* SIGUSR1 and SIGHUP only raise a flag: the first acceptor watches control_fd and does the (non signal-safe) work */
+static void control_handler(int signal)
+{
+	uint64_t value = 1;
+	int saved      = errno;
+	ssize_t n;
+
+	if (signal == SIGHUP) {
+		globals.restart = 1;
+	}
+	else {
+		globals.dump_latency = 1;
+	}
+
+	n = write(globals.control_fd, &value, sizeof(value));
+	(void)n;
+	errno = saved;
 }
 
 void set_signals(void)
@@ -16,15 +42,21 @@ void set_signals(void)
 	#pragma clang diagnostic push
 	#pragma clang diagnostic ignored "-Wdisabled-macro-expansion"
 	struct sigaction sa;
-	sa.sa_handler = signal_handler;
+	sa.sa_sigaction = signal_handler;
 	sigemptyset(&sa.sa_mask);
-	sa.sa_flags = 0;
+	sa.sa_flags = SA_SIGINFO;
 	sigaction(SIGTERM, &sa, NULL);
 	sigaction(SIGQUIT, &sa, NULL);
 	sigaction(SIGINT,  &sa, NULL);
 
+	sa.sa_handler = control_handler;
+	sa.sa_flags   = 0;
+	sigaction(SIGUSR1, &sa, NULL);
+	sigaction(SIGHUP,  &sa, NULL);
+
+	/* The successor started on SIGHUP is reaped automatically */
 	sa.sa_handler = SIG_IGN;
-	sigaction(SIGHUP, &sa, NULL);
+	sigaction(SIGCHLD, &sa, NULL);
 	#pragma clang diagnostic pop
 }
 
@@ -0,0 +1,303 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "events.h"
+#include "globals.h"
+#include "log.h"
+
+/* Room left for the closing quote and brace when a TEXT field is cut */
+#define CLOSING_RESERVE 4
+
+struct field_t {
+	const char* name;
+	const char* str;
+	size_t limit;
+	int num;
+	int is_str;
+};
+
+/* Output buffer; appends past the capacity are cut, and the buffer is always NUL-terminated */
+struct ebuf_t {
+	char* p;
+	size_t len;
+	size_t cap;
+};
+
+static void put(struct ebuf_t* b, const char* s, size_t n)
+{
+	if (n > b->cap - b->len) {
+		n = b->cap - b->len;
+	}
+
+	memcpy(b->p + b->len, s, n);
+	b->len += n;
+}
+
+static void put_str(struct ebuf_t* b, const char* s)
+{
+	put(b, s, strlen(s));
+}
+
+static void put_int(struct ebuf_t* b, int n)
+{
+	char tmp[16];
+	int len = snprintf(tmp, sizeof(tmp), "%d", n);
+	put(b, tmp, (size_t)len);
+}
+
+/* Length of the valid UTF-8 sequence at s, or 0 if there is none */
+static size_t utf8_sequence(const unsigned char* s, const unsigned char* end)
+{
+	size_t n;
+	unsigned char lo = 0x80;
+	unsigned char hi = 0xBF;
+
+	if (s[0] >= 0xC2 && s[0] <= 0xDF) {
+		n = 2;
+	}
+	else if (s[0] >= 0xE0 && s[0] <= 0xEF) {
+		n  = 3;
+		lo = s[0] == 0xE0 ? 0xA0 : 0x80;
+		hi = s[0] == 0xED ? 0x9F : 0xBF;
+	}
+	else if (s[0] >= 0xF0 && s[0] <= 0xF4) {
+		n  = 4;
+		lo = s[0] == 0xF0 ? 0x90 : 0x80;
+		hi = s[0] == 0xF4 ? 0x8F : 0xBF;
+	}
+	else {
+		return 0;
+	}
+
+	if ((size_t)(end - s) < n || s[1] < lo || s[1] > hi) {
+		return 0;
+	}
+
+	for (size_t i = 2; i < n; ++i) {
+		if (s[i] < 0x80 || s[i] > 0xBF) {
+			return 0;
+		}
+	}
+
+	return n;
+}
+
+static size_t string_budget(const struct ebuf_t* b, size_t limit)
+{
+	size_t room = b->cap - b->len;
+	room = room > CLOSING_RESERVE ? room - CLOSING_RESERVE : 0;
+	return limit && limit < room ? limit : room;
+}
+
+/*
+ * JSON string: quotes, backslashes and control characters are escaped,
+ * bytes that do not form valid UTF-8 are emitted as \u00XX so that the output is always valid JSON.
+ * Runs of safe characters are copied at once.
+ */
+static void put_json_string(struct ebuf_t* b, const char* str, size_t limit)
+{
+	static const char hex[] = "0123456789abcdef";
+	const unsigned char* s   = (const unsigned char*)(str ? str : "");
+	const unsigned char* end = s + strlen((const char*)s);
+	size_t budget;
+
+	put(b, "\"", 1);
+	budget = string_budget(b, limit);
+
+	while (s < end) {
+		const unsigned char* run = s;
+		size_t seq;
+
+		while (s < end && s[0] >= 0x20 && s[0] < 0x7F && s[0] != '"' && s[0] != '\\') {
+			++s;
+		}
+
+		if ((size_t)(s - run) > budget) {
+			put(b, (const char*)run, budget);
+			break;
+		}
+
+		put(b, (const char*)run, (size_t)(s - run));
+		budget -= (size_t)(s - run);
+		if (s == end) {
+			break;
+		}
+
+		if (s[0] >= 0x80 && (seq = utf8_sequence(s, end)) != 0) {
+			if (seq > budget) {
+				break;
+			}
+
+			put(b, (const char*)s, seq);
+			budget -= seq;
+			s      += seq;
+			continue;
+		}
+
+		char esc[6] = { '\\', 'u', '0', '0', hex[s[0] >> 4], hex[s[0] & 0x0F] };
+		size_t len  = 6;
+		switch (s[0]) {
+			case '"':  esc[1] = '"';  len = 2; break;
+			case '\\': esc[1] = '\\'; len = 2; break;
+			case '\n': esc[1] = 'n';  len = 2; break;
+			case '\r': esc[1] = 'r';  len = 2; break;
+			case '\t': esc[1] = 't';  len = 2; break;
+			default: break;
+		}
+
+		if (len > budget) {
+			break;
+		}
+
+		put(b, esc, len);
+		budget -= len;
+		++s;
+	}
+
+	put(b, "\"", 1);
+}
+
+/* Plain text: control characters and backslashes are escaped as \xNN so that one event is always one line */
+static void put_text_string(struct ebuf_t* b, const char* str, size_t limit)
+{
+	static const char hex[] = "0123456789abcdef";
+	const unsigned char* s  = (const unsigned char*)(str ? str : "");
+	size_t budget           = string_budget(b, limit);
+
+	while (*s && budget) {
+		const unsigned char* run = s;
+
+		while (*s && *s >= 0x20 && *s != 0x7F && *s != '\\') {
+			++s;
+		}
+
+		if ((size_t)(s - run) >= budget) {
+			put(b, (const char*)run, budget);
+			break;
+		}
+
+		put(b, (const char*)run, (size_t)(s - run));
+		budget -= (size_t)(s - run);
+		if (*s) {
+			char esc[4] = { '\\', 'x', hex[*s >> 4], hex[*s & 0x0F] };
+			if (budget < sizeof(esc)) {
+				break;
+			}
+
+			put(b, esc, sizeof(esc));
+			budget -= sizeof(esc);
+			++s;
+		}
+	}
+}
+
+static void put_timestamp(struct ebuf_t* b)
+{
+	struct timespec ts;
+	struct tm tm;
+	char tmp[32];
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	gmtime_r(&ts.tv_sec, &tm);
+	size_t len = strftime(tmp, sizeof(tmp), "%Y-%m-%dT%H:%M:%S", &tm);
+	len += (size_t)snprintf(tmp + len, sizeof(tmp) - len, ".%03ldZ", ts.tv_nsec / 1000000);
+	put(b, tmp, len);
+}
+
+static void encode_json(struct ebuf_t* b, const char* event, const struct field_t* fields, size_t n)
+{
+	put_str(b, "{\"ts\":\"");
+	put_timestamp(b);
+	put_str(b, "\",\"event\":\"");
+	put_str(b, event);
+	put(b, "\"", 1);
+
+	for (size_t i = 0; i < n; ++i) {
+		put(b, ",\"", 2);
+		put_str(b, fields[i].name);
+		put(b, "\":", 2);
+		if (fields[i].is_str) {
+			put_json_string(b, fields[i].str, fields[i].limit);
+		}
+		else {
+			put_int(b, fields[i].num);
+		}
+	}
+
+	put(b, "}", 1);
+}
+
+static void encode_text(struct ebuf_t* b, const char* text, const struct field_t* fields, size_t n)
+{
+	size_t i = 0;
+
+	while (*text) {
+		const char* p = strchr(text, '%');
+		if (!p) {
+			put_str(b, text);
+			break;
+		}
+
+		put(b, text, (size_t)(p - text));
+		if ((p[1] == 's' || p[1] == 'd') && i < n) {
+			if (fields[i].is_str) {
+				put_text_string(b, fields[i].str, fields[i].limit);
+			}
+			else {
+				put_int(b, fields[i].num);
+			}
+
+			++i;
+			text = p + 2;
+		}
+		else {
+			put(b, p, 1);
+			text = p + 1;
+		}
+	}
+}
+
+static size_t encode(char* buf, size_t size, const char* event, const char* text, const struct field_t* fields, size_t n)
+{
+	struct ebuf_t b = { buf, 0, size - 1 };
+
+	if (globals.log_format == LOG_FORMAT_JSON) {
+		encode_json(&b, event, fields, n);
+	}
+	else {
+		encode_text(&b, text, fields, n);
+	}
+
+	buf[b.len] = 0;
+	return b.len;
+}
+
+static void emit(int priority, const char* buf, size_t len)
+{
+	if (globals.log_format == LOG_FORMAT_JSON) {
+		log_line(priority, buf, len);
+	}
+	else {
+		my_log(priority, "%s", buf);
+	}
+}
+
+#define EVENT_FIELD_VALUE_STR(name)  { #name, e->name, EVENT_STRING_LIMIT, 0, 1 },
+#define EVENT_FIELD_VALUE_TEXT(name) { #name, e->name, 0, 0, 1 },
+#define EVENT_FIELD_VALUE_INT(name)  { #name, NULL, 0, e->name, 0 },
+#define EVENT_FIELD_VALUE(type, name) EVENT_FIELD_VALUE_##type(name)
+
+#define EVENT_DEFINE(name, priority, text, FIELDS)                                     \
+	size_t encode_##name(char* buf, size_t size, const struct event_##name##_t* e)     \
+	{                                                                                  \
+		const struct field_t fields[] = { FIELDS(EVENT_FIELD_VALUE) };                 \
+		return encode(buf, size, #name, text, fields, sizeof(fields) / sizeof(fields[0])); \
+	}                                                                                  \
+                                                                                       \
+	void emit_##name(const struct event_##name##_t* e)                                 \
+	{                                                                                  \
+		char buf[EVENT_BUFFER_SIZE];                                                   \
+		emit(priority, buf, encode_##name(buf, sizeof(buf), e));                       \
+	}
+
+HONEYPOT_EVENTS(EVENT_DEFINE)
@@ -0,0 +1,98 @@
+#ifndef EVENTS_H_
+#define EVENTS_H_
+
+#include <stddef.h>
+#include <syslog.h>
+
+/*
+ * Big enough for every event: attacker-supplied strings are cut at EVENT_STRING_LIMIT,
+ * so the largest one, auth_password with a long user and password and IPv6 addresses, takes up to about 600 bytes
+ */
+#define EVENT_BUFFER_SIZE  1024
+#define EVENT_STRING_LIMIT 128
+
+/*
+ * The schema of the honeypot events.
+ *
+ * X(name, priority, text, FIELDS): `text` is the template of the plain text encoding;
+ * its %s and %d placeholders consume the fields in the order they are listed.
+ * F(type, name): STR fields (attacker-supplied) are escaped and cut at EVENT_STRING_LIMIT bytes,
+ * TEXT fields (our own) are escaped and cut only to fit the buffer, INT fields are ints.
+ */
+#define CONNECT_FIELDS(F) \
+	F(STR, src_ip)        \
+	F(INT, src_port)      \
+	F(STR, dst_ip)        \
+	F(INT, dst_port)      \
+	F(TEXT, listener)
+
+#define KEX_FAILED_FIELDS(F) \
+	F(STR, src_ip)           \
+	F(INT, src_port)         \
+	F(STR, dst_ip)           \
+	F(INT, dst_port)         \
+	F(TEXT, listener)        \
+	F(STR, error)
+
+#define AUTH_PASSWORD_FIELDS(F) \
+	F(STR, user)                \
+	F(STR, src_ip)              \
+	F(INT, src_port)            \
+	F(INT, version)             \
+	F(STR, dst_ip)              \
+	F(INT, dst_port)            \
+	F(TEXT, listener)           \
+	F(STR, password)
+
+#define DISCONNECT_FIELDS(F) \
+	F(STR, src_ip)           \
+	F(INT, src_port)         \
+	F(STR, dst_ip)           \
+	F(INT, dst_port)         \
+	F(TEXT, listener)        \
+	F(INT, duration)
+
+#define AUTH_ROLLUP_FIELDS(F) \
+	F(STR, user)              \
+	F(STR, src_ip)            \
+	F(STR, password)          \
+	F(INT, count)             \
+	F(INT, first_seen)        \
+	F(INT, last_seen)
+
+#define NON_SSH_FIELDS(F) \
+	F(STR, src_ip)        \
+	F(INT, src_port)      \
+	F(STR, dst_ip)        \
+	F(INT, dst_port)      \
+	F(TEXT, listener)     \
+	F(TEXT, protocol)     \
+	F(STR, data)
+
+#define MESSAGE_FIELDS(F) \
+	F(TEXT, message)
+
+#define HONEYPOT_EVENTS(X) \
+	X(connect,       LOG_INFO,    "Connection from %s port %d (target: %s:%d, listener: %s)",                                 CONNECT_FIELDS)       \
+	X(kex_failed,    LOG_WARNING, "Did not receive identification string from %s:%d (target: %s:%d, listener: %s): %s",        KEX_FAILED_FIELDS)    \
+	X(auth_password, LOG_WARNING, "Failed password for %s from %s port %d ssh%d (target: %s:%d, listener: %s, password: %s)", AUTH_PASSWORD_FIELDS) \
+	X(disconnect,    LOG_INFO,    "Connection closed by %s port %d (target: %s:%d, listener: %s, duration: %ds)",             DISCONNECT_FIELDS)    \
+	X(auth_rollup,   LOG_WARNING, "Failed password for %s from %s repeated (password: %s, %d times, first: %d, last: %d)",     AUTH_ROLLUP_FIELDS)   \
+	X(non_ssh,       LOG_INFO,    "Dropped non-SSH client %s port %d (target: %s:%d, listener: %s, protocol: %s, data: %s)",  NON_SSH_FIELDS)       \
+	X(message,       LOG_INFO,    "%s",                                                                                        MESSAGE_FIELDS)
+
+#define EVENT_FIELD_TYPE_STR  const char*
+#define EVENT_FIELD_TYPE_TEXT const char*
+#define EVENT_FIELD_TYPE_INT  int
+#define EVENT_DECLARE_FIELD(type, name) EVENT_FIELD_TYPE_##type name;
+
+#define EVENT_DECLARE(name, priority, text, FIELDS)                                    \
+	struct event_##name##_t { FIELDS(EVENT_DECLARE_FIELD) };                           \
+	size_t encode_##name(char* buf, size_t size, const struct event_##name##_t* e);    \
+	void emit_##name(const struct event_##name##_t* e);
+
+HONEYPOT_EVENTS(EVENT_DECLARE)
+
+#undef EVENT_DECLARE
+
+#endif /* EVENTS_H_ */
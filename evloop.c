@@ -0,0 +1,665 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <libssh/libssh.h>
+#include <libssh/callbacks.h>
+#include <libssh/server.h>
+#include "evloop.h"
+#include "globals.h"
+#include "worker.h"
+#include "metrics.h"
+#include "log.h"
+#include "listener.h"
+#include "sniff.h"
+#include "kexlimit.h"
+#include "probes.h"
+#include "timers.h"
+
+/* Descriptors kept in reserve for the listening socket, syslog, PID file etc */
+#define RESERVED_FDS 64
+
+/* Closed sessions are looked for at most this often, and only after the loop has been woken up */
+#define SWEEP_INTERVAL 1000000000
+
+/*
+ * Every event loop owns one ssh_event shared by all of its sessions.
+ * Sessions are handed over by the acceptor through the mutex-protected inbox;
+ * everything else (the session list, libssh calls) is touched only by the loop thread.
+ */
+struct evloop_t {
+	pthread_t thread;
+	ssh_event event;
+	pthread_mutex_t mutex;
+	struct connection_info_t* inbox;
+	struct connection_info_t* head;
+	struct connection_info_t* sniffed;
+	struct connection_info_t* kex_ready;
+	struct connection_info_t* expired;
+	atomic_size_t n_sessions;       /* read by the acceptors and the metrics without the mutex */
+	uint64_t last_sweep;
+	int sweep_due;
+	int wake_fd;
+	int cpu;
+	int started;
+};
+
+static int wake_callback(socket_t fd, int revents, void* userdata)
+{
+	uint64_t value;
+
+	/* Only reset the counter: the inbox is drained once ssh_event_dopoll() returns */
+	if (read(fd, &value, sizeof(value)) == -1 && errno != EAGAIN) {
+		my_log(LOG_ERR, "Failed to read from the wakeup descriptor: %s", strerror(errno));
+	}
+
+	return 0;
+}
+
+static void wake_loop(struct evloop_t* loop)
+{
+	uint64_t value = 1;
+	if (write(loop->wake_fd, &value, sizeof(value)) == -1 && errno != EAGAIN) {
+		my_log(LOG_ERR, "Failed to wake up the event loop: %s", strerror(errno));
+	}
+}
+
+/*
+ * Clients request the ssh-userauth service right after the key exchange,
+ * which is the cheapest way to learn that a non-blocking key exchange has completed.
+ */
+static int service_request(ssh_session session, const char* service, void* userdata)
+{
+	struct connection_info_t* conn = (struct connection_info_t*)userdata;
+
+	kex_completed(conn);
+	return 0;
+}
+
+static void unlink_expired(struct evloop_t* loop, struct connection_info_t* conn)
+{
+	pthread_mutex_lock(&loop->mutex);
+	for (struct connection_info_t** p = &loop->expired; *p; p = &(*p)->expired_next) {
+		if (*p == conn) {
+			*p = conn->expired_next;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&loop->mutex);
+}
+
+static void close_session(struct evloop_t* loop, struct connection_info_t* conn)
+{
+	uint64_t start = monotonic_ns();
+
+	/* Once cancelled, the timer cannot queue the session again */
+	timer_cancel(&conn->timer);
+	if (conn->expired) {
+		unlink_expired(loop, conn);
+	}
+
+	if (conn->prev) {
+		conn->prev->next = conn->next;
+	}
+
+	if (conn->next) {
+		conn->next->prev = conn->prev;
+	}
+
+	if (loop->head == conn) {
+		loop->head = conn->next;
+	}
+
+	if (conn->sniffing) {
+		ssh_event_remove_fd(loop->event, ssh_get_fd(conn->session));
+	}
+	else {
+		ssh_event_remove_session(loop->event, conn->session);
+	}
+
+	/* May still be queued, or have been granted a slot and not picked up yet */
+	kexlimit_release(conn);
+	PROBE5(finalize, conn, (const char*)conn->ipstr, conn->port, (int)conn->expired, conn->started_ns);
+	log_disconnect(conn);
+	drop_session(conn->session, &conn->addr, conn->ip_tracked);
+	free(conn);
+	metrics_observe(METRIC_teardown, monotonic_ns() - start);
+
+	/* Last: the shutdown waits for every loop to have no sessions left */
+	atomic_fetch_sub_explicit(&loop->n_sessions, 1, memory_order_release);
+}
+
+/* For sessions that have never been added to the loop */
+static void discard_session(struct evloop_t* loop, struct connection_info_t* conn)
+{
+	PROBE5(finalize, conn, (const char*)conn->ipstr, conn->port, (int)conn->expired, conn->started_ns);
+	log_disconnect(conn);
+	drop_session(conn->session, &conn->addr, conn->ip_tracked);
+	free(conn);
+
+	/* Last: the shutdown waits for every loop to have no sessions left */
+	atomic_fetch_sub_explicit(&loop->n_sessions, 1, memory_order_release);
+}
+
+static void run_kex(struct evloop_t* loop, struct connection_info_t* conn)
+{
+	update_session_timer(conn);
+
+	/* In non-blocking mode this sends our banner and returns SSH_AGAIN; the event loop drives the rest */
+	ssh_set_blocking(conn->session, 0);
+	PROBE4(kex_begin, conn, (const char*)conn->ipstr, conn->port, conn->started_ns);
+	if (ssh_handle_key_exchange(conn->session) == SSH_ERROR) {
+		log_kex_failure(conn);
+		close_session(loop, conn);
+		return;
+	}
+
+	if (ssh_event_add_session(loop->event, conn->session) != SSH_OK) {
+		my_log(LOG_ALERT, "Failed to add the session to the polling context");
+		close_session(loop, conn);
+		return;
+	}
+
+	conn->kex_started = 1;
+}
+
+/* A queued session stays in the loop's list, outside the polling context, until it gets a slot */
+static void start_kex(struct evloop_t* loop, struct connection_info_t* conn)
+{
+	if (kexlimit_try(conn)) {
+		run_kex(loop, conn);
+	}
+	else {
+		update_session_timer(conn);
+	}
+}
+
+/* Called by whichever thread has freed the slot, with the limiter locked */
+void evloop_kex_granted(struct connection_info_t* conn)
+{
+	struct evloop_t* loop = conn->loop;
+
+	pthread_mutex_lock(&loop->mutex);
+	conn->kex_next  = loop->kex_ready;
+	loop->kex_ready = conn;
+	pthread_mutex_unlock(&loop->mutex);
+	wake_loop(loop);
+}
+
+/* Called by kexlimit_release() with the limiter mutex held: a granted session that is about to be freed */
+void evloop_kex_revoked(struct connection_info_t* conn)
+{
+	struct evloop_t* loop = conn->loop;
+
+	pthread_mutex_lock(&loop->mutex);
+	for (struct connection_info_t** p = &loop->kex_ready; *p; p = &(*p)->kex_next) {
+		if (*p == conn) {
+			*p = conn->kex_next;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&loop->mutex);
+}
+
+static void drain_kex_ready(struct evloop_t* loop)
+{
+	struct connection_info_t* conn;
+
+	pthread_mutex_lock(&loop->mutex);
+	conn            = loop->kex_ready;
+	loop->kex_ready = NULL;
+	pthread_mutex_unlock(&loop->mutex);
+
+	while (conn) {
+		struct connection_info_t* next = conn->kex_next;
+		conn->kex_next = NULL;
+		run_kex(loop, conn);
+		conn = next;
+	}
+}
+
+/* Like the wakeup descriptor, only notes the event: the sessions are dealt with once ssh_event_dopoll() returns */
+static int sniff_callback(socket_t fd, int revents, void* userdata)
+{
+	struct connection_info_t* conn = (struct connection_info_t*)userdata;
+	struct evloop_t* loop          = conn->loop;
+
+	if (conn->sniffing == 1) {
+		conn->sniffing = 2;
+		conn->sniffed  = loop->sniffed;
+		loop->sniffed  = conn;
+	}
+
+	return 0;
+}
+
+static void drain_sniffed(struct evloop_t* loop)
+{
+	struct connection_info_t* conn = loop->sniffed;
+
+	loop->sniffed = NULL;
+	while (conn) {
+		struct connection_info_t* next = conn->sniffed;
+		int rc = sniff_check(conn);
+
+		if (rc == SNIFF_NO_DATA) {
+			conn->sniffing = 1;
+		}
+		else if (rc == SNIFF_SSH) {
+			ssh_event_remove_fd(loop->event, ssh_get_fd(conn->session));
+			conn->sniffing = 0;
+			start_kex(loop, conn);
+		}
+		else {
+			close_session(loop, conn);
+		}
+
+		conn = next;
+	}
+}
+
+static void start_session(struct evloop_t* loop, struct connection_info_t* conn)
+{
+	conn->loop = loop;
+	get_connection_info(conn);
+	set_session_callbacks(conn);
+	conn->server_cb.service_request_function = service_request;
+
+	conn->prev = NULL;
+	conn->next = loop->head;
+	if (loop->head) {
+		loop->head->prev = conn;
+	}
+
+	loop->head = conn;
+
+	/* Until the client has said something, the session is only a descriptor in the polling context */
+	if (globals.sniff_timeout) {
+		conn->sniffing = 1;
+		if (ssh_event_add_fd(loop->event, ssh_get_fd(conn->session), POLLIN, sniff_callback, conn) == SSH_OK) {
+			start_session_timer(conn);
+			return;
+		}
+
+		conn->sniffing = 0;
+	}
+
+	start_session_timer(conn);
+	start_kex(loop, conn);
+}
+
+static void drain_inbox(struct evloop_t* loop)
+{
+	struct connection_info_t* conn;
+
+	pthread_mutex_lock(&loop->mutex);
+	conn        = loop->inbox;
+	loop->inbox = NULL;
+	pthread_mutex_unlock(&loop->mutex);
+
+	while (conn) {
+		struct connection_info_t* next = conn->next;
+		start_session(loop, conn);
+		conn = next;
+	}
+}
+
+/* Called on the timer thread */
+void evloop_expired(struct connection_info_t* conn, int reason)
+{
+	struct evloop_t* loop = conn->loop;
+
+	pthread_mutex_lock(&loop->mutex);
+	if (!conn->expired) {
+		conn->expired_next = loop->expired;
+		loop->expired      = conn;
+	}
+
+	if (conn->expired != EXPIRED_SHUTDOWN) {
+		conn->expired = reason;
+	}
+
+	pthread_mutex_unlock(&loop->mutex);
+	wake_loop(loop);
+}
+
+static void drain_expired(struct evloop_t* loop)
+{
+	struct connection_info_t* conn;
+
+	pthread_mutex_lock(&loop->mutex);
+	conn          = loop->expired;
+	loop->expired = NULL;
+	pthread_mutex_unlock(&loop->mutex);
+
+	/* The timer of a session taken off the list is not pending, so nothing else touches conn->expired */
+	while (conn) {
+		struct connection_info_t* next = conn->expired_next;
+		int reason                     = conn->expired;
+
+		if (reason != EXPIRED_SHUTDOWN && session_deadline(conn, &reason) > monotonic_ns()) {
+			/* The session has moved on since the timer fired */
+			conn->expired = 0;
+			update_session_timer(conn);
+		}
+		else if (reason == EXPIRED_SNIFF) {
+			sniff_timeout(conn);
+			close_session(loop, conn);
+		}
+		else if (reason == EXPIRED_KEX_WAIT && kexlimit_cancel(conn)) {
+			/* Granted a slot in the meantime: drain_kex_ready() starts the key exchange */
+			conn->expired = 0;
+		}
+		else {
+			if (reason == EXPIRED_KEX_WAIT) {
+				metrics_inc(METRIC_kex_wait_timeouts_total);
+			}
+
+			count_timeout(reason);
+			close_session(loop, conn);
+		}
+
+		conn = next;
+	}
+}
+
+/*
+ * Deadlines are kept by the timer wheel; what is left is to reap the sessions libssh has seen closed.
+ * A closed session always wakes the loop up, so the sweep runs only after a wakeup, at most once a second.
+ */
+static void sweep_sessions(struct evloop_t* loop)
+{
+	uint64_t now = monotonic_ns();
+	struct connection_info_t* conn;
+
+	if (now - loop->last_sweep < SWEEP_INTERVAL) {
+		loop->sweep_due = 1;
+		return;
+	}
+
+	loop->last_sweep = now;
+	loop->sweep_due  = 0;
+	conn = loop->head;
+	while (conn) {
+		struct connection_info_t* next = conn->next;
+
+		if (!conn->sniffing && !kexlimit_queued(conn) && (ssh_get_status(conn->session) & (SSH_CLOSED | SSH_CLOSED_ERROR))) {
+			/* Past NEWKEYS, a client that has gone before asking for a service has merely disconnected */
+			if (!conn->kex_done && !ssh_get_cipher_in(conn->session)) {
+				log_kex_failure(conn);
+			}
+
+			close_session(loop, conn);
+		}
+
+		conn = next;
+	}
+}
+
+/* Blocks indefinitely unless a sweep has been put off */
+static int poll_timeout(struct evloop_t* loop)
+{
+	uint64_t now = monotonic_ns();
+
+	if (!loop->sweep_due) {
+		return -1;
+	}
+
+	return now - loop->last_sweep >= SWEEP_INTERVAL ? 0 : (int)((loop->last_sweep + SWEEP_INTERVAL - now + 999999) / 1000000);
+}
+
+/*
+ * Like a blocking connection thread, a session in the middle of the key exchange is let finish it;
+ * if it has not by the shutdown deadline, timers_stop() expires it, and drain_sessions() counts it as force-closed.
+ * Everything else is closed at once.
+ */
+static void wind_down(struct evloop_t* loop)
+{
+	struct connection_info_t* conn;
+
+	/* It stays readable, and would keep the poll below from blocking */
+	ssh_event_remove_fd(loop->event, globals.shutdown_fd);
+
+	pthread_mutex_lock(&loop->mutex);
+	conn        = loop->inbox;
+	loop->inbox = NULL;
+	pthread_mutex_unlock(&loop->mutex);
+
+	while (conn) {
+		struct connection_info_t* next = conn->next;
+		discard_session(loop, conn);
+		conn = next;
+	}
+
+	for (;;) {
+		conn = loop->head;
+		while (conn) {
+			struct connection_info_t* next = conn->next;
+
+			/* Also covers the sessions granted a slot while waiting, still on the kex_ready list */
+			if (!conn->kex_started || conn->kex_done || ssh_get_cipher_in(conn->session)) {
+				close_session(loop, conn);
+			}
+
+			conn = next;
+		}
+
+		if (!loop->head) {
+			break;
+		}
+
+		ssh_event_dopoll(loop->event, poll_timeout(loop));
+		drain_expired(loop);
+		sweep_sessions(loop);
+	}
+}
+
+static void* evloop_thread(void* arg)
+{
+	struct evloop_t* loop = (struct evloop_t*)arg;
+
+	pin_to_cpu(loop->cpu);
+	while (!globals.terminate) {
+		ssh_event_dopoll(loop->event, poll_timeout(loop));
+		drain_sniffed(loop);
+		drain_kex_ready(loop);
+		drain_expired(loop);
+		drain_inbox(loop);
+		sweep_sessions(loop);
+	}
+
+	wind_down(loop);
+	return NULL;
+}
+
+/*
+ * With several acceptors, loop i belongs to acceptor (i % acceptors) and runs on its CPU,
+ * so that a session never leaves the core it has been accepted on.
+ */
+static int is_shard_local(struct globals_t* g, size_t loop, size_t shard)
+{
+	return g->event_loops < g->acceptors || loop % g->acceptors == shard % g->acceptors;
+}
+
+static size_t active_sessions(struct globals_t* g, size_t shard, struct evloop_t** least_loaded)
+{
+	size_t total = 0;
+	size_t least = 0;
+	struct evloop_t* best = NULL;
+
+	for (size_t i = 0; i < g->event_loops; ++i) {
+		size_t n = atomic_load_explicit(&g->evloops[i].n_sessions, memory_order_relaxed);
+		total += n;
+		if (is_shard_local(g, i, shard) && (!best || n < least)) {
+			best  = &g->evloops[i];
+			least = n;
+		}
+	}
+
+	*least_loaded = best;
+	return total;
+}
+
+static void raise_fd_limit(struct globals_t* g)
+{
+	struct rlimit rl;
+	size_t limit = 1024 - RESERVED_FDS;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+		limit = SIZE_MAX;
+		if (rl.rlim_cur < rl.rlim_max) {
+			rl.rlim_cur = rl.rlim_max;
+			if (setrlimit(RLIMIT_NOFILE, &rl) == -1) {
+				getrlimit(RLIMIT_NOFILE, &rl);
+			}
+		}
+
+		if (rl.rlim_cur != RLIM_INFINITY) {
+			limit = rl.rlim_cur > 2 * RESERVED_FDS ? (size_t)(rl.rlim_cur - RESERVED_FDS) : (size_t)(rl.rlim_cur / 2);
+		}
+	}
+
+	/* Every session holds a descriptor, whatever limit has been set or derived from the memory limit */
+	if (!g->max_sessions || g->max_sessions > limit) {
+		g->max_sessions = limit;
+	}
+}
+
+int evloop_start(struct globals_t* g)
+{
+	raise_fd_limit(g);
+
+	g->evloops = calloc(g->event_loops, sizeof(struct evloop_t));
+	if (!g->evloops) {
+		return -1;
+	}
+
+	for (size_t i = 0; i < g->event_loops; ++i) {
+		g->evloops[i].wake_fd = -1;
+		g->evloops[i].cpu     = g->event_loops >= g->acceptors ? g->listeners[i % g->acceptors].cpu : -1;
+		pthread_mutex_init(&g->evloops[i].mutex, NULL);
+		atomic_init(&g->evloops[i].n_sessions, 0);
+	}
+
+	for (size_t i = 0; i < g->event_loops; ++i) {
+		struct evloop_t* loop = &g->evloops[i];
+
+		loop->event = ssh_event_new();
+		if (!loop->event) {
+			my_log(LOG_ALERT, "Could not create polling context");
+			return -1;
+		}
+
+		loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (
+			   loop->wake_fd == -1
+			|| ssh_event_add_fd(loop->event, loop->wake_fd, POLLIN, wake_callback, loop) != SSH_OK
+			|| watch_shutdown(loop->event)
+		) {
+			my_log(LOG_ALERT, "Failed to set up the wakeup descriptor: %s", strerror(errno));
+			return -1;
+		}
+
+		if (pthread_create(&loop->thread, NULL, evloop_thread, loop) != 0) {
+			my_log(LOG_CRIT, "pthread_create() failed");
+			return -1;
+		}
+
+		loop->started = 1;
+	}
+
+	my_log(LOG_DAEMON | LOG_INFO, "Serving up to %zu sessions from %zu event loops", g->max_sessions, g->event_loops);
+	return 0;
+}
+
+size_t evloop_sessions(struct globals_t* g)
+{
+	size_t n = 0;
+
+	for (size_t i = 0; g->evloops && i < g->event_loops; ++i) {
+		n += atomic_load_explicit(&g->evloops[i].n_sessions, memory_order_acquire);
+	}
+
+	return n;
+}
+
+int evloop_has_capacity(struct globals_t* g, size_t shard)
+{
+	struct evloop_t* loop;
+	return active_sessions(g, shard, &loop) < g->max_sessions;
+}
+
+void evloop_dispatch(struct globals_t* g, ssh_session session, const struct sockaddr_storage* addr, int ip_tracked, size_t shard)
+{
+	struct evloop_t* loop;
+	struct connection_info_t* conn;
+
+	if (active_sessions(g, shard, &loop) >= g->max_sessions) {
+		my_log(LOG_ERR, "Too many connections");
+		drop_session(session, addr, ip_tracked);
+		return;
+	}
+
+	conn = alloc_connection(session, addr, ip_tracked);
+	if (!conn) {
+		return;
+	}
+
+	pthread_mutex_lock(&loop->mutex);
+	{
+		conn->next  = loop->inbox;
+		loop->inbox = conn;
+		atomic_fetch_add_explicit(&loop->n_sessions, 1, memory_order_relaxed);
+	}
+	pthread_mutex_unlock(&loop->mutex);
+
+	wake_loop(loop);
+}
+
+void evloop_stop(struct globals_t* g)
+{
+	if (!g->evloops) {
+		return;
+	}
+
+	/* Every loop watches shutdown_fd, and winds its sessions down concurrently with the others */
+	request_shutdown(g);
+	for (size_t i = 0; i < g->event_loops; ++i) {
+		struct evloop_t* loop = &g->evloops[i];
+
+		if (loop->started) {
+			pthread_join(loop->thread, NULL);
+		}
+	}
+
+	for (size_t i = 0; i < g->event_loops; ++i) {
+		struct evloop_t* loop = &g->evloops[i];
+
+		/* Sessions handed over to a loop that has never been started */
+		while (loop->inbox) {
+			struct connection_info_t* next = loop->inbox->next;
+			discard_session(loop, loop->inbox);
+			loop->inbox = next;
+		}
+
+		if (loop->event) {
+			ssh_event_free(loop->event);
+		}
+
+		if (loop->wake_fd != -1) {
+			close(loop->wake_fd);
+		}
+
+		pthread_mutex_destroy(&loop->mutex);
+	}
+
+	free(g->evloops);
+	g->evloops = NULL;
+}
@@ -0,0 +1,16 @@
+#ifndef EVLOOP_H_
+#define EVLOOP_H_
+
+#include <libssh/server.h>
+#include "globals.h"
+
+int evloop_start(struct globals_t* g);
+size_t evloop_sessions(struct globals_t* g);
+int evloop_has_capacity(struct globals_t* g, size_t shard);
+void evloop_dispatch(struct globals_t* g, ssh_session session, const struct sockaddr_storage* addr, int ip_tracked, size_t shard);
+void evloop_kex_granted(struct connection_info_t* conn);
+void evloop_kex_revoked(struct connection_info_t* conn);
+void evloop_expired(struct connection_info_t* conn, int reason);
+void evloop_stop(struct globals_t* g);
+
+#endif /* EVLOOP_H_ */
@@ -2,51 +2,151 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 #include <libssh/callbacks.h>
 #include "globals.h"
 #include "log.h"
+#include "evloop.h"
+#include "pool.h"
+#include "listener.h"
+#include "capture.h"
+#include "aggregate.h"
+#include "iplimit.h"
+#include "kexlimit.h"
+#include "tarpit.h"
+#include "timers.h"
+#include "registry.h"
+#include "metrics.h"
+#include "worker.h"
+#include "handover.h"
 
 void init_globals(struct globals_t* g)
 {
 	memset(g, 0, sizeof(struct globals_t));
 
-	pthread_mutex_init(&g->mutex, NULL);
 	ssh_threads_set_callbacks(ssh_threads_get_pthread());
 	if (ssh_init() == -1) {
 		fprintf(stderr, "ssh_init() failed\n");
 		exit(EXIT_FAILURE);
 	}
 
-	g->sshbind = ssh_bind_new();
+	g->sshbind       = ssh_bind_new();
+	g->sniff_timeout = -1;
+	g->idle_timeout  = -1;
+	g->auth_timeout  = -1;
+	g->shutdown_timeout = -1;
+	g->kex_wait      = -1;
+	g->max_sessions  = AUTO_SIZE;
+	g->max_kex       = AUTO_SIZE;
 #ifndef MINIMALISTIC_BUILD
-	g->pid_fd  = -1;
+	g->pid_fd        = -1;
 #endif
+
+	g->shutdown_fd   = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	g->control_fd    = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	g->inherited_tarpit  = -1;
+	g->inherited_metrics = -1;
+	if (g->shutdown_fd == -1 || g->control_fd == -1) {
+		fprintf(stderr, "eventfd() failed: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * Async-signal-safe. The counter of shutdown_fd is never reset: once written, the descriptor
+ * stays readable, and every poll loop watching it wakes up at once and keeps waking up.
+ */
+void request_shutdown(struct globals_t* g)
+{
+	uint64_t value = 1;
+	int saved      = errno;
+
+	g->terminate = 1;
+	if (g->shutdown_fd != -1) {
+		ssize_t n = write(g->shutdown_fd, &value, sizeof(value));
+		(void)n;
+	}
+
+	errno = saved;
+}
+
+static size_t open_sessions(struct globals_t* g)
+{
+	return (g->registry ? registry_count(g->registry) : 0) + evloop_sessions(g);
+}
+
+/*
+ * The sessions have all been told to close by shutdown_fd and wind down concurrently;
+ * those still open once the shutdown deadline has passed are force-closed by the session timers.
+ * Returns the number of force-closed sessions.
+ */
+static size_t drain_sessions(struct globals_t* g, size_t* sessions)
+{
+	uint64_t deadline = monotonic_ns() + (uint64_t)g->shutdown_timeout * 1000000000;
+	size_t left;
+
+	request_shutdown(g);
+	kexlimit_drain(g);
+
+	*sessions = left = open_sessions(g);
+	while (left > 0 && monotonic_ns() < deadline) {
+		struct timespec delay = { 0, 10000000 };
+		nanosleep(&delay, NULL);
+		left = open_sessions(g);
+	}
+
+	timers_stop(g);
+	return left;
 }
 
 static void wait_for_threads(struct globals_t* g)
 {
-	size_t num_threads;
-
-	do {
-		pthread_t thread = 0;
-		pthread_mutex_lock(&g->mutex);
-		{
-			num_threads = g->n_threads;
-			if (num_threads > 0) {
-				thread = g->head->thread;
-			}
-		}
-		pthread_mutex_unlock(&g->mutex);
+	if (!g->registry) {
+		return;
+	}
 
-		if (num_threads > 0) {
-			pthread_kill(thread, SIGTERM);
-			pthread_join(thread, NULL);
-		}
-	} while (num_threads > 0);
+	/* Connection threads are detached, and have been woken up by now: wait until every one has unregistered itself, its last step */
+	while (registry_count(g->registry) > 0) {
+		struct timespec delay = { 0, 10000000 };
+		nanosleep(&delay, NULL);
+	}
+
+	registry_free(g->registry);
+	g->registry = NULL;
 }
 
 void free_globals(struct globals_t* g)
 {
+	uint64_t started = monotonic_ns();
+	int serving      = g->registry != NULL || g->evloops != NULL;
+	size_t sessions;
+	size_t forced    = drain_sessions(g, &sessions);
+
+	/* Stop everything that may still log before flushing the log queue and closing the log */
+	metrics_stop(g);
+	evloop_stop(g);
+	pool_stop(g);
+	wait_for_threads(g);
+	close_listeners(g);
+	aggregate_stop(g);
+	iplimit_stop(g);
+	kexlimit_stop(g);
+	tarpit_stop(g);
+	if (serving) {
+		my_log(
+			LOG_DAEMON | LOG_INFO,
+			"Shut down in %.3f seconds: %zu sessions open, %zu force-closed",
+			(double)(monotonic_ns() - started) / 1e9,
+			sessions,
+			forced
+		);
+	}
+
+	capture_close(g);
+	log_stop(g);
+
 #ifndef MINIMALISTIC_BUILD
 	if (g->pid_fd >= 0) {
 		if (-1 == unlink(g->pid_file)) {
@@ -70,11 +170,26 @@ void free_globals(struct globals_t* g)
 	free(g->dsa_key);
 	free(g->ecdsa_key);
 	free(g->ed25519_key);
-	free(g->bind_address);
-	free(g->bind_port);
+	for (size_t i = 0; i < g->n_bind_addresses; ++i) {
+		free(g->bind_addresses[i]);
+	}
 
-	wait_for_threads(g);
-	pthread_mutex_destroy(&g->mutex);
+	for (size_t i = 0; i < g->n_bind_ports; ++i) {
+		free(g->bind_ports[i]);
+	}
+
+	free(g->bind_addresses);
+	free(g->bind_ports);
+	free(g->capture_dir);
+	free(g->key_cache);
+	free(g->metrics_address);
+	free(g->tarpit_port);
+
+	handover_free(g);
+	close(g->shutdown_fd);
+	close(g->control_fd);
+	g->shutdown_fd = -1;
+	g->control_fd  = -1;
 
 	ssh_bind_free(g->sshbind);
 	ssh_finalize();
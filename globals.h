@@ -5,7 +5,31 @@
 #include <sys/types.h>
 #include <signal.h>
 #include <pthread.h>
+#include <time.h>
 #include <libssh/server.h>
+#include <libssh/callbacks.h>
+#include "timers.h"
+
+/* libssh's own timeout of blocking calls: the session deadlines are kept by the timer wheel, this one must just never come first */
+#define LIBSSH_TIMEOUT   86400
+#define MAX_THREADS      100
+#define THREAD_STACK_SIZE 65536
+/* A limit to be derived from the resources of the process at startup */
+#define AUTO_SIZE        ((size_t)-1)
+
+struct evloop_t;
+struct endpoint_t;
+struct listener_t;
+struct pool_t;
+struct log_queue_t;
+struct capture_t;
+struct aggregate_t;
+struct iplimit_t;
+struct registry_t;
+struct metrics_server_t;
+struct kexlimit_t;
+struct crypto_profile_t;
+struct tarpit_t;
 
 struct connection_info_t {
 	struct connection_info_t* prev;
@@ -13,10 +37,35 @@ struct connection_info_t {
 	ssh_session session;
 	ssh_event event;
 	pthread_t thread;
+	struct evloop_t* loop;
+	struct ssh_server_callbacks_struct server_cb;
+	time_t started;
+	time_t last_activity;
+	int connected;
+	int kex_done;
+	int kex_started;                /* event loops: the session is in the polling context */
 	int port;
 	int my_port;
 	char ipstr[INET6_ADDRSTRLEN];
 	char my_ipstr[INET6_ADDRSTRLEN];
+	const char* listener;           /* the endpoint the connection has arrived on */
+	struct sockaddr_storage addr;
+	struct sockaddr_storage my_addr;
+	long int slot;
+	int ip_tracked;                 /* counted by the per-IP limits, see iplimit_admit() */
+	uint64_t started_ns;
+	int auth_seen;
+	int sniffing;
+	struct connection_info_t* sniffed;
+	int kex_state;
+	uint64_t kex_since;
+	struct connection_info_t* kex_prev;
+	struct connection_info_t* kex_next;
+	pthread_cond_t* kex_cond;
+	int fd;
+	volatile sig_atomic_t expired;
+	struct wheel_timer_t timer;
+	struct connection_info_t* expired_next;
 };
 
 #pragma clang diagnostic push
@@ -26,22 +75,88 @@ struct globals_t {
 	char* dsa_key;
 	char* ecdsa_key;
 	char* ed25519_key;
-	char* bind_address;
-	char* bind_port;
+	char* key_cache;
+	int key_type;
+	const struct crypto_profile_t* crypto_profile;
+	char** bind_addresses;
+	size_t n_bind_addresses;
+	char** bind_ports;
+	size_t n_bind_ports;
 #ifndef MINIMALISTIC_BUILD
 	char* pid_file;
 	char* daemon_name;
 #endif
 
 	ssh_bind sshbind;
+	struct endpoint_t* endpoints;   /* every address on every port */
+	size_t n_endpoints;
+	struct listener_t* listeners;   /* the acceptors */
+	size_t acceptors;
+	int reuseport_bpf;
+	int backlog;
+	int defer_accept;
+	int busy_poll;
+	long int sniff_timeout;
+	long int idle_timeout;
+	long int auth_timeout;
+	long int session_lifetime;
+	long int shutdown_timeout;
+
+	struct registry_t* registry;
+	volatile sig_atomic_t terminate;
+	volatile sig_atomic_t dump_latency;
+	volatile sig_atomic_t restart;
+	int shutdown_fd;                /* eventfd, readable once the daemon is shutting down */
+	int control_fd;                 /* eventfd, written on SIGUSR1 and SIGHUP */
 
-	pthread_mutex_t mutex;
+	char** argv;
+	int* inherited;                 /* SSH listening sockets passed in by a predecessor or the service manager */
+	size_t n_inherited;
+	int inherited_tarpit;
+	int inherited_metrics;
+	pid_t predecessor;              /* retired once we accept connections */
+	pid_t successor;
+	volatile sig_atomic_t handed_over;  /* the successor has confirmed the takeover */
 
-	struct connection_info_t* head;
-	struct connection_info_t* tail;
+	size_t event_loops;
+	size_t max_sessions;
+	struct evloop_t* evloops;
 
-	volatile size_t n_threads;
-	volatile sig_atomic_t terminate;
+	size_t workers;
+	size_t queue_depth;
+	long int overflow_timeout;
+	int overflow_wait;
+	struct pool_t* pool;
+
+	size_t log_queue;
+	int log_overflow_wait;
+	int log_format;
+	struct log_queue_t* log;
+
+	char* capture_dir;
+	size_t capture_segment;
+	struct capture_t* capture;
+
+	size_t aggregate;
+	unsigned long aggregate_interval;
+	struct aggregate_t* aggregate_table;
+
+	unsigned long max_per_ip;
+	unsigned long ip_rate;
+	unsigned long ip_burst;
+	struct iplimit_t* iplimit;
+
+	char* metrics_address;
+	struct metrics_server_t* metrics;
+
+	size_t max_kex;
+	long int kex_wait;
+	struct kexlimit_t* kexlimit;
+
+	char* tarpit_port;
+	int tarpit_delay;
+	size_t tarpit_max;
+	struct tarpit_t* tarpit;
 
 #ifndef MINIMALISTIC_BUILD
 	int pid_fd;
@@ -59,5 +174,6 @@ extern struct globals_t globals;
 
 void init_globals(struct globals_t* g);
 void free_globals(struct globals_t* g);
+void request_shutdown(struct globals_t* g);
 
 #endif /* GLOBALS_H_ */
@@ -0,0 +1,386 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "handover.h"
+#include "globals.h"
+#include "listener.h"
+#include "log.h"
+#include "metrics.h"
+#include "tarpit.h"
+
+/*
+ * Listening sockets are passed the way systemd does it (sd_listen_fds(3)):
+ * descriptors 3 .. 3 + LISTEN_FDS - 1, meant for the process LISTEN_PID and named by LISTEN_FDNAMES.
+ * The SSH sockets have any name but "tarpit" and "metrics".
+ * On SIGHUP, the daemon starts a new copy of itself with its own sockets passed this way,
+ * and SSH_HONEYPOTD_PREDECESSOR set to its PID; the new process accepts connections
+ * from the same sockets, and sends SIGTERM to its predecessor once it is ready,
+ * which then stops accepting and drains its sessions. The listening sockets are never closed.
+ * That SIGTERM is queued with HANDOVER_VALUE: until it arrives, the predecessor keeps its PID file
+ * and the metrics socket, so that a successor failing to start leaves it as it was.
+ * The successor starts in the working directory the predecessor was started in.
+ */
+#define FIRST_FD    3
+#define PREDECESSOR "SSH_HONEYPOTD_PREDECESSOR"
+#define PID_DIGITS  24
+#define HANDOVER_VALUE 0x55484f  /* "SHO" */
+
+extern char** environ;
+
+static char* self;
+static int cwd_fd = -1;
+static volatile sig_atomic_t restarting;  /* set before fork(): the successor may be faster than our return from it */
+
+static int is_listening(int fd)
+{
+	int value;
+	socklen_t len = sizeof(value);
+
+	return getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &value, &len) == 0 && value;
+}
+
+/* The name of the descriptor I in the colon-separated list */
+static void fd_name(const char* names, size_t i, char* buf, size_t size)
+{
+	buf[0] = 0;
+	while (names && i > 0) {
+		names = strchr(names, ':');
+		names = names ? names + 1 : NULL;
+		--i;
+	}
+
+	if (names) {
+		size_t len = strcspn(names, ":");
+		if (len < size) {
+			memcpy(buf, names, len);
+			buf[len] = 0;
+		}
+	}
+}
+
+static void adopt(struct globals_t* g, int fd, const char* name)
+{
+	int flags = fcntl(fd, F_GETFL);
+
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	if (flags != -1) {
+		fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+	}
+
+	if (!strcmp(name, "tarpit")) {
+		g->inherited_tarpit = fd;
+	}
+	else if (!strcmp(name, "metrics")) {
+		g->inherited_metrics = fd;
+	}
+	else {
+		g->inherited[g->n_inherited++] = fd;
+	}
+}
+
+int handover_init(struct globals_t* g, char** argv)
+{
+	const char* pid   = getenv("LISTEN_PID");
+	const char* fds   = getenv("LISTEN_FDS");
+	const char* names = getenv("LISTEN_FDNAMES");
+	const char* pred  = getenv(PREDECESSOR);
+	long int n;
+
+	g->argv = argv;
+	self    = realpath("/proc/self/exe", NULL);
+	cwd_fd  = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	if (pid && fds && atol(pid) == (long int)getpid() && (n = atol(fds)) > 0 && n <= 1024) {
+		g->inherited = calloc((size_t)n, sizeof(int));
+		if (!g->inherited) {
+			perror("calloc");
+			return -1;
+		}
+
+		for (long int i = 0; i < n; ++i) {
+			char name[64];
+			int fd = FIRST_FD + (int)i;
+
+			fd_name(names, (size_t)i, name, sizeof(name));
+			if (!is_listening(fd)) {
+				fprintf(stderr, "Inherited descriptor %d is not a listening socket\n", fd);
+				return -1;
+			}
+
+			adopt(g, fd, name);
+		}
+
+		if (pred) {
+			g->predecessor = (pid_t)atol(pred);
+		}
+	}
+
+	/* Not to be inherited by whatever we may start later */
+	unsetenv("LISTEN_PID");
+	unsetenv("LISTEN_FDS");
+	unsetenv("LISTEN_FDNAMES");
+	unsetenv(PREDECESSOR);
+	return 0;
+}
+
+/* Called once the daemon accepts connections */
+void handover_ready(struct globals_t* g)
+{
+	/* Sockets passed in for services that are not enabled */
+	if (g->inherited_tarpit != -1) {
+		close(g->inherited_tarpit);
+		g->inherited_tarpit = -1;
+	}
+
+	if (g->inherited_metrics != -1) {
+		close(g->inherited_metrics);
+		g->inherited_metrics = -1;
+	}
+
+	if (g->predecessor > 0) {
+		union sigval value = { .sival_int = HANDOVER_VALUE };
+
+		my_log(LOG_DAEMON | LOG_INFO, "Took over %zu listening sockets from process %ld, which now drains its sessions", g->n_inherited, (long int)g->predecessor);
+		if (sigqueue(g->predecessor, SIGTERM, value) == -1) {
+			my_log(LOG_WARNING, "Failed to stop process %ld: %s", (long int)g->predecessor, strerror(errno));
+		}
+	}
+	else if (g->n_inherited) {
+		my_log(LOG_DAEMON | LOG_INFO, "Using %zu listening sockets passed by the service manager", g->n_inherited);
+	}
+}
+
+static char* env_var(const char* name, const char* value)
+{
+	size_t len = strlen(name) + strlen(value) + 2;
+	char* s    = malloc(len);
+
+	if (s) {
+		snprintf(s, len, "%s=%s", name, value);
+	}
+
+	return s;
+}
+
+/* Async-signal-safe: runs between fork() and execve() */
+static void format_pid(char* buf, long int pid)
+{
+	char digits[PID_DIGITS];
+	size_t n = 0;
+
+	do {
+		digits[n++] = (char)('0' + pid % 10);
+		pid /= 10;
+	} while (pid && n < sizeof(digits));
+
+	while (n > 0) {
+		*buf++ = digits[--n];
+	}
+
+	*buf = 0;
+}
+
+/* Async-signal-safe: runs between fork() and execve(). FDS has room for N more descriptors */
+static void exec_successor(struct globals_t* g, int* fds, size_t n, char** envp, char* listen_pid)
+{
+	int* tmp = fds + n;
+
+	/* daemon() has moved us to /, and relative paths on the command line are relative to where we were started; first, as moving the descriptors may close cwd_fd */
+	if (cwd_fd != -1 && fchdir(cwd_fd) == -1) {
+		_exit(127);
+	}
+
+	/* Out of the way first, so that moving one descriptor into place never clobbers another */
+	for (size_t i = 0; i < n; ++i) {
+		tmp[i] = fcntl(fds[i], F_DUPFD, FIRST_FD + (int)n);
+		if (tmp[i] == -1) {
+			_exit(127);
+		}
+	}
+
+	/* dup2() clears FD_CLOEXEC */
+	for (size_t i = 0; i < n; ++i) {
+		if (dup2(tmp[i], FIRST_FD + (int)i) == -1) {
+			_exit(127);
+		}
+
+		close(tmp[i]);
+	}
+
+	format_pid(listen_pid + strlen("LISTEN_PID="), (long int)getpid());
+	execve(self, g->argv, envp);
+	_exit(127);
+}
+
+/*
+ * Our own environment with LISTEN_FDS, LISTEN_FDNAMES, the predecessor and LISTEN_PID (filled in by the child)
+ * in place of the inherited ones; the four variables start at *ADDED
+ */
+static char** make_environment(const char* fds, const char* names, size_t* added)
+{
+	char pid[32];
+	size_t n = 0;
+	char** envp;
+
+	while (environ[n]) {
+		++n;
+	}
+
+	envp = calloc(n + 5, sizeof(char*));
+	if (!envp) {
+		return NULL;
+	}
+
+	n = 0;
+	for (char** e = environ; *e; ++e) {
+		if (strncmp(*e, "LISTEN_", 7) && strncmp(*e, PREDECESSOR "=", sizeof(PREDECESSOR))) {
+			envp[n++] = *e;
+		}
+	}
+
+	snprintf(pid, sizeof(pid), "%ld", (long int)getpid());
+	envp[n]     = env_var("LISTEN_FDS", fds);
+	envp[n + 1] = env_var("LISTEN_FDNAMES", names);
+	envp[n + 2] = env_var(PREDECESSOR, pid);
+	envp[n + 3] = malloc(strlen("LISTEN_PID=") + PID_DIGITS + 1);
+	if (!envp[n] || !envp[n + 1] || !envp[n + 2] || !envp[n + 3]) {
+		for (size_t i = n; i < n + 4; ++i) {
+			free(envp[i]);
+		}
+
+		free(envp);
+		return NULL;
+	}
+
+	strcpy(envp[n + 3], "LISTEN_PID=");
+	*added = n;
+	return envp;
+}
+
+static void free_environment(char** envp, size_t added)
+{
+	for (size_t i = added; i < added + 4; ++i) {
+		free(envp[i]);
+	}
+
+	free(envp);
+}
+
+/* Called on SIGHUP, by the first acceptor */
+void handover_spawn(struct globals_t* g)
+{
+	size_t max   = g->acceptors * g->n_endpoints + 2;
+	int* fds     = calloc(2 * max, sizeof(int));
+	char* names  = malloc(max * sizeof(":metrics"));
+	size_t count = 0;
+	char** envp  = NULL;
+	size_t added = 0;
+	char value[32];
+	pid_t pid;
+
+	if (g->successor > 0 && kill(g->successor, 0) == 0) {
+		my_log(LOG_WARNING, "Process %ld is already taking over, ignoring SIGHUP", (long int)g->successor);
+		goto done;
+	}
+
+	if (!self || !fds || !names) {
+		my_log(LOG_ERR, "Cannot restart: %s", !self ? "the executable is unknown" : "out of memory");
+		goto done;
+	}
+
+	names[0] = 0;
+	for (size_t i = 0; i < g->acceptors; ++i) {
+		for (size_t e = 0; e < g->n_endpoints; ++e) {
+			if (g->listeners[i].fds[e] != -1) {
+				fds[count++] = g->listeners[i].fds[e];
+				strcat(names, count > 1 ? ":ssh" : "ssh");
+			}
+		}
+	}
+
+	if (g->tarpit) {
+		fds[count++] = tarpit_listener(g);
+		strcat(names, ":tarpit");
+	}
+
+	if (g->metrics) {
+		fds[count++] = metrics_listener(g);
+		strcat(names, ":metrics");
+	}
+
+	snprintf(value, sizeof(value), "%zu", count);
+	envp = make_environment(value, names, &added);
+	if (!envp) {
+		my_log(LOG_ERR, "Cannot restart: out of memory");
+		goto done;
+	}
+
+	restarting = 1;
+	pid = fork();
+	if (pid == 0) {
+		exec_successor(g, fds, count, envp, envp[added + 3]);
+	}
+
+	if (pid == -1) {
+		restarting = 0;
+		my_log(LOG_ERR, "Cannot restart: fork() failed: %s", strerror(errno));
+	}
+	else {
+		g->successor = pid;
+		my_log(LOG_DAEMON | LOG_INFO, "Restarting: handed %zu listening sockets over to process %ld (%s)", count, (long int)pid, self);
+	}
+
+done:
+	if (envp) {
+		free_environment(envp, added);
+	}
+
+	free(names);
+	free(fds);
+}
+
+/*
+ * Async-signal-safe: called from the SIGTERM handler when the signal comes from our successor.
+ * The PID file is left to it: the lock is released here, and the file is not deleted on exit.
+ */
+void handover_confirmed(struct globals_t* g)
+{
+	if (!restarting) {
+		return;
+	}
+
+	g->handed_over = 1;
+#ifndef MINIMALISTIC_BUILD
+	if (g->pid_fd >= 0) {
+		int fd = g->pid_fd;
+
+		g->pid_fd = -1;
+		close(fd);
+	}
+#endif
+}
+
+/* Whether SIGTERM with INFO has been sent by a successor that has taken over */
+int handover_signal(const siginfo_t* info)
+{
+	return info->si_code == SI_QUEUE && info->si_value.sival_int == HANDOVER_VALUE;
+}
+
+void handover_free(struct globals_t* g)
+{
+	free(g->inherited);
+	g->inherited   = NULL;
+	g->n_inherited = 0;
+	free(self);
+	self = NULL;
+	if (cwd_fd != -1) {
+		close(cwd_fd);
+		cwd_fd = -1;
+	}
+}
@@ -0,0 +1,14 @@
+#ifndef HANDOVER_H_
+#define HANDOVER_H_
+
+#include <signal.h>
+#include "globals.h"
+
+int handover_init(struct globals_t* g, char** argv);
+void handover_ready(struct globals_t* g);
+void handover_spawn(struct globals_t* g);
+void handover_confirmed(struct globals_t* g);
+int handover_signal(const siginfo_t* info);
+void handover_free(struct globals_t* g);
+
+#endif /* HANDOVER_H_ */
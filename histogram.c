@@ -0,0 +1,175 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "histogram.h"
+#include "metrics.h"
+
+#define SUB (1U << HISTOGRAM_SUB_BITS)
+
+struct phase_t {
+	atomic_ullong buckets[HISTOGRAM_BUCKETS];
+	atomic_ullong count;
+	atomic_ullong sum_us;
+	atomic_ullong max_us;
+};
+
+/*
+ * Every thread records into a block of its own; the counts are atomics only so that
+ * a concurrent merge reads whole values, the writes are uncontended.
+ * Blocks are never freed: a block of an exiting thread goes to the free list
+ * with its counts intact and is picked up by the next thread that records something.
+ */
+struct block_t {
+	struct block_t* next_all;
+	struct block_t* next_free;
+	struct phase_t phases[METRICS_HISTOGRAMS];
+};
+
+static pthread_mutex_t blocks_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t key_once      = PTHREAD_ONCE_INIT;
+static pthread_key_t block_key;
+static _Atomic(struct block_t*) all_blocks;
+static struct block_t* free_blocks;
+static __thread struct block_t* local;
+
+/* What a recording thread costs: its block outlives it, but is reused by the next thread */
+size_t histogram_thread_memory(void)
+{
+	return sizeof(struct block_t);
+}
+
+static void release_block(void* arg)
+{
+	struct block_t* b = (struct block_t*)arg;
+
+	pthread_mutex_lock(&blocks_mutex);
+	b->next_free = free_blocks;
+	free_blocks  = b;
+	pthread_mutex_unlock(&blocks_mutex);
+}
+
+static void create_key(void)
+{
+	pthread_key_create(&block_key, release_block);
+}
+
+static struct block_t* acquire_block(void)
+{
+	struct block_t* b;
+
+	pthread_once(&key_once, create_key);
+	pthread_mutex_lock(&blocks_mutex);
+	b = free_blocks;
+	if (b) {
+		free_blocks = b->next_free;
+	}
+
+	pthread_mutex_unlock(&blocks_mutex);
+
+	if (!b) {
+		b = calloc(1, sizeof(struct block_t));
+		if (!b) {
+			return NULL;
+		}
+
+		/* Published once and never unlinked, so readers can walk the list without a lock */
+		b->next_all = atomic_load(&all_blocks);
+		while (!atomic_compare_exchange_weak(&all_blocks, &b->next_all, b)) {
+			;
+		}
+	}
+
+	pthread_setspecific(block_key, b);
+	return b;
+}
+
+static size_t bucket_of(uint64_t us)
+{
+	unsigned int msb;
+	unsigned int shift;
+
+	if (us < SUB) {
+		return (size_t)us;
+	}
+
+	msb = 63U - (unsigned int)__builtin_clzll(us);
+	if (msb >= HISTOGRAM_MAX_BITS) {
+		return HISTOGRAM_BUCKETS - 1;
+	}
+
+	shift = msb - HISTOGRAM_SUB_BITS;
+	return ((size_t)(shift + 1) << HISTOGRAM_SUB_BITS) + (size_t)((us >> shift) - SUB);
+}
+
+/* The largest value (in microseconds) that lands in the bucket */
+uint64_t histogram_bucket_limit(size_t bucket)
+{
+	size_t shift;
+
+	if (bucket < SUB) {
+		return (uint64_t)bucket;
+	}
+
+	shift = (bucket >> HISTOGRAM_SUB_BITS) - 1;
+	return (((uint64_t)(bucket & (SUB - 1)) + SUB + 1) << shift) - 1;
+}
+
+void histogram_record(size_t histogram, uint64_t ns)
+{
+	struct phase_t* p;
+	uint64_t us = ns / 1000;
+
+	if (!local && !(local = acquire_block())) {
+		return;
+	}
+
+	p = &local->phases[histogram];
+	atomic_fetch_add_explicit(&p->buckets[bucket_of(us)], 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&p->count, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&p->sum_us, us, memory_order_relaxed);
+	if (us > atomic_load_explicit(&p->max_us, memory_order_relaxed)) {
+		atomic_store_explicit(&p->max_us, us, memory_order_relaxed);
+	}
+}
+
+void histogram_merge(size_t histogram, struct histogram_snapshot_t* snapshot)
+{
+	memset(snapshot, 0, sizeof(*snapshot));
+
+	for (struct block_t* b = atomic_load(&all_blocks); b; b = b->next_all) {
+		struct phase_t* p = &b->phases[histogram];
+		uint64_t max      = atomic_load_explicit(&p->max_us, memory_order_relaxed);
+
+		for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+			snapshot->buckets[i] += atomic_load_explicit(&p->buckets[i], memory_order_relaxed);
+		}
+
+		snapshot->count  += atomic_load_explicit(&p->count, memory_order_relaxed);
+		snapshot->sum_us += atomic_load_explicit(&p->sum_us, memory_order_relaxed);
+		if (max > snapshot->max_us) {
+			snapshot->max_us = max;
+		}
+	}
+}
+
+/* The upper limit of the bucket holding the given percentile, in microseconds */
+uint64_t histogram_percentile(const struct histogram_snapshot_t* snapshot, double percentile)
+{
+	uint64_t rank = (uint64_t)((double)snapshot->count * percentile / 100.0 + 0.5);
+	uint64_t seen = 0;
+
+	if (rank == 0) {
+		rank = 1;
+	}
+
+	for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+		seen += snapshot->buckets[i];
+		if (seen >= rank) {
+			uint64_t limit = histogram_bucket_limit(i);
+			return limit < snapshot->max_us ? limit : snapshot->max_us;
+		}
+	}
+
+	return snapshot->max_us;
+}
@@ -0,0 +1,29 @@
+#ifndef HISTOGRAM_H_
+#define HISTOGRAM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Log-linear (HDR-style) buckets over microseconds: values below 2^HISTOGRAM_SUB_BITS
+ * get a bucket each, every further power of two is split into 2^HISTOGRAM_SUB_BITS buckets,
+ * so any value is stored with a relative error of at most 1/2^HISTOGRAM_SUB_BITS (~3%).
+ */
+#define HISTOGRAM_SUB_BITS 5
+#define HISTOGRAM_MAX_BITS 36       /* 2^36 us, about 19 hours; larger values are clamped */
+#define HISTOGRAM_BUCKETS  ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+struct histogram_snapshot_t {
+	uint64_t buckets[HISTOGRAM_BUCKETS];
+	uint64_t count;
+	uint64_t sum_us;
+	uint64_t max_us;
+};
+
+void histogram_record(size_t histogram, uint64_t ns);
+void histogram_merge(size_t histogram, struct histogram_snapshot_t* snapshot);
+uint64_t histogram_bucket_limit(size_t bucket);
+uint64_t histogram_percentile(const struct histogram_snapshot_t* snapshot, double percentile);
+size_t histogram_thread_memory(void);
+
+#endif /* HISTOGRAM_H_ */
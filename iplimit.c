@@ -0,0 +1,248 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include "iplimit.h"
+#include "globals.h"
+
+#define SHARDS          64
+#define BUCKETS         128     /* per shard */
+#define WAYS            8       /* entries per bucket */
+#define CACHE_LINE      64
+
+struct iplimit_entry_t {
+	uint8_t addr[16];
+	int64_t refilled_ms;
+	double tokens;
+	uint32_t active;
+	uint16_t family;        /* 0 for a free entry */
+};
+
+/*
+ * Set-associative table: an address can only live in the WAYS entries of its bucket,
+ * so a lookup never scans more than one bucket, and an insert recycles the stalest
+ * idle entry of the bucket. Nothing ever has to be swept: under a scan from spoofed
+ * or random addresses the table simply keeps the most recently seen ones.
+ */
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+struct iplimit_shard_t {
+	_Alignas(CACHE_LINE) pthread_mutex_t mutex;
+	struct iplimit_entry_t entries[BUCKETS][WAYS];
+};
+
+struct iplimit_t {
+	struct iplimit_shard_t shards[SHARDS];
+	uint64_t seed;
+	double refill_per_ms;
+};
+#pragma clang diagnostic pop
+
+static int64_t now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Returns the length of the address, 0 for unsupported families */
+static size_t address_key(const struct sockaddr_storage* addr, uint8_t* key)
+{
+	if (addr->ss_family == AF_INET) {
+		memcpy(key, &((const struct sockaddr_in*)addr)->sin_addr, 4);
+		return 4;
+	}
+
+	if (addr->ss_family == AF_INET6) {
+		memcpy(key, &((const struct sockaddr_in6*)addr)->sin6_addr, 16);
+		return 16;
+	}
+
+	return 0;
+}
+
+/* The seed is random so that a client cannot pick addresses that all land in one bucket */
+static uint64_t hash_key(const struct iplimit_t* t, const uint8_t* key, size_t len)
+{
+	uint64_t h = t->seed;
+	for (size_t i = 0; i < len; ++i) {
+		h = (h ^ key[i]) * 0x100000001B3ULL;
+	}
+
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static struct iplimit_entry_t* find(struct iplimit_entry_t* bucket, uint16_t family, const uint8_t* key, size_t len)
+{
+	for (size_t i = 0; i < WAYS; ++i) {
+		if (bucket[i].family == family && !memcmp(bucket[i].addr, key, len)) {
+			return &bucket[i];
+		}
+	}
+
+	return NULL;
+}
+
+static void refill(struct globals_t* g, struct iplimit_t* t, struct iplimit_entry_t* e, int64_t now)
+{
+	e->tokens += (double)(now - e->refilled_ms) * t->refill_per_ms;
+	if (e->tokens > (double)g->ip_burst) {
+		e->tokens = (double)g->ip_burst;
+	}
+
+	e->refilled_ms = now;
+}
+
+/* An entry with no sessions and a full bucket of tokens carries no state and may be recycled */
+static struct iplimit_entry_t* recycle(struct globals_t* g, struct iplimit_t* t, struct iplimit_entry_t* bucket, int64_t now)
+{
+	struct iplimit_entry_t* victim = NULL;
+
+	for (size_t i = 0; i < WAYS; ++i) {
+		struct iplimit_entry_t* e = &bucket[i];
+		if (!e->family) {
+			return e;
+		}
+
+		if (!e->active && (!victim || e->refilled_ms < victim->refilled_ms)) {
+			victim = e;
+		}
+	}
+
+	if (victim && g->ip_rate) {
+		refill(g, t, victim, now);
+		if (victim->tokens < (double)g->ip_burst) {
+			/* Forgetting it now would hand out a fresh burst */
+			victim = NULL;
+		}
+	}
+
+	return victim;
+}
+
+int iplimit_admit(struct globals_t* g, const struct sockaddr_storage* addr)
+{
+	struct iplimit_t* t = g->iplimit;
+	struct iplimit_shard_t* shard;
+	struct iplimit_entry_t* bucket;
+	struct iplimit_entry_t* e;
+	uint8_t key[16];
+	size_t len;
+	uint64_t h;
+	int64_t now;
+	int admitted = IPLIMIT_UNTRACKED;
+
+	if (!t || !(len = address_key(addr, key))) {
+		return IPLIMIT_UNTRACKED;
+	}
+
+	h      = hash_key(t, key, len);
+	shard  = &t->shards[h % SHARDS];
+	bucket = shard->entries[(h / SHARDS) % BUCKETS];
+	now    = now_ms();
+
+	pthread_mutex_lock(&shard->mutex);
+	{
+		e = find(bucket, addr->ss_family, key, len);
+		if (!e && (e = recycle(g, t, bucket, now)) != NULL) {
+			memset(e->addr, 0, sizeof(e->addr));
+			memcpy(e->addr, key, len);
+			e->family      = addr->ss_family;
+			e->active      = 0;
+			e->tokens      = (double)g->ip_burst;
+			e->refilled_ms = now;
+		}
+
+		/*
+		 * No entry when every entry of the bucket has live sessions: let the client in untracked rather than punish it for a collision.
+		 * Its release must then be skipped, or it would take a session away from whichever client has got the entry in the meantime.
+		 */
+		if (e) {
+			if (g->ip_rate) {
+				refill(g, t, e, now);
+			}
+
+			if (g->max_per_ip && e->active >= g->max_per_ip) {
+				admitted = IPLIMIT_REJECTED;
+			}
+			else if (g->ip_rate && e->tokens < 1.0) {
+				admitted = IPLIMIT_REJECTED;
+			}
+			else {
+				e->tokens -= g->ip_rate ? 1.0 : 0.0;
+				++e->active;
+				admitted = IPLIMIT_TRACKED;
+			}
+		}
+	}
+	pthread_mutex_unlock(&shard->mutex);
+	return admitted;
+}
+
+void iplimit_release(struct globals_t* g, const struct sockaddr_storage* addr)
+{
+	struct iplimit_t* t = g->iplimit;
+	struct iplimit_shard_t* shard;
+	struct iplimit_entry_t* e;
+	uint8_t key[16];
+	size_t len;
+	uint64_t h;
+
+	if (!t || !(len = address_key(addr, key))) {
+		return;
+	}
+
+	h     = hash_key(t, key, len);
+	shard = &t->shards[h % SHARDS];
+
+	pthread_mutex_lock(&shard->mutex);
+	e = find(shard->entries[(h / SHARDS) % BUCKETS], addr->ss_family, key, len);
+	if (e && e->active) {
+		--e->active;
+	}
+
+	pthread_mutex_unlock(&shard->mutex);
+}
+
+int iplimit_start(struct globals_t* g)
+{
+	struct iplimit_t* t;
+	struct timespec ts;
+	void* mem;
+
+	if (posix_memalign(&mem, CACHE_LINE, sizeof(struct iplimit_t))) {
+		return -1;
+	}
+
+	t = (struct iplimit_t*)mem;
+	memset(t, 0, sizeof(struct iplimit_t));
+	for (size_t i = 0; i < SHARDS; ++i) {
+		pthread_mutex_init(&t->shards[i].mutex, NULL);
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	t->seed          = 0xCBF29CE484222325ULL ^ ((uint64_t)ts.tv_nsec << 32) ^ (uint64_t)ts.tv_sec ^ ((uint64_t)getpid() << 16);
+	t->refill_per_ms = (double)g->ip_rate / 60000.0;
+
+	g->iplimit = t;
+	return 0;
+}
+
+void iplimit_stop(struct globals_t* g)
+{
+	struct iplimit_t* t = g->iplimit;
+
+	if (t) {
+		g->iplimit = NULL;
+		for (size_t i = 0; i < SHARDS; ++i) {
+			pthread_mutex_destroy(&t->shards[i].mutex);
+		}
+
+		free(t);
+	}
+}
@@ -0,0 +1,17 @@
+#ifndef IPLIMIT_H_
+#define IPLIMIT_H_
+
+#include <sys/socket.h>
+#include "globals.h"
+
+/* iplimit_admit() results; only a tracked client has to be released */
+#define IPLIMIT_REJECTED  0
+#define IPLIMIT_UNTRACKED 1
+#define IPLIMIT_TRACKED   2
+
+int iplimit_start(struct globals_t* g);
+int iplimit_admit(struct globals_t* g, const struct sockaddr_storage* addr);
+void iplimit_release(struct globals_t* g, const struct sockaddr_storage* addr);
+void iplimit_stop(struct globals_t* g);
+
+#endif /* IPLIMIT_H_ */
@@ -0,0 +1,342 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "kexlimit.h"
+#include "globals.h"
+#include "evloop.h"
+#include "metrics.h"
+#include "worker.h"
+
+/*
+ * At most max_kex key exchanges run at once; the rest wait in arrival order.
+ * A freed slot is handed over directly to the head of the queue, so a newcomer
+ * can never overtake a waiter. Blocking waiters (thread-per-connection and pooled workers)
+ * sleep on a condition variable of their own; event-loop sessions are handed back
+ * to their loop, which starts the key exchange on its next iteration.
+ */
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+struct kexlimit_t {
+	pthread_mutex_t mutex;
+	size_t max;
+	size_t in_flight;
+	size_t waiting;
+	struct connection_info_t* head;
+	struct connection_info_t* tail;
+};
+#pragma clang diagnostic pop
+
+static void take_slot(struct kexlimit_t* l, struct connection_info_t* conn)
+{
+	++l->in_flight;
+	conn->kex_state = KEX_HOLDING;
+	metrics_observe(METRIC_kex_wait, conn->kex_since ? monotonic_ns() - conn->kex_since : 0);
+}
+
+static void enqueue(struct kexlimit_t* l, struct connection_info_t* conn)
+{
+	conn->kex_state = KEX_WAITING;
+	conn->kex_since = monotonic_ns();
+	conn->kex_next  = NULL;
+	conn->kex_prev  = l->tail;
+	if (l->tail) {
+		l->tail->kex_next = conn;
+	}
+	else {
+		l->head = conn;
+	}
+
+	l->tail = conn;
+	++l->waiting;
+}
+
+static void unlink_waiter(struct kexlimit_t* l, struct connection_info_t* conn)
+{
+	if (conn->kex_prev) {
+		conn->kex_prev->kex_next = conn->kex_next;
+	}
+	else {
+		l->head = conn->kex_next;
+	}
+
+	if (conn->kex_next) {
+		conn->kex_next->kex_prev = conn->kex_prev;
+	}
+	else {
+		l->tail = conn->kex_prev;
+	}
+
+	conn->kex_next = NULL;
+	conn->kex_prev = NULL;
+	--l->waiting;
+}
+
+/* Called with the mutex held */
+static void grant(struct kexlimit_t* l)
+{
+	while (l->head && l->in_flight < l->max) {
+		struct connection_info_t* conn = l->head;
+
+		unlink_waiter(l, conn);
+		take_slot(l, conn);
+		if (conn->kex_cond) {
+			pthread_cond_signal(conn->kex_cond);
+		}
+		else {
+			evloop_kex_granted(conn);
+		}
+	}
+}
+
+int kexlimit_start(struct globals_t* g)
+{
+	struct kexlimit_t* l = calloc(1, sizeof(struct kexlimit_t));
+	if (!l) {
+		return -1;
+	}
+
+	pthread_mutex_init(&l->mutex, NULL);
+	l->max      = g->max_kex;
+	g->kexlimit = l;
+	return 0;
+}
+
+void kexlimit_stop(struct globals_t* g)
+{
+	struct kexlimit_t* l = g->kexlimit;
+
+	if (l) {
+		g->kexlimit = NULL;
+		pthread_mutex_destroy(&l->mutex);
+		free(l);
+	}
+}
+
+/* Wakes up every blocking waiter on shutdown; queued event-loop sessions are closed by their loops */
+void kexlimit_drain(struct globals_t* g)
+{
+	struct kexlimit_t* l = g->kexlimit;
+
+	if (!l) {
+		return;
+	}
+
+	pthread_mutex_lock(&l->mutex);
+	for (struct connection_info_t* conn = l->head; conn; conn = conn->kex_next) {
+		if (conn->kex_cond) {
+			pthread_cond_signal(conn->kex_cond);
+		}
+	}
+
+	pthread_mutex_unlock(&l->mutex);
+}
+
+/* Blocks until the session may start its key exchange; 0 if the wait deadline has passed first */
+int kexlimit_enter(struct connection_info_t* conn)
+{
+	struct kexlimit_t* l = globals.kexlimit;
+	pthread_condattr_t attr;
+	pthread_cond_t cond;
+	struct timespec ts;
+	uint64_t deadline;
+	int granted;
+
+	if (!l) {
+		return 1;
+	}
+
+	pthread_mutex_lock(&l->mutex);
+	if (!l->head && l->in_flight < l->max) {
+		conn->kex_since = 0;
+		take_slot(l, conn);
+		pthread_mutex_unlock(&l->mutex);
+		return 1;
+	}
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	conn->kex_cond = &cond;
+	enqueue(l, conn);
+	deadline = conn->kex_since + (uint64_t)globals.kex_wait * 1000000;
+
+	ts.tv_sec  = (time_t)(deadline / 1000000000);
+	ts.tv_nsec = (long int)(deadline % 1000000000);
+
+	/* An expired session timer wakes the waiter through kexlimit_interrupt(), a shutdown through kexlimit_drain() */
+	while (conn->kex_state == KEX_WAITING && !conn->expired && !globals.terminate) {
+		if (pthread_cond_timedwait(&cond, &l->mutex, &ts) == ETIMEDOUT) {
+			break;
+		}
+	}
+
+	granted = conn->kex_state == KEX_HOLDING;
+	if (!granted) {
+		unlink_waiter(l, conn);
+		conn->kex_state = KEX_IDLE;
+	}
+
+	conn->kex_cond = NULL;
+	pthread_mutex_unlock(&l->mutex);
+	pthread_cond_destroy(&cond);
+
+	if (!granted && !conn->expired && !globals.terminate) {
+		metrics_inc(METRIC_kex_wait_timeouts_total);
+	}
+
+	return granted;
+}
+
+/* Non-blocking: 1 if the session may start its key exchange now, 0 if it has been queued */
+int kexlimit_try(struct connection_info_t* conn)
+{
+	struct kexlimit_t* l = globals.kexlimit;
+	int granted;
+
+	if (!l) {
+		return 1;
+	}
+
+	pthread_mutex_lock(&l->mutex);
+	granted = !l->head && l->in_flight < l->max;
+	if (granted) {
+		conn->kex_since = 0;
+		take_slot(l, conn);
+	}
+	else {
+		conn->kex_cond = NULL;
+		enqueue(l, conn);
+	}
+
+	pthread_mutex_unlock(&l->mutex);
+	return granted;
+}
+
+/* Takes a queued session out of the queue; 1 if it has been granted a slot in the meantime */
+int kexlimit_cancel(struct connection_info_t* conn)
+{
+	struct kexlimit_t* l = globals.kexlimit;
+	int granted;
+
+	pthread_mutex_lock(&l->mutex);
+	granted = conn->kex_state == KEX_HOLDING;
+	if (conn->kex_state == KEX_WAITING) {
+		unlink_waiter(l, conn);
+		conn->kex_state = KEX_IDLE;
+	}
+
+	pthread_mutex_unlock(&l->mutex);
+	return granted;
+}
+
+/* Wakes a blocked waiter whose session has expired; called on the timer thread */
+void kexlimit_interrupt(struct connection_info_t* conn)
+{
+	struct kexlimit_t* l = globals.kexlimit;
+
+	if (l) {
+		pthread_mutex_lock(&l->mutex);
+		if (conn->kex_cond) {
+			pthread_cond_signal(conn->kex_cond);
+		}
+
+		pthread_mutex_unlock(&l->mutex);
+	}
+}
+
+/* Called with the mutex held */
+static void give_back(struct kexlimit_t* l, struct connection_info_t* conn)
+{
+	conn->kex_state = KEX_IDLE;
+	--l->in_flight;
+	grant(l);
+}
+
+/* Gives the slot back once the key exchange is over, whatever its outcome; a no-op if the session holds none */
+void kexlimit_leave(struct connection_info_t* conn)
+{
+	struct kexlimit_t* l = globals.kexlimit;
+
+	if (l) {
+		pthread_mutex_lock(&l->mutex);
+		if (conn->kex_state == KEX_HOLDING) {
+			give_back(l, conn);
+		}
+
+		pthread_mutex_unlock(&l->mutex);
+	}
+}
+
+/*
+ * For an event-loop session about to be freed, whatever its state: takes it out of the queue,
+ * or gives its slot back. grant() hands a slot over and queues the session on its loop's kex_ready
+ * list under the mutex, so a granted session is unlinked from that list before the mutex is released.
+ */
+void kexlimit_release(struct connection_info_t* conn)
+{
+	struct kexlimit_t* l = globals.kexlimit;
+
+	if (l) {
+		pthread_mutex_lock(&l->mutex);
+		if (conn->kex_state == KEX_WAITING) {
+			unlink_waiter(l, conn);
+			conn->kex_state = KEX_IDLE;
+		}
+		else if (conn->kex_state == KEX_HOLDING) {
+			if (!conn->kex_done) {
+				evloop_kex_revoked(conn);
+			}
+
+			give_back(l, conn);
+		}
+
+		pthread_mutex_unlock(&l->mutex);
+	}
+}
+
+/* 1 if the session waits in the queue */
+int kexlimit_queued(struct connection_info_t* conn)
+{
+	struct kexlimit_t* l = globals.kexlimit;
+	int queued           = 0;
+
+	if (l) {
+		pthread_mutex_lock(&l->mutex);
+		queued = conn->kex_state == KEX_WAITING;
+		pthread_mutex_unlock(&l->mutex);
+	}
+
+	return queued;
+}
+
+size_t kexlimit_in_flight(struct globals_t* g)
+{
+	struct kexlimit_t* l = g->kexlimit;
+	size_t n             = 0;
+
+	if (l) {
+		pthread_mutex_lock(&l->mutex);
+		n = l->in_flight;
+		pthread_mutex_unlock(&l->mutex);
+	}
+
+	return n;
+}
+
+size_t kexlimit_waiting(struct globals_t* g)
+{
+	struct kexlimit_t* l = g->kexlimit;
+	size_t n             = 0;
+
+	if (l) {
+		pthread_mutex_lock(&l->mutex);
+		n = l->waiting;
+		pthread_mutex_unlock(&l->mutex);
+	}
+
+	return n;
+}
@@ -0,0 +1,26 @@
+#ifndef KEXLIMIT_H_
+#define KEXLIMIT_H_
+
+#include "globals.h"
+
+/* connection_info_t.kex_state */
+#define KEX_IDLE    0
+#define KEX_WAITING 1
+#define KEX_HOLDING 2
+
+int kexlimit_start(struct globals_t* g);
+void kexlimit_stop(struct globals_t* g);
+void kexlimit_drain(struct globals_t* g);
+
+int kexlimit_enter(struct connection_info_t* conn);
+int kexlimit_try(struct connection_info_t* conn);
+int kexlimit_cancel(struct connection_info_t* conn);
+void kexlimit_interrupt(struct connection_info_t* conn);
+void kexlimit_leave(struct connection_info_t* conn);
+void kexlimit_release(struct connection_info_t* conn);
+int kexlimit_queued(struct connection_info_t* conn);
+
+size_t kexlimit_in_flight(struct globals_t* g);
+size_t kexlimit_waiting(struct globals_t* g);
+
+#endif /* KEXLIMIT_H_ */
@@ -0,0 +1,490 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+#include "listener.h"
+#include "globals.h"
+
+#ifndef SO_REUSEPORT
+#define SO_REUSEPORT 15
+#endif
+
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51
+#endif
+
+#ifndef SO_INCOMING_CPU
+#define SO_INCOMING_CPU 49
+#endif
+
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+
+static struct listen_stats_t baseline;
+
+static int read_netstat(struct listen_stats_t* stats);
+
+/* Optional tuning: a failure is reported, but the socket is still usable */
+static void tune_listener(struct globals_t* g, int fd)
+{
+	if (g->defer_accept && setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &g->defer_accept, sizeof(g->defer_accept)) == -1) {
+		fprintf(stderr, "WARNING: failed to set TCP_DEFER_ACCEPT: %s\n", strerror(errno));
+	}
+
+	/* Accepted sockets inherit the setting */
+	if (g->busy_poll && setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &g->busy_poll, sizeof(g->busy_poll)) == -1) {
+		fprintf(stderr, "WARNING: failed to set SO_BUSY_POLL: %s\n", strerror(errno));
+	}
+}
+
+static int open_socket(struct globals_t* g, const char* address, const char* port, int reuseport)
+{
+	struct addrinfo hints;
+	struct addrinfo* ai;
+	int fd  = -1;
+	int one = 1;
+	int rc;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_flags    = AI_PASSIVE;
+	hints.ai_socktype = SOCK_STREAM;
+
+	rc = getaddrinfo(address, port, &hints, &ai);
+	if (rc != 0) {
+		fprintf(stderr, "Error resolving %s:%s: %s\n", address, port, gai_strerror(rc));
+		return -1;
+	}
+
+	/* With several addresses, [::] must not claim the IPv4 port as well */
+	fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+	if (
+		   fd == -1
+		|| setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1
+		|| (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1)
+		|| (ai->ai_family == AF_INET6 && g->n_bind_addresses > 1 && setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &one, sizeof(one)) == -1)
+		|| bind(fd, ai->ai_addr, ai->ai_addrlen) == -1
+		|| listen(fd, g->backlog) == -1
+	) {
+		fprintf(stderr, "Error listening to socket %s:%s: %s\n", address, port, strerror(errno));
+		if (fd != -1) {
+			close(fd);
+		}
+
+		fd = -1;
+	}
+
+	freeaddrinfo(ai);
+	return fd;
+}
+
+/* A plain listening socket on another port of the (first) bind address, for the auxiliary services */
+int listen_on(struct globals_t* g, const char* port)
+{
+	return open_socket(g, g->bind_addresses[0], port, 0);
+}
+
+static int same_address(const struct sockaddr_storage* a, const struct sockaddr_storage* b, int wildcard)
+{
+	if (a->ss_family != b->ss_family) {
+		return 0;
+	}
+
+	if (a->ss_family == AF_INET) {
+		const struct sockaddr_in* x = (const struct sockaddr_in*)a;
+		const struct sockaddr_in* y = (const struct sockaddr_in*)b;
+
+		return x->sin_port == y->sin_port && (x->sin_addr.s_addr == y->sin_addr.s_addr || (wildcard && y->sin_addr.s_addr == htonl(INADDR_ANY)));
+	}
+
+	if (a->ss_family == AF_INET6) {
+		const struct sockaddr_in6* x = (const struct sockaddr_in6*)a;
+		const struct sockaddr_in6* y = (const struct sockaddr_in6*)b;
+
+		return x->sin6_port == y->sin6_port && (
+			   !memcmp(&x->sin6_addr, &y->sin6_addr, sizeof(x->sin6_addr))
+			|| (wildcard && !memcmp(&y->sin6_addr, &in6addr_any, sizeof(y->sin6_addr)))
+		);
+	}
+
+	return 0;
+}
+
+/* Fills the endpoint in from the address the socket is bound to; -1 if it is not an IP socket */
+static int describe_endpoint(struct endpoint_t* e, int fd)
+{
+	socklen_t len = sizeof(e->addr);
+	char ip[INET6_ADDRSTRLEN];
+
+	if (getsockname(fd, (struct sockaddr*)&e->addr, &len) == -1) {
+		return -1;
+	}
+
+	if (e->addr.ss_family == AF_INET) {
+		const struct sockaddr_in* sin = (const struct sockaddr_in*)&e->addr;
+		inet_ntop(AF_INET, &sin->sin_addr, ip, sizeof(ip));
+		snprintf(e->name, sizeof(e->name), "%s:%u", ip, ntohs(sin->sin_port));
+	}
+	else if (e->addr.ss_family == AF_INET6) {
+		const struct sockaddr_in6* sin6 = (const struct sockaddr_in6*)&e->addr;
+		inet_ntop(AF_INET6, &sin6->sin6_addr, ip, sizeof(ip));
+		snprintf(e->name, sizeof(e->name), "[%s]:%u", ip, ntohs(sin6->sin6_port));
+	}
+	else {
+		return -1;
+	}
+
+	return 0;
+}
+
+/* The endpoint a connection has arrived on, from its local address */
+const char* listener_name(struct globals_t* g, const struct sockaddr_storage* local)
+{
+	if (g->n_endpoints == 1) {
+		return g->endpoints[0].name;
+	}
+
+	for (size_t i = 0; i < g->n_endpoints; ++i) {
+		if (same_address(local, &g->endpoints[i].addr, 1)) {
+			return g->endpoints[i].name;
+		}
+	}
+
+	return "?";
+}
+
+/*
+ * Steers connections inside the SO_REUSEPORT group by the source address:
+ * the program returns the index of the socket (in bind order) which gets the connection.
+ * The address family is that of the packet, not of the socket: a dual-stack socket gets IPv4 packets too.
+ */
+static int attach_reuseport_bpf(int fd, size_t n)
+{
+	struct sock_filter code[] = {
+		BPF_STMT(BPF_LD  | BPF_H   | BPF_ABS, (__u32)SKF_AD_OFF + SKF_AD_PROTOCOL),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,   ETH_P_IP, 12, 0),
+
+		/* IPv6: A = XOR of the four words of the source address */
+		BPF_STMT(BPF_LD  | BPF_W   | BPF_ABS, (__u32)SKF_NET_OFF + 8),
+		BPF_STMT(BPF_MISC | BPF_TAX,          0),
+		BPF_STMT(BPF_LD  | BPF_W   | BPF_ABS, (__u32)SKF_NET_OFF + 12),
+		BPF_STMT(BPF_ALU | BPF_XOR | BPF_X,   0),
+		BPF_STMT(BPF_MISC | BPF_TAX,          0),
+		BPF_STMT(BPF_LD  | BPF_W   | BPF_ABS, (__u32)SKF_NET_OFF + 16),
+		BPF_STMT(BPF_ALU | BPF_XOR | BPF_X,   0),
+		BPF_STMT(BPF_MISC | BPF_TAX,          0),
+		BPF_STMT(BPF_LD  | BPF_W   | BPF_ABS, (__u32)SKF_NET_OFF + 20),
+		BPF_STMT(BPF_ALU | BPF_XOR | BPF_X,   0),
+		BPF_STMT(BPF_ALU | BPF_MOD | BPF_K,   (__u32)n),
+		BPF_STMT(BPF_RET | BPF_A,             0),
+
+		/* IPv4: A = source address */
+		BPF_STMT(BPF_LD  | BPF_W   | BPF_ABS, (__u32)SKF_NET_OFF + 12),
+		BPF_STMT(BPF_ALU | BPF_MOD | BPF_K,   (__u32)n),
+		BPF_STMT(BPF_RET | BPF_A,             0)
+	};
+
+	struct sock_fprog prog = { sizeof(code) / sizeof(code[0]), code };
+
+	return setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+}
+
+static void assign_cpus(struct globals_t* g)
+{
+	cpu_set_t set;
+	int cpus[CPU_SETSIZE];
+	int n = 0;
+
+	if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+		for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+			if (CPU_ISSET(cpu, &set)) {
+				cpus[n++] = cpu;
+			}
+		}
+	}
+
+	for (size_t i = 0; i < g->acceptors; ++i) {
+		g->listeners[i].cpu = n > 0 ? cpus[i % (size_t)n] : -1;
+	}
+}
+
+/*
+ * Prefer the acceptor pinned to the CPU that handled the packet: the connection is then
+ * accepted and served where its softirq ran. The BPF program, when attached, takes precedence.
+ */
+static void set_incoming_cpu(struct globals_t* g)
+{
+	for (size_t i = 0; i < g->acceptors; ++i) {
+		int cpu = g->listeners[i].cpu;
+
+		for (size_t e = 0; cpu >= 0 && e < g->n_endpoints; ++e) {
+			int fd = g->listeners[i].fds[e];
+			if (fd != -1 && setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) == -1) {
+				fprintf(stderr, "WARNING: failed to set SO_INCOMING_CPU: %s\n", strerror(errno));
+				return;
+			}
+		}
+	}
+}
+
+static int alloc_listeners(struct globals_t* g)
+{
+	g->listeners = calloc(g->acceptors, sizeof(struct listener_t));
+	if (!g->listeners) {
+		perror("calloc");
+		return -1;
+	}
+
+	for (size_t i = 0; i < g->acceptors; ++i) {
+		g->listeners[i].cpu = -1;
+		g->listeners[i].fds = malloc(g->n_endpoints * sizeof(int));
+		if (!g->listeners[i].fds) {
+			perror("malloc");
+			return -1;
+		}
+
+		for (size_t e = 0; e < g->n_endpoints; ++e) {
+			g->listeners[i].fds[e] = -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Every address on every port; every endpoint gets a socket per acceptor */
+static int open_endpoints(struct globals_t* g)
+{
+	int reuseport  = g->acceptors > 1;
+	g->n_endpoints = g->n_bind_addresses * g->n_bind_ports;
+
+	if (alloc_listeners(g)) {
+		return -1;
+	}
+
+	for (size_t e = 0; e < g->n_endpoints; ++e) {
+		const char* address = g->bind_addresses[e / g->n_bind_ports];
+		const char* port    = g->bind_ports[e % g->n_bind_ports];
+
+		for (size_t i = 0; i < g->acceptors; ++i) {
+			int fd = open_socket(g, address, port, reuseport);
+			if (fd == -1) {
+				return -1;
+			}
+
+			g->listeners[i].fds[e] = fd;
+			tune_listener(g, fd);
+		}
+
+		if (describe_endpoint(&g->endpoints[e], g->listeners[0].fds[e])) {
+			snprintf(g->endpoints[e].name, sizeof(g->endpoints[e].name), "%s:%s", address, port);
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Sockets handed over by a predecessor (or the service manager) are already bound and listening.
+ * Those bound to the same address form an endpoint; the k-th socket of every endpoint goes to acceptor k,
+ * so there are as many acceptors as sockets in the largest group, whatever --acceptors says.
+ */
+static int adopt_endpoints(struct globals_t* g)
+{
+	size_t* group = calloc(g->n_inherited, sizeof(size_t));
+	size_t* rank  = calloc(g->n_inherited, sizeof(size_t));
+	size_t* size  = calloc(g->n_inherited, sizeof(size_t));
+	int rc        = -1;
+
+	if (!group || !rank || !size) {
+		perror("calloc");
+		goto done;
+	}
+
+	g->n_endpoints = 0;
+	g->acceptors   = 0;
+	for (size_t k = 0; k < g->n_inherited; ++k) {
+		struct endpoint_t e;
+		size_t i = 0;
+
+		if (describe_endpoint(&e, g->inherited[k])) {
+			fprintf(stderr, "Inherited descriptor %d is not an IP socket\n", g->inherited[k]);
+			goto done;
+		}
+
+		while (i < g->n_endpoints && !same_address(&e.addr, &g->endpoints[i].addr, 0)) {
+			++i;
+		}
+
+		if (i == g->n_endpoints) {
+			g->endpoints[g->n_endpoints++] = e;
+		}
+
+		group[k] = i;
+		rank[k]  = size[i]++;
+		if (size[i] > g->acceptors) {
+			g->acceptors = size[i];
+		}
+	}
+
+	if (alloc_listeners(g)) {
+		goto done;
+	}
+
+	for (size_t k = 0; k < g->n_inherited; ++k) {
+		g->listeners[rank[k]].fds[group[k]] = g->inherited[k];
+		tune_listener(g, g->inherited[k]);
+	}
+
+	rc = 0;
+
+done:
+	free(group);
+	free(rank);
+	free(size);
+	return rc;
+}
+
+int open_listeners(struct globals_t* g)
+{
+	size_t n = g->n_inherited ? g->n_inherited : g->n_bind_addresses * g->n_bind_ports;
+
+	g->endpoints = calloc(n, sizeof(struct endpoint_t));
+	if (!g->endpoints) {
+		perror("calloc");
+		return -1;
+	}
+
+	if (g->n_inherited ? adopt_endpoints(g) : open_endpoints(g)) {
+		return -1;
+	}
+
+	if (g->acceptors > 1) {
+		assign_cpus(g);
+		set_incoming_cpu(g);
+		for (size_t e = 0; g->reuseport_bpf && e < g->n_endpoints; ++e) {
+			if (attach_reuseport_bpf(g->listeners[0].fds[e], g->acceptors) == -1) {
+				fprintf(stderr, "WARNING: failed to attach the SO_REUSEPORT BPF program: %s\n", strerror(errno));
+				break;
+			}
+		}
+	}
+
+	read_netstat(&baseline);
+	return 0;
+}
+
+void close_listeners(struct globals_t* g)
+{
+	if (g->listeners) {
+		for (size_t i = 0; i < g->acceptors; ++i) {
+			for (size_t e = 0; g->listeners[i].fds && e < g->n_endpoints; ++e) {
+				if (g->listeners[i].fds[e] != -1) {
+					close(g->listeners[i].fds[e]);
+				}
+			}
+
+			free(g->listeners[i].fds);
+		}
+
+		free(g->listeners);
+		g->listeners = NULL;
+	}
+
+	free(g->endpoints);
+	g->endpoints   = NULL;
+	g->n_endpoints = 0;
+}
+
+/* The current and the maximum length of the accept queue of a listening socket */
+int listener_queue(int fd, unsigned int* len, unsigned int* max)
+{
+	struct tcp_info info;
+	socklen_t size = sizeof(info);
+
+	if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &size) == -1) {
+		return -1;
+	}
+
+	*len = info.tcpi_unacked;
+	*max = info.tcpi_sacked;
+	return 0;
+}
+
+/*
+ * The kernel counts accept queue overflows per network namespace only (TcpExt in /proc/net/netstat):
+ * ListenOverflows are connections that found the accept queue full,
+ * ListenDrops are all the connections dropped by listening sockets, overflows included.
+ */
+static int read_netstat(struct listen_stats_t* stats)
+{
+	char names[4096];
+	char values[4096];
+	int found = 0;
+	FILE* f   = fopen("/proc/net/netstat", "r");
+
+	if (!f) {
+		return -1;
+	}
+
+	while (fgets(names, sizeof(names), f) && fgets(values, sizeof(values), f)) {
+		char* nsave;
+		char* vsave;
+		char* name;
+		char* value;
+
+		if (strncmp(names, "TcpExt:", 7)) {
+			continue;
+		}
+
+		name  = strtok_r(names, " \n", &nsave);
+		value = strtok_r(values, " \n", &vsave);
+		while ((name = strtok_r(NULL, " \n", &nsave)) && (value = strtok_r(NULL, " \n", &vsave))) {
+			if (!strcmp(name, "ListenOverflows")) {
+				stats->overflows = strtoull(value, NULL, 10);
+				++found;
+			}
+			else if (!strcmp(name, "ListenDrops")) {
+				stats->drops = strtoull(value, NULL, 10);
+				++found;
+			}
+		}
+
+		break;
+	}
+
+	fclose(f);
+	return found == 2 ? 0 : -1;
+}
+
+/* The counters since the listeners were opened */
+int listen_stats(struct listen_stats_t* stats)
+{
+	if (read_netstat(stats)) {
+		return -1;
+	}
+
+	stats->overflows -= baseline.overflows;
+	stats->drops     -= baseline.drops;
+	return 0;
+}
+
+void pin_to_cpu(int cpu)
+{
+	if (cpu >= 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	}
+}
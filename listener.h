@@ -0,0 +1,36 @@
+#ifndef LISTENER_H_
+#define LISTENER_H_
+
+#include <pthread.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "globals.h"
+
+/* An address and port the daemon listens on */
+struct endpoint_t {
+	char name[INET6_ADDRSTRLEN + 8];    /* [ADDRESS]:PORT as bound, for the logs */
+	struct sockaddr_storage addr;
+};
+
+/* An acceptor: one thread accepting connections from its socket of every endpoint */
+struct listener_t {
+	pthread_t thread;
+	int* fds;                           /* indexed by endpoint, -1 if the acceptor has no socket for it */
+	int cpu;
+	int started;
+};
+
+struct listen_stats_t {
+	unsigned long long overflows;
+	unsigned long long drops;
+};
+
+int open_listeners(struct globals_t* g);
+int listen_on(struct globals_t* g, const char* port);
+const char* listener_name(struct globals_t* g, const struct sockaddr_storage* local);
+void close_listeners(struct globals_t* g);
+int listener_queue(int fd, unsigned int* len, unsigned int* max);
+int listen_stats(struct listen_stats_t* stats);
+void pin_to_cpu(int cpu);
+
+#endif /* LISTENER_H_ */
@@ -1,36 +1,333 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <time.h>
 #include <unistd.h>
+#include <sys/uio.h>
 #include "log.h"
 #include "globals.h"
+#include "events.h"
+
+#define LOG_RECORD_SIZE 1024
+#define LOG_BATCH       128
+#define CACHE_LINE      64
+
+struct log_record_t {
+	atomic_size_t seq;
+	time_t time;
+	int priority;
+	int raw;
+	unsigned int len;
+	char text[LOG_RECORD_SIZE];
+};
+
+/*
+ * Bounded lock-free queue (D. Vyukov's sequence-numbered ring): any number of producers,
+ * a single consumer - the writer thread. The sequence number of every slot tells
+ * whether the slot is free for the producer at position `pos` (seq == pos)
+ * or holds a record ready for the consumer (seq == pos + 1).
+ */
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+struct log_queue_t {
+	_Alignas(CACHE_LINE) atomic_size_t enqueue_pos;
+	_Alignas(CACHE_LINE) size_t dequeue_pos;
+	atomic_int sleeping;
+	atomic_int stop;
+	atomic_ullong dropped;
+	unsigned long long reported_drops;
+	struct log_record_t* ring;
+	size_t mask;
+	sem_t wakeup;
+	pthread_t writer;
+};
+#pragma clang diagnostic pop
+
+static __thread char format_buffer[LOG_RECORD_SIZE];
+
+static const char* daemon_name(void)
+{
+#ifndef MINIMALISTIC_BUILD
+	return globals.daemon_name;
+#else
+	return "ssh-honeypotd";
+#endif
+}
+
+static int use_syslog(void)
+{
+#ifndef MINIMALISTIC_BUILD
+	return !globals.no_syslog;
+#else
+	return 0;
+#endif
+}
+
+static int format_prefix(time_t now, char* buf, size_t size)
+{
+	struct tm timeinfo;
+	char timestring[32];
+
+	localtime_r(&now, &timeinfo);
+	strftime(timestring, sizeof(timestring), "%Y-%m-%d %H:%M:%S", &timeinfo);
+	return snprintf(buf, size, "%s %s[%d]: ", timestring, daemon_name(), getpid());
+}
+
+/* The message as it should be written: as is for the text format, wrapped into a message event for JSON */
+static size_t format_line(char* buf, size_t size, const char* text)
+{
+	if (globals.log_format == LOG_FORMAT_JSON) {
+		struct event_message_t e = { text };
+		return encode_message(buf, size, &e);
+	}
+
+	size_t len = strlen(text);
+	if (len >= size) {
+		len = size - 1;
+	}
+
+	memmove(buf, text, len);
+	buf[len] = 0;
+	return len;
+}
+
+static void writev_all(int fd, struct iovec* iov, int cnt)
+{
+	while (cnt > 0) {
+		ssize_t n = writev(fd, iov, cnt);
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			return;
+		}
+
+		while (cnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= (ssize_t)iov->iov_len;
+			++iov;
+			--cnt;
+		}
+
+		if (cnt > 0) {
+			iov->iov_base  = (char*)iov->iov_base + n;
+			iov->iov_len  -= (size_t)n;
+		}
+	}
+}
+
+static void write_batch(struct log_record_t** batch, size_t n)
+{
+	if (use_syslog()) {
+		for (size_t i = 0; i < n; ++i) {
+			syslog(batch[i]->priority, "%s", batch[i]->text);
+		}
+	}
+	else {
+		static char newline[] = "\n";
+		char prefixes[LOG_BATCH][128];
+		struct iovec iov[LOG_BATCH * 3];
+		int cnt = 0;
+		size_t prefix = 0;
+
+		for (size_t i = 0; i < n; ++i) {
+			/* Records are mostly from the same second, format the timestamp once per second */
+			if (!batch[i]->raw) {
+				if (i == 0 || batch[i]->time != batch[prefix]->time || batch[prefix]->raw) {
+					prefix = i;
+					format_prefix(batch[i]->time, prefixes[prefix], sizeof(prefixes[prefix]));
+				}
+
+				iov[cnt].iov_base   = prefixes[prefix];
+				iov[cnt++].iov_len  = strlen(prefixes[prefix]);
+			}
+
+			iov[cnt].iov_base   = batch[i]->text;
+			iov[cnt++].iov_len  = batch[i]->len;
+			iov[cnt].iov_base   = newline;
+			iov[cnt++].iov_len  = 1;
+		}
+
+		writev_all(STDERR_FILENO, iov, cnt);
+	}
+}
+
+static void report_drops(struct log_queue_t* q)
+{
+	unsigned long long dropped = atomic_load_explicit(&q->dropped, memory_order_relaxed);
+
+	if (dropped != q->reported_drops) {
+		struct log_record_t record;
+		struct log_record_t* batch[1] = { &record };
+
+		char text[128];
+		snprintf(text, sizeof(text), "Log queue overflow: %llu messages dropped", dropped - q->reported_drops);
+
+		record.time     = time(NULL);
+		record.priority = LOG_DAEMON | LOG_WARNING;
+		record.raw      = globals.log_format == LOG_FORMAT_JSON;
+		record.len      = (unsigned int)format_line(record.text, sizeof(record.text), text);
+		write_batch(batch, 1);
+		q->reported_drops = dropped;
+	}
+}
+
+static int has_records(struct log_queue_t* q)
+{
+	struct log_record_t* rec = &q->ring[q->dequeue_pos & q->mask];
+	return atomic_load_explicit(&rec->seq, memory_order_acquire) == q->dequeue_pos + 1;
+}
+
+static void* log_writer(void* arg)
+{
+	struct log_queue_t* q = (struct log_queue_t*)arg;
+	struct log_record_t* batch[LOG_BATCH];
+
+	while (1) {
+		size_t n = 0;
+
+		while (n < LOG_BATCH && has_records(q)) {
+			batch[n++] = &q->ring[q->dequeue_pos & q->mask];
+			++q->dequeue_pos;
+		}
+
+		if (n) {
+			write_batch(batch, n);
+			for (size_t i = 0; i < n; ++i) {
+				/* Hand the slot over to the producer one lap ahead */
+				size_t seq = atomic_load_explicit(&batch[i]->seq, memory_order_relaxed);
+				atomic_store_explicit(&batch[i]->seq, seq + q->mask, memory_order_release);
+			}
+
+			continue;
+		}
+
+		report_drops(q);
+		if (atomic_load(&q->stop)) {
+			break;
+		}
+
+		atomic_store(&q->sleeping, 1);
+		if (has_records(q) || atomic_load(&q->stop)) {
+			atomic_store(&q->sleeping, 0);
+			continue;
+		}
+
+		sem_wait(&q->wakeup);
+	}
+
+	return NULL;
+}
+
+static void wake_writer(struct log_queue_t* q)
+{
+	if (atomic_exchange(&q->sleeping, 0)) {
+		sem_post(&q->wakeup);
+	}
+}
+
+static void enqueue(struct log_queue_t* q, int priority, int raw, const char* text, size_t len)
+{
+	struct log_record_t* rec;
+	size_t pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+
+	while (1) {
+		size_t seq;
+		intptr_t diff;
+
+		rec  = &q->ring[pos & q->mask];
+		seq  = atomic_load_explicit(&rec->seq, memory_order_acquire);
+		diff = (intptr_t)seq - (intptr_t)pos;
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&q->enqueue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+				break;
+			}
+		}
+		else if (diff < 0) {
+			if (!globals.log_overflow_wait) {
+				atomic_fetch_add_explicit(&q->dropped, 1, memory_order_relaxed);
+				return;
+			}
+
+			struct timespec delay = { 0, 1000000 };
+			wake_writer(q);
+			nanosleep(&delay, NULL);
+			pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+		}
+		else {
+			pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+		}
+	}
+
+	rec->time     = time(NULL);
+	rec->priority = priority;
+	rec->raw      = raw;
+	rec->len      = (unsigned int)len;
+	memcpy(rec->text, text, len);
+	rec->text[len] = 0;
+	atomic_store_explicit(&rec->seq, pos + 1, memory_order_release);
+
+	wake_writer(q);
+}
+
+void log_line(int priority, const char* line, size_t len)
+{
+	if (globals.log) {
+		enqueue(globals.log, priority, 1, line, len < LOG_RECORD_SIZE ? len : LOG_RECORD_SIZE - 1);
+		return;
+	}
+
+#ifndef MINIMALISTIC_BUILD
+	if (globals.no_syslog) {
+#endif
+		fprintf(stderr, "%.*s\n", (int)len, line);
+#ifndef MINIMALISTIC_BUILD
+	}
+	else {
+		syslog(priority, "%.*s", (int)len, line);
+	}
+#endif
+}
 
 void my_log(int priority, const char *format, ...)
 {
 	va_list ap;
 	va_start(ap, format);
 
+	if (globals.log || globals.log_format == LOG_FORMAT_JSON) {
+		char line[LOG_RECORD_SIZE];
+
+		#pragma GCC diagnostic push
+		#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+		int len = vsnprintf(format_buffer, sizeof(format_buffer), format, ap);
+		#pragma GCC diagnostic pop
+
+		va_end(ap);
+		if (len >= 0) {
+			if (globals.log_format == LOG_FORMAT_JSON) {
+				log_line(priority, line, format_line(line, sizeof(line), format_buffer));
+			}
+			else {
+				enqueue(globals.log, priority, 0, format_buffer, (size_t)len < sizeof(format_buffer) ? (size_t)len : sizeof(format_buffer) - 1);
+			}
+		}
+
+		return;
+	}
+
 #ifndef MINIMALISTIC_BUILD
 	if (globals.no_syslog) {
 #endif
-		time_t now;
-		struct tm timeinfo;
-		char timestring[32];
-
-		time(&now);
-		localtime_r(&now, &timeinfo);
-		strftime(timestring, sizeof(timestring), "%Y-%m-%d %H:%M:%S", &timeinfo);
-		fprintf(
-			stderr,
-			"%s %s[%d]: ",
-			timestring,
-#ifndef MINIMALISTIC_BUILD
-			globals.daemon_name,
-#else
-			"ssh-honeypotd",
-#endif
-			getpid()
-		);
+		char prefix[128];
+
+		format_prefix(time(NULL), prefix, sizeof(prefix));
+		fputs(prefix, stderr);
 
 		#pragma GCC diagnostic push
 		#pragma GCC diagnostic ignored "-Wformat-nonliteral"
@@ -49,3 +346,64 @@ void my_log(int priority, const char *format, ...)
 
 	va_end(ap);
 }
+
+int log_start(struct globals_t* g)
+{
+	struct log_queue_t* q;
+	size_t size = 1;
+	void* mem;
+
+	while (size < g->log_queue) {
+		size <<= 1;
+	}
+
+	if (posix_memalign(&mem, CACHE_LINE, sizeof(struct log_queue_t))) {
+		return -1;
+	}
+
+	q = (struct log_queue_t*)mem;
+	memset(q, 0, sizeof(struct log_queue_t));
+	q->mask = size - 1;
+	q->ring = calloc(size, sizeof(struct log_record_t));
+	if (!q->ring) {
+		free(q);
+		return -1;
+	}
+
+	for (size_t i = 0; i < size; ++i) {
+		atomic_init(&q->ring[i].seq, i);
+	}
+
+	sem_init(&q->wakeup, 0, 0);
+	if (pthread_create(&q->writer, NULL, log_writer, q) != 0) {
+		sem_destroy(&q->wakeup);
+		free(q->ring);
+		free(q);
+		return -1;
+	}
+
+	g->log = q;
+	return 0;
+}
+
+void log_stop(struct globals_t* g)
+{
+	struct log_queue_t* q = g->log;
+
+	if (q) {
+		/* Whatever is logged from now on goes synchronously; the writer drains the queue before exiting */
+		g->log = NULL;
+		atomic_store(&q->stop, 1);
+		sem_post(&q->wakeup);
+		pthread_join(q->writer, NULL);
+
+		sem_destroy(&q->wakeup);
+		free(q->ring);
+		free(q);
+	}
+}
+
+unsigned long long log_dropped(struct globals_t* g)
+{
+	return g->log ? atomic_load_explicit(&g->log->dropped, memory_order_relaxed) : 0;
+}
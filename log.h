@@ -4,6 +4,17 @@
 /* Make LOG_XXX constants available */
 #include <syslog.h>
 
+#include <stddef.h>
+
+#define LOG_FORMAT_TEXT 0
+#define LOG_FORMAT_JSON 1
+
+struct globals_t;
+
 void my_log(int priority, const char *format, ...);
+void log_line(int priority, const char* line, size_t len);
+int log_start(struct globals_t* g);
+void log_stop(struct globals_t* g);
+unsigned long long log_dropped(struct globals_t* g);
 
 #endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,15 +6,32 @@
 #include <errno.h>
 #include <libssh/server.h>
 #include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include "globals.h"
 #include "log.h"
 #include "daemon.h"
 #include "cmdline.h"
 #include "worker.h"
+#include "evloop.h"
+#include "listener.h"
+#include "pool.h"
+#include "capture.h"
+#include "aggregate.h"
+#include "iplimit.h"
+#include "kexlimit.h"
+#include "admission.h"
+#include "registry.h"
+#include "metrics.h"
 #include "pidfile.h"
+#include "crypto.h"
+#include "tarpit.h"
+#include "timers.h"
+#include "handover.h"
+#include "sizing.h"
+#include "probes.h"
 
-#define MAX_THREADS      100
-#define SESSION_TIMEOUT  120
 
 struct globals_t globals;
 
@@ -32,9 +50,24 @@ static void report_privs_error(int res)
 	}
 }
 
+static uid_t pid_file_owner(struct globals_t* g)
+{
+	uid_t pid_owner = geteuid();
+	if (pid_owner == 0 && g->uid_set) {
+		/*
+		 * Prefer the runtime uid as PID-file owner for post-drop updates;
+		 * PID-file removal still depends on parent directory permissions.
+		 */
+		pid_owner = g->uid;
+	}
+
+	return pid_owner;
+}
+
 static void check_pid_file(struct globals_t* g)
 {
-	if (g->pid_file) {
+	/* After a restart, the predecessor holds the PID file until we are ready */
+	if (g->pid_file && g->predecessor <= 0) {
 		/* Resolve the eventual runtime uid before creating a root-owned PID file. */
 		int res = prepare_privs(g);
 		if (res != 0) {
@@ -42,16 +75,7 @@ static void check_pid_file(struct globals_t* g)
 			exit(EXIT_FAILURE);
 		}
 
-		uid_t pid_owner = geteuid();
-		if (pid_owner == 0 && g->uid_set) {
-			/*
-			 * Prefer the runtime uid as PID-file owner for post-drop updates;
-			 * PID-file removal still depends on parent directory permissions.
-			 */
-			pid_owner = g->uid;
-		}
-
-		g->pid_fd = create_pid_file(g->pid_file, pid_owner);
+		g->pid_fd = create_pid_file(g->pid_file, pid_file_owner(g));
 		if (g->pid_fd == -1) {
 			fprintf(stderr, "Error creating PID file %s: %s\n", g->pid_file, strerror(errno));
 			exit(EXIT_FAILURE);
@@ -64,6 +88,31 @@ static void check_pid_file(struct globals_t* g)
 	}
 }
 
+/* The predecessor lets the PID file go once it has got our SIGTERM */
+static void take_over_pid_file(struct globals_t* g)
+{
+	int fd = -2;
+
+	for (int i = 0; i < 100 && fd == -2; ++i) {
+		struct timespec delay = { 0, 10000000 };
+
+		fd = create_pid_file(g->pid_file, pid_file_owner(g));
+		if (fd == -2) {
+			nanosleep(&delay, NULL);
+		}
+	}
+
+	if (fd < 0) {
+		my_log(LOG_WARNING, "Failed to take the PID file %s over: %s", g->pid_file, fd == -2 ? "still locked" : strerror(errno));
+		return;
+	}
+
+	g->pid_fd = fd;
+	if (write_pid(fd)) {
+		my_log(LOG_WARNING, "Failed to write to the PID file: %s", strerror(errno));
+	}
+}
+
 static void daemonize(struct globals_t* g)
 {
 	int res;
@@ -84,10 +133,85 @@ static void daemonize(struct globals_t* g)
 }
 #endif
 
+/* How the host key was obtained, for the startup report */
+static const char* key_origin = "file";
+
+#if LIBSSH_VERSION_INT >= SSH_VERSION_INT(0, 7, 90)
+static int generate_key(enum ssh_keytypes_e type, ssh_key* key)
+{
+#if LIBSSH_VERSION_INT >= SSH_VERSION_INT(0, 12, 0)
+	return ssh_pki_generate_key(type, NULL, key);
+#else
+	return ssh_pki_generate(type, 0, key);
+#endif
+}
+
+static ssh_key load_cached_key(struct globals_t* g)
+{
+	ssh_key key;
+
+	if (ssh_pki_import_privkey_file(g->key_cache, NULL, NULL, NULL, &key) != SSH_OK) {
+		return NULL;
+	}
+
+	if ((int)ssh_key_type(key) != g->key_type) {
+		ssh_key_free(key);
+		return NULL;
+	}
+
+	return key;
+}
+
+/* Written to a temporary file first, so that a crash never leaves a truncated key behind */
+static void store_cached_key(struct globals_t* g, ssh_key key)
+{
+	size_t len = strlen(g->key_cache) + sizeof(".tmp");
+	char* tmp  = malloc(len);
+
+	if (!tmp) {
+		return;
+	}
+
+	snprintf(tmp, len, "%s.tmp", g->key_cache);
+	unlink(tmp);
+	if (
+		   ssh_pki_export_privkey_file(key, NULL, NULL, NULL, tmp) != SSH_OK
+		|| chmod(tmp, S_IRUSR | S_IWUSR) == -1
+		|| rename(tmp, g->key_cache) == -1
+	) {
+		fprintf(stderr, "WARNING: failed to save the generated key to %s\n", g->key_cache);
+		unlink(tmp);
+	}
+
+	free(tmp);
+}
+
+static ssh_key get_host_key(struct globals_t* g)
+{
+	ssh_key key = g->key_cache ? load_cached_key(g) : NULL;
+
+	if (key) {
+		key_origin = "cached";
+		return key;
+	}
+
+	if (generate_key((enum ssh_keytypes_e)g->key_type, &key) != SSH_OK) {
+		return NULL;
+	}
+
+	key_origin = "generated";
+	if (g->key_cache) {
+		store_cached_key(g, key);
+	}
+
+	return key;
+}
+#endif
+
 static void set_options(struct globals_t* g)
 {
-	ssh_bind_options_set(g->sshbind, SSH_BIND_OPTIONS_BINDADDR, g->bind_address);
-	ssh_bind_options_set(g->sshbind, SSH_BIND_OPTIONS_BINDPORT_STR, g->bind_port);
+	ssh_bind_options_set(g->sshbind, SSH_BIND_OPTIONS_BINDADDR, g->bind_addresses[0]);
+	ssh_bind_options_set(g->sshbind, SSH_BIND_OPTIONS_BINDPORT_STR, g->bind_ports[0]);
 
 	if (g->dsa_key) {
 		ssh_bind_options_set(g->sshbind, SSH_BIND_OPTIONS_HOSTKEY, g->dsa_key);
@@ -106,19 +230,15 @@ static void set_options(struct globals_t* g)
 	}
 
 	ssh_bind_options_set(g->sshbind, SSH_BIND_OPTIONS_BANNER, "OpenSSH");
+	if (apply_crypto_profile(g->sshbind, g->crypto_profile)) {
+		exit(EXIT_FAILURE);
+	}
 
 #if LIBSSH_VERSION_INT >= SSH_VERSION_INT(0, 7, 90)
 	if (!g->rsa_key && !g->dsa_key && !g->ecdsa_key && !g->ed25519_key) {
-		ssh_key key;
-		int res;
+		ssh_key key = get_host_key(g);
 
-#if LIBSSH_VERSION_INT >= SSH_VERSION_INT(0, 12, 0)
-		res = ssh_pki_generate_key(SSH_KEYTYPE_RSA, NULL, &key);
-#else
-		res = ssh_pki_generate(SSH_KEYTYPE_RSA, 0, &key);
-#endif
-
-		if (res == SSH_OK) {
+		if (key) {
 			ssh_bind_options_set(g->sshbind, SSH_BIND_OPTIONS_IMPORT_KEY, key);
 		}
 		else {
@@ -129,87 +249,192 @@ static void set_options(struct globals_t* g)
 #endif
 }
 
-static void spawn_thread(struct globals_t* g, pthread_attr_t* attr, ssh_session session)
+static void spawn_thread(struct globals_t* g, pthread_attr_t* attr, ssh_session session, const struct sockaddr_storage* addr, int ip_tracked)
 {
-	size_t num_threads;
-	struct connection_info_t* conn = calloc(1, sizeof(struct connection_info_t));
+	struct connection_info_t* conn = alloc_connection(session, addr, ip_tracked);
 	if (!conn) {
-		my_log(LOG_ALERT, "malloc() failed, out of memory");
-		ssh_disconnect(session);
-		ssh_free(session);
 		return;
 	}
 
-	conn->next        = NULL;
-	conn->event       = NULL;
-	conn->session     = session;
+	if (register_connection(conn)) {
+		my_log(LOG_ERR, "Too many connections");
+		finalize_connection(conn);
+	}
+	else if (pthread_create(&conn->thread, attr, worker, conn) != 0) {
+		my_log(LOG_CRIT, "pthread_create() failed");
+		finalize_connection(conn);
+	}
+}
 
-	conn->port        = -1;
-	conn->ipstr[0]    = '?';
-	conn->ipstr[1]    = 0;
+static ssh_session accept_session(struct globals_t* g, int listen_fd, struct sockaddr_storage* addr, int* ip_tracked, size_t shard)
+{
+	const long int timeout = LIBSSH_TIMEOUT;
+	socklen_t len = sizeof(*addr);
+	ssh_session session;
+	int admitted;
+	int fd;
+
+	fd = accept4(listen_fd, (struct sockaddr*)addr, &len, SOCK_CLOEXEC);
+	if (fd == -1) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED) {
+			my_log(LOG_WARNING, "Error accepting the connection: %s", strerror(errno));
+		}
 
-	conn->my_port     = -1;
-	conn->my_ipstr[0] = '?';
-	conn->my_ipstr[1] = 0;
+		return NULL;
+	}
 
-	pthread_mutex_lock(&g->mutex);
-	{
-		if (!g->head) {
-			g->head = conn;
-		}
+	/* Load and per-IP limits are checked before any libssh state or crypto work is spent on the client */
+	admitted = admit_connection(g, fd, addr, shard);
+	if (admitted == IPLIMIT_REJECTED) {
+		return NULL;
+	}
+
+	*ip_tracked = admitted == IPLIMIT_TRACKED;
 
-		if (g->tail) {
-			g->tail->next = conn;
+	session = ssh_new();
+	if (!session) {
+		my_log(LOG_ALERT, "Failed to allocate an SSH session");
+		if (*ip_tracked) {
+			iplimit_release(g, addr);
 		}
 
-		conn->prev  = g->tail;
-		g->tail     = conn;
-		num_threads = g->n_threads;
-		++g->n_threads;
+		close(fd);
+		return NULL;
 	}
-	pthread_mutex_unlock(&g->mutex);
 
-	if (num_threads > MAX_THREADS) {
-		my_log(LOG_ERR, "Too many connections");
-		finalize_connection(conn);
+	ssh_options_set(session, SSH_OPTIONS_TIMEOUT, &timeout);
+	if (ssh_bind_accept_fd(g->sshbind, session, fd) == SSH_ERROR) {
+		my_log(LOG_WARNING, "Error accepting the connection: %s", ssh_get_error(g->sshbind));
+		if (ssh_get_fd(session) != fd) {
+			close(fd);
+		}
+
+		if (*ip_tracked) {
+			iplimit_release(g, addr);
+		}
+
+		ssh_free(session);
+		return NULL;
 	}
-	else if (pthread_create(&conn->thread, attr, worker, conn) != 0) {
-		my_log(LOG_CRIT, "pthread_create() failed");
-		finalize_connection(conn);
+
+	PROBE4(accept, session, addr, fd, shard);
+	return session;
+}
+
+static void handle_control(struct globals_t* g)
+{
+	uint64_t value;
+
+	if (read(g->control_fd, &value, sizeof(value)) > 0) {
+		if (g->dump_latency) {
+			g->dump_latency = 0;
+			metrics_dump_latency();
+		}
+
+		if (g->restart) {
+			g->restart = 0;
+			handover_spawn(g);
+		}
 	}
 }
 
-static void main_loop(struct globals_t* g)
+static void* accept_loop(void* arg)
 {
+	struct globals_t* g          = &globals;
+	struct listener_t* listener  = (struct listener_t*)arg;
+	size_t shard                 = (size_t)(listener - g->listeners);
+	size_t n                     = g->n_endpoints + 2;
+	struct pollfd* pfd           = calloc(n, sizeof(struct pollfd));
 	pthread_attr_t attr;
+
+	if (!pfd) {
+		my_log(LOG_CRIT, "malloc() failed, out of memory");
+		return NULL;
+	}
+
+	/*
+	 * No timeout: a shutdown makes shutdown_fd readable, and SIGUSR1 and SIGHUP write to control_fd,
+	 * which only the first acceptor watches. Negative descriptors are ignored by poll().
+	 */
+	pfd[0].fd = g->shutdown_fd;
+	pfd[1].fd = shard == 0 ? g->control_fd : -1;
+	for (size_t e = 0; e < g->n_endpoints; ++e) {
+		pfd[e + 2].fd = listener->fds[e];
+	}
+
+	for (size_t i = 0; i < n; ++i) {
+		pfd[i].events = POLLIN;
+	}
+
+	/* Worker threads inherit the affinity of the acceptor that spawns them */
+	pin_to_cpu(listener->cpu);
+
 	pthread_attr_init(&attr);
-	pthread_attr_setstacksize(&attr, 65536);
+	pthread_attr_setstacksize(&attr, THREAD_STACK_SIZE);
 	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
 
 	while (!g->terminate) {
-		const long int timeout = SESSION_TIMEOUT;
-		ssh_session session    = ssh_new();
-		if (!session) {
-			my_log(LOG_ALERT, "Failed to allocate an SSH session");
-			break;
+		if (poll(pfd, n, -1) <= 0) {
+			continue;
 		}
 
-		ssh_options_set(session, SSH_OPTIONS_TIMEOUT, &timeout);
-		int r = ssh_bind_accept(g->sshbind, session);
-		if (r == SSH_ERROR) {
-			ssh_free(session);
-			if (g->terminate) {
-				break;
+		if (pfd[1].revents & POLLIN) {
+			handle_control(g);
+		}
+
+		/* All endpoints share the engine, and so the capacity, of the daemon */
+		for (size_t i = 2; i < n && !g->terminate; ++i) {
+			struct sockaddr_storage addr;
+			ssh_session session;
+			int ip_tracked;
+
+			if (!(pfd[i].revents & POLLIN)) {
+				continue;
 			}
 
-			my_log(LOG_WARNING, "Error accepting the connection: %s\n", ssh_get_error(g->sshbind));
-			continue;
-		}
+			session = accept_session(g, pfd[i].fd, &addr, &ip_tracked, shard);
+			if (!session) {
+				continue;
+			}
 
-		spawn_thread(g, &attr, session);
+			if (g->event_loops) {
+				evloop_dispatch(g, session, &addr, ip_tracked, shard);
+			}
+			else if (g->workers) {
+				pool_submit(g, session, &addr, ip_tracked);
+			}
+			else {
+				spawn_thread(g, &attr, session, &addr, ip_tracked);
+			}
+		}
 	}
 
 	pthread_attr_destroy(&attr);
+	free(pfd);
+	return NULL;
+}
+
+static void main_loop(struct globals_t* g)
+{
+	for (size_t i = 1; i < g->acceptors; ++i) {
+		if (pthread_create(&g->listeners[i].thread, NULL, accept_loop, &g->listeners[i]) != 0) {
+			my_log(LOG_CRIT, "pthread_create() failed");
+			break;
+		}
+
+		g->listeners[i].started = 1;
+	}
+
+	accept_loop(&g->listeners[0]);
+
+	for (size_t i = 1; i < g->acceptors; ++i) {
+		if (g->listeners[i].started) {
+			pthread_join(g->listeners[i].thread, NULL);
+			g->listeners[i].started = 0;
+		}
+	}
+
+	admission_report(g);
 	my_log(LOG_DAEMON | LOG_INFO, "Shutting down...");
 }
 
@@ -220,26 +445,49 @@ static void goodbye(void)
 
 int main(int argc, char** argv)
 {
+	struct timespec started;
+	struct timespec ready;
+
+	clock_gettime(CLOCK_MONOTONIC, &started);
 	init_globals(&globals);
 	atexit(goodbye);
 	parse_options(argc, argv, &globals);
+	if (handover_init(&globals, argv)) {
+		return EXIT_FAILURE;
+	}
+
 #ifndef MINIMALISTIC_BUILD
 	check_pid_file(&globals);
 #endif
 	set_options(&globals);
 
+	if (open_listeners(&globals)) {
+		return EXIT_FAILURE;
+	}
+
+	if (globals.tarpit_port && tarpit_open(&globals)) {
+		return EXIT_FAILURE;
+	}
+
+	/*
+	 * Let libssh load the host keys against our socket, then take the socket back:
+	 * connections are accepted by us and handed over with ssh_bind_accept_fd()
+	 */
+	ssh_bind_set_fd(globals.sshbind, globals.listeners[0].fds[0]);
 	if (ssh_bind_listen(globals.sshbind) < 0) {
 		fprintf(stderr, "Error listening to socket: %s\n", ssh_get_error(globals.sshbind));
 		return EXIT_FAILURE;
 	}
 
+	ssh_bind_set_fd(globals.sshbind, SSH_INVALID_SOCKET);
+
 #ifndef MINIMALISTIC_BUILD
 	if (!globals.no_syslog) {
 		openlog(globals.daemon_name, LOG_PID | LOG_CONS | (globals.foreground ? LOG_PERROR : 0), LOG_AUTH);
 	}
 
 	daemonize(&globals);
-	if (globals.pid_file && write_pid(globals.pid_fd)) {
+	if (globals.pid_fd >= 0 && write_pid(globals.pid_fd)) {
 		my_log(LOG_CRIT, "Failed to write to the PID file: %s", strerror(errno));
 		return EXIT_FAILURE;
 	}
@@ -247,6 +495,81 @@ int main(int argc, char** argv)
 	set_signals();
 #endif
 
+	if (globals.capture_dir && capture_open(&globals)) {
+		return EXIT_FAILURE;
+	}
+
+	if (globals.log_queue && log_start(&globals)) {
+		my_log(LOG_CRIT, "Failed to start the log writer");
+		return EXIT_FAILURE;
+	}
+
+	sizing_apply(&globals);
+
+	if ((globals.max_per_ip || globals.ip_rate) && iplimit_start(&globals)) {
+		my_log(LOG_CRIT, "Failed to set up the per-IP limits");
+		return EXIT_FAILURE;
+	}
+
+	if (globals.aggregate && aggregate_start(&globals)) {
+		my_log(LOG_CRIT, "Failed to start credential aggregation");
+		return EXIT_FAILURE;
+	}
+
+	if (globals.max_kex && kexlimit_start(&globals)) {
+		my_log(LOG_CRIT, "Failed to set up the key exchange limit");
+		return EXIT_FAILURE;
+	}
+
+	if (timers_start(&globals)) {
+		my_log(LOG_CRIT, "Failed to start the session timers");
+		return EXIT_FAILURE;
+	}
+
+	if (globals.event_loops && evloop_start(&globals)) {
+		my_log(LOG_CRIT, "Failed to start the event loops");
+		return EXIT_FAILURE;
+	}
+
+	/* Threads of the default mode and pooled workers are tracked in the registry; event loops keep their own lists */
+	if (!globals.event_loops) {
+		globals.registry = registry_new(globals.workers ? globals.workers : globals.max_sessions);
+	}
+
+	if (!globals.event_loops && !globals.registry) {
+		my_log(LOG_CRIT, "Failed to allocate the connection registry");
+		return EXIT_FAILURE;
+	}
+
+	if (globals.workers && pool_start(&globals)) {
+		my_log(LOG_CRIT, "Failed to start the worker pool");
+		return EXIT_FAILURE;
+	}
+
+	if (globals.metrics_address && metrics_start(&globals)) {
+		return EXIT_FAILURE;
+	}
+
+	if (globals.tarpit && tarpit_start(&globals)) {
+		my_log(LOG_CRIT, "Failed to start the tarpit");
+		return EXIT_FAILURE;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ready);
+	my_log(
+		LOG_DAEMON | LOG_INFO,
+		"Accepting connections %.1f ms after start (host key: %s)",
+		(double)(ready.tv_sec - started.tv_sec) * 1000.0 + (double)(ready.tv_nsec - started.tv_nsec) / 1000000.0,
+		key_origin
+	);
+
+	handover_ready(&globals);
+#ifndef MINIMALISTIC_BUILD
+	if (globals.pid_file && globals.predecessor > 0) {
+		take_over_pid_file(&globals);
+	}
+#endif
+
 	main_loop(&globals);
 	return 0;
 }
@@ -0,0 +1,389 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "metrics.h"
+#include "globals.h"
+#include "registry.h"
+#include "evloop.h"
+#include "listener.h"
+#include "kexlimit.h"
+#include "histogram.h"
+#include "log.h"
+
+#define CACHE_LINE     64
+#define BUCKETS        20           /* exported upper bounds of 1 ms, 2 ms, 4 ms ... 524 s, then +Inf */
+#define RESPONSE_SIZE  16384        /* everything but the per-socket gauges */
+#define SOCKET_SIZE    256          /* the queue and backlog lines of one listening socket */
+#define REQUEST_SIZE   1024
+#define IO_TIMEOUT     1000         /* ms */
+
+/* Every counter on its own cache line: the hot path is one relaxed atomic add with no false sharing */
+struct counter_t {
+	_Alignas(CACHE_LINE) atomic_ullong value;
+};
+
+struct metrics_server_t {
+	pthread_t thread;
+	int fd;
+	char* response;
+	size_t size;
+};
+
+static struct counter_t counters[METRICS_COUNTERS];
+
+#define METRICS_NAME(name, help) #name,
+#define METRICS_HELP(name, help) help,
+static const char* counter_names[]   = { HONEYPOT_COUNTERS(METRICS_NAME) };
+static const char* counter_help[]    = { HONEYPOT_COUNTERS(METRICS_HELP) };
+static const char* histogram_names[] = { HONEYPOT_HISTOGRAMS(METRICS_NAME) };
+static const char* histogram_help[]  = { HONEYPOT_HISTOGRAMS(METRICS_HELP) };
+#undef METRICS_NAME
+#undef METRICS_HELP
+
+void metrics_inc(enum metrics_counter_t counter)
+{
+	atomic_fetch_add_explicit(&counters[counter].value, 1, memory_order_relaxed);
+}
+
+unsigned long long metrics_get(enum metrics_counter_t counter)
+{
+	return atomic_load_explicit(&counters[counter].value, memory_order_relaxed);
+}
+
+/* Per-thread: see histogram.c */
+void metrics_observe(enum metrics_histogram_t histogram, uint64_t ns)
+{
+	histogram_record((size_t)histogram, ns);
+}
+
+void metrics_dump_latency(void)
+{
+	struct histogram_snapshot_t s;
+
+	my_log(LOG_DAEMON | LOG_INFO, "Latency (ms):      count        p50        p90        p99      p99.9        max");
+	for (size_t i = 0; i < METRICS_HISTOGRAMS; ++i) {
+		histogram_merge(i, &s);
+		my_log(
+			LOG_DAEMON | LOG_INFO,
+			"  %-10s %12llu %10.3f %10.3f %10.3f %10.3f %10.3f",
+			histogram_names[i],
+			(unsigned long long)s.count,
+			(double)histogram_percentile(&s, 50.0) / 1000.0,
+			(double)histogram_percentile(&s, 90.0) / 1000.0,
+			(double)histogram_percentile(&s, 99.0) / 1000.0,
+			(double)histogram_percentile(&s, 99.9) / 1000.0,
+			(double)s.max_us / 1000.0
+		);
+	}
+}
+
+struct output_t {
+	char* p;
+	size_t len;
+	size_t cap;
+};
+
+#if defined(__GNUC__) || defined(__clang__)
+__attribute__((format(printf, 2, 3)))
+#endif
+static void out(struct output_t* o, const char* format, ...)
+{
+	va_list ap;
+	int n;
+
+	if (o->len >= o->cap) {
+		return;
+	}
+
+	va_start(ap, format);
+	n = vsnprintf(o->p + o->len, o->cap - o->len, format, ap);
+	va_end(ap);
+
+	if (n > 0) {
+		o->len += (size_t)n < o->cap - o->len ? (size_t)n : o->cap - o->len - 1;
+	}
+}
+
+/* The fine-grained buckets are folded into the exported ones, which are a subset of their precision */
+static void render_histogram(struct output_t* o, size_t i)
+{
+	struct histogram_snapshot_t s;
+	unsigned long long cumulative = 0;
+	size_t next = 0;
+
+	histogram_merge(i, &s);
+	out(o, "# HELP ssh_honeypotd_%s_seconds %s\n", histogram_names[i], histogram_help[i]);
+	out(o, "# TYPE ssh_honeypotd_%s_seconds histogram\n", histogram_names[i]);
+	for (size_t b = 0; b < BUCKETS; ++b) {
+		uint64_t le_us = ((uint64_t)1 << b) * 1000;
+
+		while (next < HISTOGRAM_BUCKETS && histogram_bucket_limit(next) < le_us) {
+			cumulative += s.buckets[next++];
+		}
+
+		out(o, "ssh_honeypotd_%s_seconds_bucket{le=\"%g\"} %llu\n", histogram_names[i], (double)le_us / 1e6, cumulative);
+	}
+
+	out(o, "ssh_honeypotd_%s_seconds_bucket{le=\"+Inf\"} %llu\n", histogram_names[i], (unsigned long long)s.count);
+	out(o, "ssh_honeypotd_%s_seconds_sum %.6f\n", histogram_names[i], (double)s.sum_us / 1e6);
+	out(o, "ssh_honeypotd_%s_seconds_count %llu\n", histogram_names[i], (unsigned long long)s.count);
+}
+
+static void render_listeners(struct globals_t* g, struct output_t* o)
+{
+	struct listen_stats_t ls;
+	unsigned int len;
+	unsigned int max;
+
+	if (listen_stats(&ls) == 0) {
+		out(o, "# HELP ssh_honeypotd_listen_overflows_total Connections that found an accept queue full (whole network namespace)\n");
+		out(o, "# TYPE ssh_honeypotd_listen_overflows_total counter\n");
+		out(o, "ssh_honeypotd_listen_overflows_total %llu\n", ls.overflows);
+		out(o, "# HELP ssh_honeypotd_listen_drops_total Connections dropped by listening sockets (whole network namespace)\n");
+		out(o, "# TYPE ssh_honeypotd_listen_drops_total counter\n");
+		out(o, "ssh_honeypotd_listen_drops_total %llu\n", ls.drops);
+	}
+
+	out(o, "# HELP ssh_honeypotd_listen_queue Connections waiting in the accept queue\n");
+	out(o, "# TYPE ssh_honeypotd_listen_queue gauge\n");
+	for (size_t i = 0; i < g->acceptors; ++i) {
+		for (size_t e = 0; e < g->n_endpoints; ++e) {
+			if (listener_queue(g->listeners[i].fds[e], &len, &max) == 0) {
+				out(o, "ssh_honeypotd_listen_queue{listener=\"%zu\",endpoint=\"%s\"} %u\n", i, g->endpoints[e].name, len);
+			}
+		}
+	}
+
+	out(o, "# HELP ssh_honeypotd_listen_backlog The size of the accept queue\n");
+	out(o, "# TYPE ssh_honeypotd_listen_backlog gauge\n");
+	for (size_t i = 0; i < g->acceptors; ++i) {
+		for (size_t e = 0; e < g->n_endpoints; ++e) {
+			if (listener_queue(g->listeners[i].fds[e], &len, &max) == 0) {
+				out(o, "ssh_honeypotd_listen_backlog{listener=\"%zu\",endpoint=\"%s\"} %u\n", i, g->endpoints[e].name, max);
+			}
+		}
+	}
+}
+
+/* Everything is aggregated here, at scrape time */
+static void render(struct globals_t* g, struct output_t* o)
+{
+	for (size_t i = 0; i < METRICS_COUNTERS; ++i) {
+		out(o, "# HELP ssh_honeypotd_%s %s\n", counter_names[i], counter_help[i]);
+		out(o, "# TYPE ssh_honeypotd_%s counter\n", counter_names[i]);
+		out(o, "ssh_honeypotd_%s %llu\n", counter_names[i], metrics_get((enum metrics_counter_t)i));
+	}
+
+	out(o, "# HELP ssh_honeypotd_log_dropped_total Log messages dropped because the log queue was full\n");
+	out(o, "# TYPE ssh_honeypotd_log_dropped_total counter\n");
+	out(o, "ssh_honeypotd_log_dropped_total %llu\n", log_dropped(g));
+
+	out(o, "# HELP ssh_honeypotd_threads Connection threads currently running\n");
+	out(o, "# TYPE ssh_honeypotd_threads gauge\n");
+	out(o, "ssh_honeypotd_threads %zu\n", registry_count(g->registry));
+
+	out(o, "# HELP ssh_honeypotd_evloop_sessions Sessions currently served by the event loops\n");
+	out(o, "# TYPE ssh_honeypotd_evloop_sessions gauge\n");
+	out(o, "ssh_honeypotd_evloop_sessions %zu\n", evloop_sessions(g));
+
+	out(o, "# HELP ssh_honeypotd_kex_in_flight Key exchanges currently running\n");
+	out(o, "# TYPE ssh_honeypotd_kex_in_flight gauge\n");
+	out(o, "ssh_honeypotd_kex_in_flight %zu\n", kexlimit_in_flight(g));
+
+	out(o, "# HELP ssh_honeypotd_kex_queue Sessions waiting for a key exchange slot\n");
+	out(o, "# TYPE ssh_honeypotd_kex_queue gauge\n");
+	out(o, "ssh_honeypotd_kex_queue %zu\n", kexlimit_waiting(g));
+
+	render_listeners(g, o);
+	for (size_t i = 0; i < METRICS_HISTOGRAMS; ++i) {
+		render_histogram(o, i);
+	}
+}
+
+static int wait_for(int fd, short events)
+{
+	struct pollfd pfd = { fd, events, 0 };
+	return poll(&pfd, 1, IO_TIMEOUT) > 0;
+}
+
+/* Any request gets the metrics; the request itself is read only so that the client does not see a reset */
+static void serve(struct globals_t* g, struct metrics_server_t* s, int fd)
+{
+	char request[REQUEST_SIZE];
+	struct output_t body = { s->response + 128, 0, s->size - 128 };
+	char header[128];
+	int hlen;
+
+	if (wait_for(fd, POLLIN)) {
+		ssize_t n = recv(fd, request, sizeof(request), MSG_DONTWAIT);
+		(void)n;
+	}
+
+	render(g, &body);
+	hlen = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", body.len);
+
+	/* The body is rendered after a gap reserved for the header, which is copied right in front of it */
+	char* start = body.p - hlen;
+	memcpy(start, header, (size_t)hlen);
+
+	size_t left = body.len + (size_t)hlen;
+	while (left > 0 && wait_for(fd, POLLOUT)) {
+		ssize_t n = send(fd, start, left, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (n <= 0) {
+			if (n == -1 && (errno == EAGAIN || errno == EINTR)) {
+				continue;
+			}
+
+			break;
+		}
+
+		start += n;
+		left  -= (size_t)n;
+	}
+}
+
+static void* metrics_thread(void* arg)
+{
+	struct globals_t* g = &globals;
+	struct metrics_server_t* s = (struct metrics_server_t*)arg;
+
+	while (!g->terminate) {
+		struct pollfd pfd[2] = { { s->fd, POLLIN, 0 }, { g->shutdown_fd, POLLIN, 0 } };
+
+		if (poll(pfd, 2, -1) <= 0 || !(pfd[0].revents & POLLIN)) {
+			continue;
+		}
+
+		int fd = accept4(s->fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+		if (fd != -1) {
+			serve(g, s, fd);
+			close(fd);
+		}
+	}
+
+	return NULL;
+}
+
+/* ADDRESS is either the path of a unix socket or a port on 127.0.0.1 */
+static int open_metrics_socket(const char* address)
+{
+	int fd;
+
+	if (address[0] == '/') {
+		struct sockaddr_un sun;
+
+		if (strlen(address) >= sizeof(sun.sun_path)) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		strcpy(sun.sun_path, address);
+		unlink(address);
+
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (fd == -1 || bind(fd, (struct sockaddr*)&sun, sizeof(sun)) == -1 || listen(fd, 16) == -1) {
+			goto fail;
+		}
+	}
+	else {
+		struct sockaddr_in sin;
+		int one = 1;
+
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family      = AF_INET;
+		sin.sin_port        = htons((uint16_t)atoi(address));
+		sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+		fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (
+			   fd == -1
+			|| setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1
+			|| bind(fd, (struct sockaddr*)&sin, sizeof(sin)) == -1
+			|| listen(fd, 16) == -1
+		) {
+			goto fail;
+		}
+	}
+
+	return fd;
+
+fail:
+	if (fd != -1) {
+		int err = errno;
+		close(fd);
+		errno = err;
+	}
+
+	return -1;
+}
+
+int metrics_start(struct globals_t* g)
+{
+	struct metrics_server_t* s = calloc(1, sizeof(struct metrics_server_t));
+	if (!s) {
+		return -1;
+	}
+
+	/* Every acceptor has a socket per endpoint, and each of them gets its own gauges */
+	s->size     = RESPONSE_SIZE + g->acceptors * g->n_endpoints * SOCKET_SIZE;
+	s->response = malloc(s->size);
+	if (!s->response) {
+		free(s);
+		return -1;
+	}
+
+	s->fd = g->inherited_metrics != -1 ? g->inherited_metrics : open_metrics_socket(g->metrics_address);
+	g->inherited_metrics = -1;
+	if (s->fd == -1) {
+		my_log(LOG_CRIT, "Failed to open the metrics socket %s: %s", g->metrics_address, strerror(errno));
+		free(s->response);
+		free(s);
+		return -1;
+	}
+
+	if (pthread_create(&s->thread, NULL, metrics_thread, s) != 0) {
+		close(s->fd);
+		free(s->response);
+		free(s);
+		return -1;
+	}
+
+	g->metrics = s;
+	return 0;
+}
+
+void metrics_stop(struct globals_t* g)
+{
+	struct metrics_server_t* s = g->metrics;
+
+	if (s) {
+		request_shutdown(g);
+		pthread_join(s->thread, NULL);
+		close(s->fd);
+		/* After a restart, the socket belongs to the successor */
+		if (g->metrics_address[0] == '/' && !g->handed_over) {
+			unlink(g->metrics_address);
+		}
+
+		g->metrics = NULL;
+		free(s->response);
+		free(s);
+	}
+}
+
+int metrics_listener(struct globals_t* g)
+{
+	return g->metrics->fd;
+}
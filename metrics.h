@@ -0,0 +1,53 @@
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <stdint.h>
+#include "globals.h"
+
+/* X(name, help): exported as ssh_honeypotd_<name> */
+#define HONEYPOT_COUNTERS(X)                                                              \
+	X(connections_accepted_total,  "Connections admitted after accept()")                 \
+	X(connections_rejected_capacity_total, "Connections rejected because the daemon was at capacity") \
+	X(connections_rejected_per_ip_total,   "Connections rejected by the per-IP limits")   \
+	X(kex_failures_total,          "Sessions that failed the key exchange")               \
+	X(connections_non_ssh_total,   "Connections dropped because the client spoke another protocol") \
+	X(connections_silent_total,    "Connections dropped because the client sent nothing")  \
+	X(kex_wait_timeouts_total,     "Sessions dropped while waiting for a key exchange slot") \
+	X(auth_timeouts_total,         "Sessions closed because the client had not tried a password in time") \
+	X(idle_timeouts_total,         "Sessions closed because the client was idle for too long") \
+	X(lifetime_timeouts_total,     "Sessions closed because they had lasted for too long") \
+	X(password_attempts_total,     "Password authentication attempts")
+
+/* X(name, help): exported as ssh_honeypotd_<name>_seconds */
+#define HONEYPOT_HISTOGRAMS(X)                                                            \
+	X(accept,     "Time from accept() to the start of the session")                      \
+	X(kex_wait,   "Time spent waiting for a key exchange slot")                          \
+	X(kex,        "Time from accept() to the completed key exchange")                    \
+	X(first_auth, "Time from accept() to the first password attempt")                    \
+	X(teardown,   "Time spent tearing a session down")                                   \
+	X(session,    "Time from accept() to the end of the session")
+
+#define METRICS_ENUM(name, help) METRIC_##name,
+
+enum metrics_counter_t {
+	HONEYPOT_COUNTERS(METRICS_ENUM)
+	METRICS_COUNTERS
+};
+
+enum metrics_histogram_t {
+	HONEYPOT_HISTOGRAMS(METRICS_ENUM)
+	METRICS_HISTOGRAMS
+};
+
+#undef METRICS_ENUM
+
+void metrics_inc(enum metrics_counter_t counter);
+unsigned long long metrics_get(enum metrics_counter_t counter);
+void metrics_observe(enum metrics_histogram_t histogram, uint64_t ns);
+void metrics_dump_latency(void);
+
+int metrics_start(struct globals_t* g);
+void metrics_stop(struct globals_t* g);
+int metrics_listener(struct globals_t* g);
+
+#endif /* METRICS_H_ */
@@ -0,0 +1,315 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "pool.h"
+#include "globals.h"
+#include "worker.h"
+#include "log.h"
+
+#define REPORT_INTERVAL 60
+
+struct pool_item_t {
+	ssh_session session;
+	struct timespec enqueued;
+	struct sockaddr_storage addr;
+	int ip_tracked;
+};
+
+struct pool_worker_t {
+	pthread_t thread;
+	struct timespec busy_since;
+	int busy;
+	int started;
+};
+
+/*
+ * Bounded MPMC queue of accepted sessions: acceptors are the producers,
+ * the pool workers are the consumers. Everything below is guarded by the mutex.
+ */
+struct pool_t {
+	pthread_mutex_t mutex;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+
+	struct pool_item_t* ring;
+	size_t head;
+	size_t count;
+
+	struct pool_worker_t* workers;
+	size_t busy;
+
+	/* Statistics for the current reporting interval */
+	struct timespec interval_start;
+	uint64_t handed;
+	uint64_t dropped;
+	uint64_t wait_ns;
+	uint64_t max_wait_ns;
+	uint64_t busy_ns;
+};
+
+static uint64_t elapsed_ns(const struct timespec* from, const struct timespec* to)
+{
+	int64_t ns = (int64_t)(to->tv_sec - from->tv_sec) * 1000000000 + (to->tv_nsec - from->tv_nsec);
+	return ns > 0 ? (uint64_t)ns : 0;
+}
+
+static const struct timespec* later_of(const struct timespec* a, const struct timespec* b)
+{
+	return elapsed_ns(a, b) ? b : a;
+}
+
+static void report(struct globals_t* g, struct pool_t* pool, const struct timespec* now)
+{
+	uint64_t interval = elapsed_ns(&pool->interval_start, now);
+	uint64_t busy_ns  = pool->busy_ns;
+
+	/* Account for the sessions still in progress up to now */
+	for (size_t i = 0; i < g->workers; ++i) {
+		if (pool->workers[i].busy) {
+			busy_ns += elapsed_ns(later_of(&pool->workers[i].busy_since, &pool->interval_start), now);
+		}
+	}
+
+	my_log(
+		LOG_DAEMON | LOG_INFO,
+		"Worker pool: %zu/%zu busy, queue %zu/%zu, %llu sessions handed over, %llu dropped, queue wait avg %.3f ms / max %.3f ms, utilization %.1f%%",
+		pool->busy,
+		g->workers,
+		pool->count,
+		g->queue_depth,
+		(unsigned long long)pool->handed,
+		(unsigned long long)pool->dropped,
+		pool->handed ? (double)pool->wait_ns / (double)pool->handed / 1e6 : 0.0,
+		(double)pool->max_wait_ns / 1e6,
+		interval ? 100.0 * (double)busy_ns / ((double)interval * (double)g->workers) : 0.0
+	);
+
+	pool->interval_start = *now;
+	pool->handed         = 0;
+	pool->dropped        = 0;
+	pool->wait_ns        = 0;
+	pool->max_wait_ns    = 0;
+	pool->busy_ns        = 0;
+}
+
+static void* pool_worker(void* arg)
+{
+	struct pool_worker_t* self = (struct pool_worker_t*)arg;
+	struct pool_t* pool        = globals.pool;
+
+	while (1) {
+		struct pool_item_t item;
+		struct timespec now;
+		struct connection_info_t* conn;
+		uint64_t wait;
+
+		pthread_mutex_lock(&pool->mutex);
+		while (!pool->count && !globals.terminate) {
+			pthread_cond_wait(&pool->not_empty, &pool->mutex);
+		}
+
+		if (globals.terminate) {
+			pthread_mutex_unlock(&pool->mutex);
+			break;
+		}
+
+		item       = pool->ring[pool->head];
+		pool->head = (pool->head + 1) % globals.queue_depth;
+		--pool->count;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		wait = elapsed_ns(&item.enqueued, &now);
+		++pool->handed;
+		pool->wait_ns += wait;
+		if (wait > pool->max_wait_ns) {
+			pool->max_wait_ns = wait;
+		}
+
+		++pool->busy;
+		self->busy       = 1;
+		self->busy_since = now;
+
+		if (now.tv_sec - pool->interval_start.tv_sec >= REPORT_INTERVAL) {
+			report(&globals, pool, &now);
+		}
+
+		pthread_cond_signal(&pool->not_full);
+		pthread_mutex_unlock(&pool->mutex);
+
+		conn = alloc_connection(item.session, &item.addr, item.ip_tracked);
+		if (conn) {
+			/* Phase latencies include the time spent in the queue */
+			conn->started_ns = (uint64_t)item.enqueued.tv_sec * 1000000000 + (uint64_t)item.enqueued.tv_nsec;
+			conn->thread     = pthread_self();
+			register_connection(conn);
+			worker(conn);
+		}
+
+		pthread_mutex_lock(&pool->mutex);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		pool->busy_ns += elapsed_ns(later_of(&self->busy_since, &pool->interval_start), &now);
+		self->busy = 0;
+		--pool->busy;
+		pthread_mutex_unlock(&pool->mutex);
+	}
+
+	return NULL;
+}
+
+int pool_start(struct globals_t* g)
+{
+	struct pool_t* pool;
+	pthread_condattr_t cattr;
+	pthread_attr_t attr;
+
+	pool = calloc(1, sizeof(struct pool_t));
+	if (!pool) {
+		return -1;
+	}
+
+	g->pool       = pool;
+	pool->ring    = calloc(g->queue_depth, sizeof(struct pool_item_t));
+	pool->workers = calloc(g->workers, sizeof(struct pool_worker_t));
+	if (!pool->ring || !pool->workers) {
+		return -1;
+	}
+
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&pool->not_empty, &cattr);
+	pthread_cond_init(&pool->not_full, &cattr);
+	pthread_condattr_destroy(&cattr);
+	clock_gettime(CLOCK_MONOTONIC, &pool->interval_start);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, THREAD_STACK_SIZE);
+	for (size_t i = 0; i < g->workers; ++i) {
+		if (pthread_create(&pool->workers[i].thread, &attr, pool_worker, &pool->workers[i]) != 0) {
+			my_log(LOG_CRIT, "pthread_create() failed");
+			pthread_attr_destroy(&attr);
+			return -1;
+		}
+
+		pool->workers[i].started = 1;
+	}
+
+	pthread_attr_destroy(&attr);
+	my_log(LOG_DAEMON | LOG_INFO, "Serving sessions from %zu pooled workers, queue depth %zu", g->workers, g->queue_depth);
+	return 0;
+}
+
+/* A full queue only means rejection under the drop policy; with wait:MS the acceptor blocks instead */
+int pool_has_capacity(struct globals_t* g)
+{
+	struct pool_t* pool = g->pool;
+	int res;
+
+	if (g->overflow_wait) {
+		return 1;
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+	res = pool->count < g->queue_depth;
+	pthread_mutex_unlock(&pool->mutex);
+	return res;
+}
+
+void pool_submit(struct globals_t* g, ssh_session session, const struct sockaddr_storage* addr, int ip_tracked)
+{
+	struct pool_t* pool = g->pool;
+	struct timespec deadline;
+	int queued = 0;
+
+	pthread_mutex_lock(&pool->mutex);
+	{
+		if (pool->count == g->queue_depth && g->overflow_wait) {
+			clock_gettime(CLOCK_MONOTONIC, &deadline);
+			deadline.tv_sec  += g->overflow_timeout / 1000;
+			deadline.tv_nsec += (g->overflow_timeout % 1000) * 1000000;
+			if (deadline.tv_nsec >= 1000000000) {
+				++deadline.tv_sec;
+				deadline.tv_nsec -= 1000000000;
+			}
+
+			while (pool->count == g->queue_depth && !g->terminate) {
+				if (pthread_cond_timedwait(&pool->not_full, &pool->mutex, &deadline) == ETIMEDOUT) {
+					break;
+				}
+			}
+		}
+
+		if (pool->count < g->queue_depth && !g->terminate) {
+			struct pool_item_t* item = &pool->ring[(pool->head + pool->count) % g->queue_depth];
+
+			item->session = session;
+			item->addr       = *addr;
+			item->ip_tracked = ip_tracked;
+			clock_gettime(CLOCK_MONOTONIC, &item->enqueued);
+			++pool->count;
+			queued = 1;
+			pthread_cond_signal(&pool->not_empty);
+		}
+		else {
+			++pool->dropped;
+		}
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	if (!queued) {
+		my_log(LOG_ERR, "Too many connections");
+		drop_session(session, addr, ip_tracked);
+	}
+}
+
+void pool_stop(struct globals_t* g)
+{
+	struct pool_t* pool = g->pool;
+	struct timespec now;
+
+	if (!pool) {
+		return;
+	}
+
+	if (pool->workers && pool->ring) {
+		pthread_mutex_lock(&pool->mutex);
+		request_shutdown(g);
+		pthread_cond_broadcast(&pool->not_empty);
+		pthread_cond_broadcast(&pool->not_full);
+		pthread_mutex_unlock(&pool->mutex);
+
+		for (size_t i = 0; i < g->workers; ++i) {
+			if (pool->workers[i].started) {
+				/* Busy workers have been woken up by shutdown_fd, or force-closed by timers_stop() */
+				pthread_join(pool->workers[i].thread, NULL);
+			}
+		}
+
+		while (pool->count) {
+			struct pool_item_t* item = &pool->ring[pool->head];
+			drop_session(item->session, &item->addr, item->ip_tracked);
+			pool->head = (pool->head + 1) % g->queue_depth;
+			--pool->count;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		report(g, pool, &now);
+
+		pthread_cond_destroy(&pool->not_empty);
+		pthread_cond_destroy(&pool->not_full);
+		pthread_mutex_destroy(&pool->mutex);
+	}
+
+	free(pool->ring);
+	free(pool->workers);
+	free(pool);
+	g->pool = NULL;
+}
+
+/* A worker and its share of the default queue (two items per worker) */
+size_t pool_worker_memory(void)
+{
+	return sizeof(struct pool_worker_t) + 2 * sizeof(struct pool_item_t);
+}
@@ -0,0 +1,13 @@
+#ifndef POOL_H_
+#define POOL_H_
+
+#include <libssh/server.h>
+#include "globals.h"
+
+int pool_start(struct globals_t* g);
+int pool_has_capacity(struct globals_t* g);
+void pool_submit(struct globals_t* g, ssh_session session, const struct sockaddr_storage* addr, int ip_tracked);
+void pool_stop(struct globals_t* g);
+size_t pool_worker_memory(void);
+
+#endif /* POOL_H_ */
@@ -0,0 +1,26 @@
+#ifndef PROBES_H_
+#define PROBES_H_
+
+/*
+ * USDT probes of the provider ssh_honeypotd, for bpftrace and friends (see the examples in bpftrace/).
+ * A probe is a single nop and an ELF note until something attaches to it. Its arguments are only
+ * operands of that nop, so they must be values at hand: times are passed as CLOCK_MONOTONIC
+ * timestamps (bpftrace's nsecs) rather than durations, which would need a clock_gettime() per probe.
+ * Compiled in whenever <sys/sdt.h> is available, unless NO_USDT is defined.
+ */
+#if defined(__has_include) && !defined(NO_USDT)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_USDT 1
+#endif
+#endif
+
+#ifdef HAVE_USDT
+#define PROBE4(name, a1, a2, a3, a4)     DTRACE_PROBE4(ssh_honeypotd, name, a1, a2, a3, a4)
+#define PROBE5(name, a1, a2, a3, a4, a5) DTRACE_PROBE5(ssh_honeypotd, name, a1, a2, a3, a4, a5)
+#else
+#define PROBE4(name, a1, a2, a3, a4)     do {} while (0)
+#define PROBE5(name, a1, a2, a3, a4, a5) do {} while (0)
+#endif
+
+#endif /* PROBES_H_ */
@@ -0,0 +1,119 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "registry.h"
+
+#define CACHE_LINE 64
+#define NIL        UINT32_MAX
+
+/*
+ * One cache line per slot, so that threads registering and unregistering
+ * different connections never write to the same line.
+ */
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+struct registry_slot_t {
+	_Alignas(CACHE_LINE) atomic_uint next;  /* the next free slot while this one is on the free stack */
+};
+
+/*
+ * Fixed-capacity set of slots, one per live connection thread. Free slot indices form a Treiber stack;
+ * its head carries a generation tag in the upper 32 bits, which protects pops from ABA.
+ * Slots hold no pointer to their connection: a connection is freed by its own thread with no
+ * lock that a reader could take, so nothing could safely walk them. The shutdown and the metrics
+ * only need the count, and the session timers and the shutdown eventfd reach every session.
+ */
+struct registry_t {
+	_Alignas(CACHE_LINE) atomic_uint_fast64_t free_head;
+	_Alignas(CACHE_LINE) atomic_size_t count;
+	size_t capacity;
+	struct registry_slot_t* slots;
+};
+#pragma clang diagnostic pop
+
+static uint64_t make_head(uint64_t tag, uint32_t index)
+{
+	return (tag << 32) | index;
+}
+
+struct registry_t* registry_new(size_t capacity)
+{
+	struct registry_t* r;
+	void* mem;
+
+	if (!capacity || capacity >= NIL) {
+		return NULL;
+	}
+
+	if (posix_memalign(&mem, CACHE_LINE, sizeof(struct registry_t))) {
+		return NULL;
+	}
+
+	r = (struct registry_t*)mem;
+	memset(r, 0, sizeof(struct registry_t));
+	if (posix_memalign(&mem, CACHE_LINE, capacity * sizeof(struct registry_slot_t))) {
+		free(r);
+		return NULL;
+	}
+
+	r->slots    = (struct registry_slot_t*)mem;
+	r->capacity = capacity;
+	memset(r->slots, 0, capacity * sizeof(struct registry_slot_t));
+	for (size_t i = 0; i < capacity; ++i) {
+		atomic_init(&r->slots[i].next, i + 1 < capacity ? (unsigned int)(i + 1) : NIL);
+	}
+
+	atomic_init(&r->free_head, make_head(0, 0));
+	atomic_init(&r->count, 0);
+	return r;
+}
+
+void registry_free(struct registry_t* r)
+{
+	if (r) {
+		free(r->slots);
+		free(r);
+	}
+}
+
+/* Returns the slot of the connection, or -1 if the registry is full */
+long int registry_add(struct registry_t* r)
+{
+	uint64_t head = atomic_load_explicit(&r->free_head, memory_order_acquire);
+	uint32_t index;
+
+	do {
+		index = (uint32_t)head;
+		if (index == NIL) {
+			return -1;
+		}
+
+		/* May read a stale value if another thread pops this slot first; the tag makes the CAS fail then */
+		uint32_t next = atomic_load_explicit(&r->slots[index].next, memory_order_relaxed);
+		if (atomic_compare_exchange_weak_explicit(&r->free_head, &head, make_head((head >> 32) + 1, next), memory_order_acquire, memory_order_acquire)) {
+			break;
+		}
+	} while (1);
+
+	atomic_fetch_add_explicit(&r->count, 1, memory_order_relaxed);
+	return (long int)index;
+}
+
+void registry_remove(struct registry_t* r, long int slot)
+{
+	struct registry_slot_t* s = &r->slots[slot];
+	uint64_t head             = atomic_load_explicit(&r->free_head, memory_order_relaxed);
+
+	do {
+		atomic_store_explicit(&s->next, (uint32_t)head, memory_order_relaxed);
+	} while (!atomic_compare_exchange_weak_explicit(&r->free_head, &head, make_head((head >> 32) + 1, (uint32_t)slot), memory_order_release, memory_order_relaxed));
+
+	/* Last: once the count drops to zero, the registry may be freed by whoever is waiting for it */
+	atomic_fetch_sub_explicit(&r->count, 1, memory_order_release);
+}
+
+size_t registry_count(const struct registry_t* r)
+{
+	return r ? atomic_load_explicit(&r->count, memory_order_acquire) : 0;
+}
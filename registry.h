@@ -0,0 +1,16 @@
+#ifndef REGISTRY_H_
+#define REGISTRY_H_
+
+#include <stddef.h>
+
+struct registry_t;
+
+struct registry_t* registry_new(size_t capacity);
+void registry_free(struct registry_t* r);
+
+long int registry_add(struct registry_t* r);
+void registry_remove(struct registry_t* r, long int slot);
+
+size_t registry_count(const struct registry_t* r);
+
+#endif /* REGISTRY_H_ */
@@ -0,0 +1,270 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include "sizing.h"
+#include "globals.h"
+#include "histogram.h"
+#include "log.h"
+#include "pool.h"
+
+/*
+ * Limits left to "auto" are derived from the cgroup v2 limits of the process (the lowest
+ * cpu.max and memory.max / memory.high on the way from our cgroup up to the root) and from what
+ * a session costs. The baseline is our resident set, measured once the host keys are loaded;
+ * a session costs its libssh state (socket and packet buffers, key exchange and cipher contexts)
+ * and our connection_info_t. A session with a thread of its own adds the stack and the thread's
+ * latency histograms, and a pool worker its slot in the pool.
+ *
+ * SESSION_MEMORY and KEX_PER_CPU are not measured on the host: a session only reaches its full
+ * size, and a key exchange its full cost, with a client on the other end. They are estimates.
+ * SESSION_MEMORY allows for libssh's input and output buffers, each grown to hold a 32 KiB
+ * packet (RFC 4253, 6.1), plus the key exchange and cipher contexts and connection_info_t.
+ * KEX_PER_CPU assumes that a key exchange uses a CPU for a millisecond or two out of several
+ * round trips, so a few of them in flight keep a CPU busy without a long queue.
+ * To recalibrate, run `make bench` with BENCH_DAEMON_ARGS="-E 1" at two values of
+ * BENCH_CONNECTIONS: the difference in rss_kb over the difference in connections is the cost
+ * of a session. KEX_PER_CPU is about the handshake_ms p50 of that run over the
+ * cpu_us_per_handshake of `make bench-profiles` (in ms), for the profile in use.
+ */
+#define CGROUP_ROOT      "/sys/fs/cgroup"
+#define SESSION_MEMORY   (96 * 1024)
+#define HEADROOM         8      /* keep 1/8 of the memory limit free */
+#define KEX_PER_CPU      4      /* key exchanges in flight per CPU, see above */
+#define MIN_SESSIONS     4
+#define PATH_SIZE        4096
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+struct resources_t {
+	double cpus;                    /* CPU quota, 0 if none */
+	size_t affinity;                /* the number of CPUs we may run on */
+	size_t memory;                  /* 0 if unlimited */
+	size_t resident;
+};
+#pragma clang diagnostic pop
+
+static int read_file(const char* dir, const char* name, char* buf, size_t size)
+{
+	char path[PATH_SIZE + 64];
+	FILE* f;
+	int res = -1;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	f = fopen(path, "re");
+	if (f) {
+		if (fgets(buf, (int)size, f)) {
+			buf[strcspn(buf, "\n")] = 0;
+			res = 0;
+		}
+
+		fclose(f);
+	}
+
+	return res;
+}
+
+/* The path of our cgroup in the unified hierarchy ("0::/path") */
+static int cgroup_path(char* buf, size_t size)
+{
+	char line[PATH_SIZE];
+	FILE* f = fopen("/proc/self/cgroup", "re");
+	int res = -1;
+
+	if (f) {
+		while (fgets(line, sizeof(line), f)) {
+			if (!strncmp(line, "0::", 3)) {
+				line[strcspn(line, "\n")] = 0;
+				snprintf(buf, size, "%s%s", CGROUP_ROOT, strcmp(line + 3, "/") ? line + 3 : "");
+				res = 0;
+				break;
+			}
+		}
+
+		fclose(f);
+	}
+
+	return res;
+}
+
+static void lower_memory(const char* dir, const char* name, struct resources_t* res)
+{
+	char buf[64];
+	unsigned long long value;
+
+	if (!read_file(dir, name, buf, sizeof(buf)) && strcmp(buf, "max") && sscanf(buf, "%llu", &value) == 1) {
+		if (!res->memory || value < res->memory) {
+			res->memory = (size_t)value;
+		}
+	}
+}
+
+static void read_limits(const char* dir, struct resources_t* res)
+{
+	char buf[64];
+	unsigned long long quota;
+	unsigned long long period;
+
+	if (!read_file(dir, "cpu.max", buf, sizeof(buf)) && sscanf(buf, "%llu %llu", &quota, &period) == 2 && period) {
+		double cpus = (double)quota / (double)period;
+		if (res->cpus <= 0 || cpus < res->cpus) {
+			res->cpus = cpus;
+		}
+	}
+
+	lower_memory(dir, "memory.max", res);
+	lower_memory(dir, "memory.high", res);
+}
+
+static void probe(struct resources_t* res)
+{
+	char path[PATH_SIZE + sizeof(CGROUP_ROOT)];
+	cpu_set_t set;
+	FILE* f;
+	unsigned long pages;
+	unsigned long resident;
+
+	memset(res, 0, sizeof(*res));
+	res->affinity = sched_getaffinity(0, sizeof(set), &set) == 0 ? (size_t)CPU_COUNT(&set) : 1;
+
+	/* Without a cgroup namespace, our cgroup may not be visible under the mount point; its ancestors, up to the root, still are */
+	if (!cgroup_path(path, sizeof(path))) {
+		while (1) {
+			char* slash;
+
+			read_limits(path, res);
+			slash = strrchr(path, '/');
+			if (!slash || (size_t)(slash - path) < strlen(CGROUP_ROOT)) {
+				break;
+			}
+
+			*slash = 0;
+		}
+	}
+
+	f = fopen("/proc/self/statm", "re");
+	if (f) {
+		if (fscanf(f, "%lu %lu", &pages, &resident) == 2) {
+			res->resident = (size_t)resident * (size_t)sysconf(_SC_PAGESIZE);
+		}
+
+		fclose(f);
+	}
+}
+
+static size_t round_up(double value)
+{
+	size_t n = (size_t)value;
+
+	return (double)n < value ? n + 1 : n;
+}
+
+static size_t sessions_fit(const struct resources_t* res, size_t cost)
+{
+	size_t reserve = res->memory / HEADROOM + res->resident;
+	size_t n       = res->memory > reserve ? (res->memory - reserve) / cost : 0;
+
+	return n > MIN_SESSIONS ? n : MIN_SESSIONS;
+}
+
+static size_t thread_memory(void)
+{
+	return THREAD_STACK_SIZE + SESSION_MEMORY + histogram_thread_memory();
+}
+
+static const char* describe(char* buf, size_t size, size_t value, const char* zero)
+{
+	if (value) {
+		snprintf(buf, size, "%zu", value);
+		return buf;
+	}
+
+	return zero;
+}
+
+void sizing_apply(struct globals_t* g)
+{
+	struct resources_t res;
+	double cpus;
+	const char* loops_from    = "set";
+	const char* workers_from  = "set";
+	const char* sessions_from = "set";
+	const char* kex_from      = "set";
+	char memory[32];
+	char sessions[32];
+	char kex[32];
+
+	probe(&res);
+	cpus = res.cpus > 0 && res.cpus < (double)res.affinity ? res.cpus : (double)res.affinity;
+
+	if (g->event_loops == AUTO_SIZE) {
+		g->event_loops = round_up(cpus);
+		loops_from     = "cpu";
+	}
+
+	if (g->workers == AUTO_SIZE) {
+		g->workers   = res.memory ? sessions_fit(&res, thread_memory() + pool_worker_memory()) : MAX_THREADS;
+		workers_from = res.memory ? "memory" : "default";
+		if (!g->queue_depth) {
+			g->queue_depth = 2 * g->workers;
+		}
+	}
+
+	if (g->max_sessions == AUTO_SIZE) {
+		if (res.memory) {
+			g->max_sessions = sessions_fit(&res, g->event_loops ? SESSION_MEMORY : thread_memory());
+			sessions_from   = "memory";
+		}
+		else {
+			/* With event loops, evloop_start() derives it from the descriptor limit */
+			g->max_sessions = g->event_loops ? 0 : MAX_THREADS;
+			sessions_from   = "default";
+		}
+	}
+
+	if (g->max_kex == AUTO_SIZE) {
+		g->max_kex = res.cpus > 0 ? round_up(cpus * KEX_PER_CPU) : 0;
+		kex_from   = res.cpus > 0 ? "cpu" : "default";
+	}
+
+	if (res.memory) {
+		snprintf(memory, sizeof(memory), "%.1f MiB", (double)res.memory / 1048576.0);
+	}
+
+	my_log(
+		LOG_DAEMON | LOG_INFO,
+		"Resources: %.2f CPUs%s, memory %s, resident %.1f MiB",
+		cpus,
+		res.cpus > 0 ? " (cgroup quota)" : "",
+		res.memory ? memory : "unlimited",
+		(double)res.resident / 1048576.0
+	);
+
+	if (g->event_loops) {
+		my_log(
+			LOG_DAEMON | LOG_INFO,
+			"Limits: %zu event loops (%s), %s sessions (%s), %s concurrent key exchanges (%s)",
+			g->event_loops, loops_from,
+			describe(sessions, sizeof(sessions), g->max_sessions, "descriptor-limited"), sessions_from,
+			describe(kex, sizeof(kex), g->max_kex, "unlimited"), kex_from
+		);
+	}
+	else if (g->workers) {
+		my_log(
+			LOG_DAEMON | LOG_INFO,
+			"Limits: %zu workers (%s), queue depth %zu, %s concurrent key exchanges (%s)",
+			g->workers, workers_from, g->queue_depth,
+			describe(kex, sizeof(kex), g->max_kex, "unlimited"), kex_from
+		);
+	}
+	else {
+		my_log(
+			LOG_DAEMON | LOG_INFO,
+			"Limits: %zu sessions (%s), %s concurrent key exchanges (%s)",
+			g->max_sessions, sessions_from,
+			describe(kex, sizeof(kex), g->max_kex, "unlimited"), kex_from
+		);
+	}
+}
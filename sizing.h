@@ -0,0 +1,8 @@
+#ifndef SIZING_H_
+#define SIZING_H_
+
+#include "globals.h"
+
+void sizing_apply(struct globals_t* g);
+
+#endif /* SIZING_H_ */
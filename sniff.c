@@ -0,0 +1,140 @@
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <libssh/libssh.h>
+#include "sniff.h"
+#include "globals.h"
+#include "events.h"
+#include "metrics.h"
+#include "worker.h"
+
+/* Enough to tell the protocols apart and to show a bit of the request in the log */
+#define PEEK_SIZE 32
+
+static const char* const http_methods[] = {
+	"GET ", "POST ", "HEAD ", "PUT ", "DELETE ", "OPTIONS ", "CONNECT ", "PATCH ", "TRACE ", "PRI * HTTP/2"
+};
+
+static int has_prefix(const unsigned char* buf, size_t len, const char* prefix)
+{
+	size_t n = strlen(prefix);
+	return !memcmp(buf, prefix, len < n ? len : n);
+}
+
+/*
+ * NULL for (the beginning of) an SSH identification string, otherwise the name of the protocol.
+ * Whatever the client has sent so far is enough: a client that has sent a part of "SSH-" gets the benefit of the doubt.
+ */
+static const char* detect_protocol(const unsigned char* buf, size_t len)
+{
+	if (has_prefix(buf, len, "SSH-")) {
+		return NULL;
+	}
+
+	for (size_t i = 0; i < sizeof(http_methods) / sizeof(http_methods[0]); ++i) {
+		if (has_prefix(buf, len, http_methods[i])) {
+			return "http";
+		}
+	}
+
+	if (buf[0] == 0x16 && (len < 2 || buf[1] == 0x03)) {
+		return "tls";
+	}
+
+	if (buf[0] == 0x03 && (len < 2 || buf[1] == 0x00)) {
+		return "rdp";
+	}
+
+	if (buf[0] == 0x04 || buf[0] == 0x05) {
+		return "socks";
+	}
+
+	return "unknown";
+}
+
+static void log_probe(struct connection_info_t* conn, const char* protocol, const char* data)
+{
+	struct event_non_ssh_t e = {
+		conn->ipstr,
+		conn->port,
+		conn->my_ipstr,
+		conn->my_port,
+		conn->listener,
+		protocol,
+		data
+	};
+
+	emit_non_ssh(&e);
+}
+
+/* Peeks at what the client has sent without consuming it: libssh reads the same bytes afterwards */
+int sniff_check(struct connection_info_t* conn)
+{
+	unsigned char buf[PEEK_SIZE + 1];
+	const char* protocol;
+	ssize_t n;
+
+	do {
+		n = recv(ssh_get_fd(conn->session), buf, PEEK_SIZE, MSG_PEEK | MSG_DONTWAIT);
+	} while (n == -1 && errno == EINTR);
+
+	if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		return SNIFF_NO_DATA;
+	}
+
+	if (n <= 0) {
+		/* Closed (or reset, or timed out) before saying anything */
+		if (conn->expired != EXPIRED_SHUTDOWN) {
+			sniff_timeout(conn);
+		}
+
+		return SNIFF_DROP;
+	}
+
+	protocol = detect_protocol(buf, (size_t)n);
+	if (!protocol) {
+		return SNIFF_SSH;
+	}
+
+	buf[n] = 0;
+	metrics_inc(METRIC_connections_non_ssh_total);
+	log_probe(conn, protocol, (const char*)buf);
+	return SNIFF_DROP;
+}
+
+/*
+ * The blocking flavor for the thread-per-connection and pooled modes. There is no polling timeout:
+ * at the deadline the session timer shuts the socket down, which reads as a hangup; a shutdown makes shutdown_fd readable.
+ */
+int sniff_wait(struct connection_info_t* conn)
+{
+	struct pollfd pfd[2] = {
+		{ ssh_get_fd(conn->session), POLLIN, 0 },
+		{ globals.shutdown_fd,       POLLIN, 0 }
+	};
+
+	while (1) {
+		int rc = poll(pfd, 2, -1);
+
+		if (rc > 0 && (pfd[1].revents & POLLIN)) {
+			return SNIFF_DROP;
+		}
+
+		if (rc > 0) {
+			rc = sniff_check(conn);
+			if (rc != SNIFF_NO_DATA) {
+				return rc;
+			}
+		}
+		else if (rc == -1 && errno != EINTR) {
+			return SNIFF_DROP;
+		}
+	}
+}
+
+void sniff_timeout(struct connection_info_t* conn)
+{
+	metrics_inc(METRIC_connections_silent_total);
+	log_probe(conn, "silent", "");
+}
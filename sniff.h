@@ -0,0 +1,14 @@
+#ifndef SNIFF_H_
+#define SNIFF_H_
+
+#include "globals.h"
+
+#define SNIFF_SSH       1
+#define SNIFF_DROP      0
+#define SNIFF_NO_DATA (-1)
+
+int sniff_check(struct connection_info_t* conn);
+int sniff_wait(struct connection_info_t* conn);
+void sniff_timeout(struct connection_info_t* conn);
+
+#endif /* SNIFF_H_ */
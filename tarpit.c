@@ -0,0 +1,411 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include "tarpit.h"
+#include "globals.h"
+#include "listener.h"
+#include "log.h"
+
+#define WHEEL           256         /* one-second slots; the delay must be shorter than the wheel */
+#define MAX_LINE        32
+#define REPORT_INTERVAL 60
+#define LISTENER        UINT32_MAX  /* epoll tag of the listening socket */
+#define SHUTDOWN        (UINT32_MAX - 1) /* epoll tag of globals.shutdown_fd */
+#define NIL             (-1)
+
+/* 16 bytes per client; clients are only counted, never logged one by one */
+struct tarpit_client_t {
+	int fd;                         /* -1 for a free entry */
+	int32_t prev;
+	int32_t next;                   /* the next free entry for a free one */
+	uint32_t since;                 /* tick of the connection */
+};
+
+/*
+ * Every client waits in the slot of the wheel for the tick of its next line;
+ * a tick visits only the clients due in it. Nothing but the epoll thread touches any of this.
+ */
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+struct tarpit_t {
+	pthread_t thread;
+	int listen_fd;
+	int epoll_fd;
+	int paused;
+	int started;
+	struct tarpit_client_t* clients;
+	size_t max;
+	size_t held;
+	int32_t free_list;
+	int32_t wheel[WHEEL];
+	uint32_t tick;
+	uint64_t rng;
+	unsigned long long trapped;
+	unsigned long long wasted;      /* client-seconds of the released clients */
+	uint32_t last_report;
+};
+#pragma clang diagnostic pop
+
+static uint32_t current_tick(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t)ts.tv_sec;
+}
+
+static uint64_t next_random(struct tarpit_t* t)
+{
+	t->rng ^= t->rng << 13;
+	t->rng ^= t->rng >> 7;
+	t->rng ^= t->rng << 17;
+	return t->rng;
+}
+
+static void wheel_insert(struct tarpit_t* t, int32_t i, uint32_t tick)
+{
+	int32_t* slot = &t->wheel[tick % WHEEL];
+
+	t->clients[i].prev = NIL;
+	t->clients[i].next = *slot;
+	if (*slot != NIL) {
+		t->clients[*slot].prev = i;
+	}
+
+	*slot = i;
+}
+
+static void wheel_remove(struct tarpit_t* t, int32_t i, uint32_t tick)
+{
+	struct tarpit_client_t* c = &t->clients[i];
+
+	if (c->prev != NIL) {
+		t->clients[c->prev].next = c->next;
+	}
+	else {
+		t->wheel[tick % WHEEL] = c->next;
+	}
+
+	if (c->next != NIL) {
+		t->clients[c->next].prev = c->prev;
+	}
+}
+
+/* `due` is the tick of the slot the client waits in */
+static void release(struct tarpit_t* t, int32_t i, uint32_t due)
+{
+	struct tarpit_client_t* c = &t->clients[i];
+	uint32_t held             = t->tick - c->since;
+
+	wheel_remove(t, i, due);
+	close(c->fd);
+	c->fd        = -1;
+	c->next      = t->free_list;
+	t->free_list = i;
+	t->wasted   += held;
+	--t->held;
+}
+
+/*
+ * Lines before the identification string are allowed by RFC 4253, section 4.2,
+ * and clients keep reading them; a line must not start with "SSH-".
+ */
+static int drip(struct tarpit_t* t, struct tarpit_client_t* c)
+{
+	char line[MAX_LINE + 2];
+	uint64_t r  = next_random(t);
+	size_t len  = 3 + (size_t)(r % (MAX_LINE - 3));
+	ssize_t n;
+
+	for (size_t i = 0; i < len; ++i) {
+		if (i % 8 == 0) {
+			r = next_random(t);
+		}
+
+		line[i] = (char)(i ? 0x21 + (r & 0xFF) % 94 : 'a' + (r & 0xFF) % 26);
+		r     >>= 8;
+	}
+
+	line[len++] = '\r';
+	line[len++] = '\n';
+
+	n = send(c->fd, line, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+	if (n > 0) {
+		return 0;
+	}
+
+	/* A full send buffer only means that the client reads even slower than we write */
+	return n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+}
+
+static void set_listening(struct tarpit_t* t, int on)
+{
+	struct epoll_event ev;
+
+	if (on == !t->paused) {
+		return;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events   = EPOLLIN;
+	ev.data.u32 = LISTENER;
+	epoll_ctl(t->epoll_fd, on ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, t->listen_fd, &ev);
+	t->paused = !on;
+}
+
+static void accept_clients(struct tarpit_t* t)
+{
+	while (t->free_list != NIL) {
+		struct epoll_event ev;
+		int32_t i;
+		int fd = accept4(t->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+		if (fd == -1) {
+			if (errno == EMFILE || errno == ENFILE) {
+				/* Out of descriptors: wait for clients to go away instead of spinning on the listener */
+				set_listening(t, 0);
+			}
+
+			return;
+		}
+
+		/* Only a hangup is of interest: whatever the client sends just sits in its small receive buffer */
+		i = t->free_list;
+		memset(&ev, 0, sizeof(ev));
+		ev.events   = EPOLLRDHUP;
+		ev.data.u32 = (uint32_t)i;
+		if (epoll_ctl(t->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+			close(fd);
+			continue;
+		}
+
+		t->free_list        = t->clients[i].next;
+		t->clients[i].fd    = fd;
+		t->clients[i].since = t->tick;
+		wheel_insert(t, i, t->tick + (uint32_t)globals.tarpit_delay);
+		++t->held;
+		++t->trapped;
+	}
+
+	set_listening(t, 0);
+}
+
+static void run_tick(struct tarpit_t* t)
+{
+	uint32_t delay = (uint32_t)globals.tarpit_delay;
+	int32_t i      = t->wheel[t->tick % WHEEL];
+
+	t->wheel[t->tick % WHEEL] = NIL;
+	while (i != NIL) {
+		int32_t next = t->clients[i].next;
+
+		/* Re-linked into the slot first, so that release() finds it there */
+		wheel_insert(t, i, t->tick + delay);
+		if (drip(t, &t->clients[i])) {
+			release(t, i, t->tick + delay);
+		}
+
+		i = next;
+	}
+
+	if (t->paused && t->free_list != NIL) {
+		set_listening(t, 1);
+	}
+}
+
+static void report(struct tarpit_t* t)
+{
+	unsigned long long wasted = t->wasted;
+
+	for (size_t i = 0; i < t->max; ++i) {
+		if (t->clients[i].fd != -1) {
+			wasted += t->tick - t->clients[i].since;
+		}
+	}
+
+	my_log(
+		LOG_DAEMON | LOG_INFO,
+		"Tarpit: %zu clients held, %llu trapped in total, %llu client-seconds wasted",
+		t->held,
+		t->trapped,
+		wasted
+	);
+
+	t->last_report = t->tick;
+}
+
+/*
+ * Clients are due every `delay` ticks after the connection, and the slot of the current tick
+ * has already been served: the client waits in the first slot after it
+ */
+static void hangup(struct tarpit_t* t, int32_t i)
+{
+	uint32_t delay = (uint32_t)globals.tarpit_delay;
+	uint32_t since = t->clients[i].since;
+
+	release(t, i, since + ((t->tick - since) / delay + 1) * delay);
+}
+
+static void* tarpit_thread(void* arg)
+{
+	struct tarpit_t* t = (struct tarpit_t*)arg;
+	struct epoll_event events[64];
+
+	while (!globals.terminate) {
+		int n = epoll_wait(t->epoll_fd, events, sizeof(events) / sizeof(events[0]), 1000);
+		uint32_t now = current_tick();
+
+		for (int k = 0; k < n; ++k) {
+			if (events[k].data.u32 == LISTENER) {
+				accept_clients(t);
+			}
+			else if (events[k].data.u32 == SHUTDOWN) {
+				/* globals.terminate is set */
+			}
+			else if (t->clients[events[k].data.u32].fd != -1) {
+				hangup(t, (int32_t)events[k].data.u32);
+			}
+		}
+
+		/* Catch up tick by tick, so that no slot is skipped after a long wait */
+		while (t->tick != now) {
+			++t->tick;
+			run_tick(t);
+		}
+
+		if (t->tick - t->last_report >= REPORT_INTERVAL) {
+			report(t);
+		}
+	}
+
+	return NULL;
+}
+
+/* Called before the privileges are dropped, so that the tarpit may sit on a privileged port */
+int tarpit_open(struct globals_t* g)
+{
+	struct tarpit_t* t = calloc(1, sizeof(struct tarpit_t));
+	struct rlimit lim;
+
+	if (!t) {
+		return -1;
+	}
+
+	t->clients = calloc(g->tarpit_max, sizeof(struct tarpit_client_t));
+	if (!t->clients) {
+		free(t);
+		return -1;
+	}
+
+	/* A socket handed over by a predecessor (or the service manager) is taken as is */
+	t->listen_fd = g->inherited_tarpit != -1 ? g->inherited_tarpit : listen_on(g, g->tarpit_port);
+	g->inherited_tarpit = -1;
+	if (t->listen_fd == -1) {
+		free(t->clients);
+		free(t);
+		return -1;
+	}
+
+	/* Every trapped client holds a descriptor: take all the descriptors we are allowed to */
+	if (getrlimit(RLIMIT_NOFILE, &lim) == 0 && lim.rlim_cur < lim.rlim_max) {
+		lim.rlim_cur = lim.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &lim);
+	}
+
+	for (size_t i = 0; i < g->tarpit_max; ++i) {
+		t->clients[i].fd   = -1;
+		t->clients[i].next = i + 1 < g->tarpit_max ? (int32_t)(i + 1) : NIL;
+	}
+
+	for (size_t i = 0; i < WHEEL; ++i) {
+		t->wheel[i] = NIL;
+	}
+
+	t->max      = g->tarpit_max;
+	t->epoll_fd = -1;
+	t->paused   = 1;
+	g->tarpit   = t;
+	return 0;
+}
+
+int tarpit_start(struct globals_t* g)
+{
+	struct tarpit_t* t = g->tarpit;
+	struct epoll_event ev;
+	struct timespec ts;
+
+	t->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (t->epoll_fd == -1) {
+		return -1;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	t->rng         = ((uint64_t)ts.tv_sec << 32) ^ (uint64_t)ts.tv_nsec ^ (uint64_t)getpid() ^ 0x9E3779B97F4A7C15ULL;
+	t->tick        = current_tick();
+	t->last_report = t->tick;
+	set_listening(t, 1);
+
+	/* Level-triggered and never reset, like in every other poll loop */
+	memset(&ev, 0, sizeof(ev));
+	ev.events   = EPOLLIN;
+	ev.data.u32 = SHUTDOWN;
+	if (epoll_ctl(t->epoll_fd, EPOLL_CTL_ADD, g->shutdown_fd, &ev) == -1) {
+		return -1;
+	}
+
+	if (pthread_create(&t->thread, NULL, tarpit_thread, t) != 0) {
+		return -1;
+	}
+
+	t->started = 1;
+	my_log(
+		LOG_DAEMON | LOG_INFO,
+		"Tarpit on port %s: up to %zu clients, a line every %d seconds",
+		g->tarpit_port,
+		t->max,
+		g->tarpit_delay
+	);
+
+	return 0;
+}
+
+void tarpit_stop(struct globals_t* g)
+{
+	struct tarpit_t* t = g->tarpit;
+
+	if (!t) {
+		return;
+	}
+
+	if (t->started) {
+		pthread_join(t->thread, NULL);
+		t->tick = current_tick();
+		report(t);
+	}
+
+	for (size_t i = 0; i < t->max; ++i) {
+		if (t->clients[i].fd != -1) {
+			close(t->clients[i].fd);
+		}
+	}
+
+	if (t->epoll_fd != -1) {
+		close(t->epoll_fd);
+	}
+
+	close(t->listen_fd);
+	free(t->clients);
+	free(t);
+	g->tarpit = NULL;
+}
+
+int tarpit_listener(struct globals_t* g)
+{
+	return g->tarpit->listen_fd;
+}
@@ -0,0 +1,11 @@
+#ifndef TARPIT_H_
+#define TARPIT_H_
+
+#include "globals.h"
+
+int tarpit_open(struct globals_t* g);
+int tarpit_start(struct globals_t* g);
+void tarpit_stop(struct globals_t* g);
+int tarpit_listener(struct globals_t* g);
+
+#endif /* TARPIT_H_ */
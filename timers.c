@@ -0,0 +1,289 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include "timers.h"
+#include "globals.h"
+#include "worker.h"
+
+#define TICK_NS    100000000ULL     /* 100 ms */
+#define LEVEL_BITS 6
+#define LEVEL_SIZE (1 << LEVEL_BITS)
+#define LEVEL_MASK (LEVEL_SIZE - 1)
+#define LEVELS     4                /* 64^4 ticks, about 19 days; later deadlines are parked and placed again */
+
+/*
+ * Hierarchical timer wheel of every session deadline. Level 0 has a slot per tick;
+ * a slot of level N covers 64^N ticks and is cascaded into the lower levels when its time comes,
+ * so arming, cancelling and firing a timer are O(1) whatever the number of sessions.
+ * The thread sleeps until the next occupied slot of level 0 or the next cascade, and not at all while the wheel is empty.
+ */
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+struct wheel_t {
+	pthread_mutex_t mutex;
+	pthread_cond_t wakeup;
+	pthread_t thread;
+	struct wheel_timer_t* slots[LEVELS][LEVEL_SIZE];
+	struct wheel_timer_t* unarmed;  /* the timers without a deadline */
+	size_t count;                   /* the timers in the slots */
+	uint64_t now;                   /* the last processed tick */
+	uint64_t wake;                  /* the tick the thread sleeps until */
+	int started;
+	int stopped;
+};
+#pragma clang diagnostic pop
+
+static struct wheel_t wheel;
+
+static uint64_t current_tick(void)
+{
+	return monotonic_ns() / TICK_NS;
+}
+
+static void link_timer(struct wheel_timer_t* t, struct wheel_timer_t** slot)
+{
+	t->slot = slot;
+	t->prev = NULL;
+	t->next = *slot;
+	if (*slot) {
+		(*slot)->prev = t;
+	}
+
+	*slot = t;
+	if (slot != &wheel.unarmed) {
+		++wheel.count;
+	}
+}
+
+static void unlink_timer(struct wheel_timer_t* t)
+{
+	if (t->prev) {
+		t->prev->next = t->next;
+	}
+	else {
+		*t->slot = t->next;
+	}
+
+	if (t->next) {
+		t->next->prev = t->prev;
+	}
+
+	if (t->slot != &wheel.unarmed) {
+		--wheel.count;
+	}
+
+	t->slot = NULL;
+}
+
+/* The lowest level on which the expiry is at most a full turn of slots away */
+static void place(struct wheel_timer_t* t)
+{
+	unsigned int level = 0;
+	uint64_t index;
+
+	if (t->expires == TIMER_NEVER) {
+		link_timer(t, &wheel.unarmed);
+		return;
+	}
+
+	if (t->expires <= wheel.now) {
+		t->expires = wheel.now + 1;
+	}
+
+	while (level < LEVELS && (t->expires >> (LEVEL_BITS * level)) - (wheel.now >> (LEVEL_BITS * level)) > LEVEL_SIZE) {
+		++level;
+	}
+
+	if (level == LEVELS) {
+		/* Beyond the wheel: parked in the last slot of the top level to come round, and placed again from there */
+		level = LEVELS - 1;
+		index = ((wheel.now >> (LEVEL_BITS * level)) + LEVEL_MASK) & LEVEL_MASK;
+	}
+	else {
+		index = (t->expires >> (LEVEL_BITS * level)) & LEVEL_MASK;
+	}
+
+	link_timer(t, &wheel.slots[level][index]);
+}
+
+static void fire_list(struct wheel_timer_t* t, int shutdown)
+{
+	while (t) {
+		struct wheel_timer_t* next = t->next;
+
+		t->slot = NULL;
+		t->fire(t->data, t->tag, shutdown);
+		t = next;
+	}
+}
+
+static void run_tick(uint64_t tick)
+{
+	struct wheel_timer_t* t;
+
+	/* Placed against the previous tick, so that the timers due right now land in the slot about to fire */
+	for (unsigned int level = 1; level < LEVELS && !(tick & ((1ULL << (LEVEL_BITS * level)) - 1)); ++level) {
+		struct wheel_timer_t** slot = &wheel.slots[level][(tick >> (LEVEL_BITS * level)) & LEVEL_MASK];
+
+		t     = *slot;
+		*slot = NULL;
+		while (t) {
+			struct wheel_timer_t* next = t->next;
+
+			--wheel.count;
+			place(t);
+			t = next;
+		}
+	}
+
+	wheel.now = tick;
+	t = wheel.slots[0][tick & LEVEL_MASK];
+	wheel.slots[0][tick & LEVEL_MASK] = NULL;
+	for (struct wheel_timer_t* p = t; p; p = p->next) {
+		--wheel.count;
+	}
+
+	fire_list(t, 0);
+}
+
+static uint64_t next_wake(void)
+{
+	if (!wheel.count) {
+		return TIMER_NEVER;
+	}
+
+	for (uint64_t tick = wheel.now + 1; tick & LEVEL_MASK; ++tick) {
+		if (wheel.slots[0][tick & LEVEL_MASK]) {
+			return tick;
+		}
+	}
+
+	return (wheel.now | LEVEL_MASK) + 1;
+}
+
+static void* timer_thread(void* arg)
+{
+	pthread_mutex_lock(&wheel.mutex);
+	while (!wheel.stopped) {
+		uint64_t now = current_tick();
+
+		if (!wheel.count) {
+			wheel.now = now;
+		}
+
+		while (wheel.now < now) {
+			run_tick(wheel.now + 1);
+		}
+
+		wheel.wake = next_wake();
+		if (wheel.wake == TIMER_NEVER) {
+			pthread_cond_wait(&wheel.wakeup, &wheel.mutex);
+		}
+		else {
+			struct timespec ts;
+
+			ts.tv_sec  = (time_t)(wheel.wake * TICK_NS / 1000000000);
+			ts.tv_nsec = (long int)(wheel.wake * TICK_NS % 1000000000);
+			pthread_cond_timedwait(&wheel.wakeup, &wheel.mutex, &ts);
+		}
+	}
+
+	pthread_mutex_unlock(&wheel.mutex);
+	return NULL;
+}
+
+int timers_start(struct globals_t* g)
+{
+	pthread_condattr_t attr;
+
+	pthread_mutex_init(&wheel.mutex, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&wheel.wakeup, &attr);
+	pthread_condattr_destroy(&attr);
+
+	wheel.now  = current_tick();
+	wheel.wake = TIMER_NEVER;
+	if (pthread_create(&wheel.thread, NULL, timer_thread, NULL) != 0) {
+		return -1;
+	}
+
+	wheel.started = 1;
+	return 0;
+}
+
+/* Fires every pending timer as a shutdown; the timers armed from now on fire right away */
+void timers_stop(struct globals_t* g)
+{
+	if (!wheel.started) {
+		return;
+	}
+
+	pthread_mutex_lock(&wheel.mutex);
+	if (!wheel.stopped) {
+		wheel.stopped = 1;
+		for (unsigned int level = 0; level < LEVELS; ++level) {
+			for (unsigned int i = 0; i < LEVEL_SIZE; ++i) {
+				fire_list(wheel.slots[level][i], 1);
+				wheel.slots[level][i] = NULL;
+			}
+		}
+
+		fire_list(wheel.unarmed, 1);
+		wheel.unarmed = NULL;
+		wheel.count   = 0;
+		pthread_cond_signal(&wheel.wakeup);
+	}
+
+	pthread_mutex_unlock(&wheel.mutex);
+	pthread_join(wheel.thread, NULL);
+	wheel.started = 0;
+}
+
+void timer_init(struct wheel_timer_t* t, void (*fire)(void* data, int tag, int shutdown), void* data)
+{
+	t->prev = NULL;
+	t->next = NULL;
+	t->slot = NULL;
+	t->fire = fire;
+	t->data = data;
+}
+
+/* (Re)arms the timer for the deadline (monotonic_ns(), rounded up to the next tick) or TIMER_NEVER */
+void timer_set(struct wheel_timer_t* t, uint64_t deadline, int tag)
+{
+	pthread_mutex_lock(&wheel.mutex);
+	if (t->slot) {
+		unlink_timer(t);
+	}
+
+	t->tag = tag;
+	if (wheel.stopped) {
+		t->fire(t->data, tag, 1);
+	}
+	else {
+		if (!wheel.count) {
+			/* The thread may have slept for a long time: do not make it walk the ticks it has missed */
+			wheel.now = current_tick();
+		}
+
+		t->expires = deadline == TIMER_NEVER ? TIMER_NEVER : (deadline + TICK_NS - 1) / TICK_NS;
+		place(t);
+		if (t->expires < wheel.wake) {
+			pthread_cond_signal(&wheel.wakeup);
+		}
+	}
+
+	pthread_mutex_unlock(&wheel.mutex);
+}
+
+void timer_cancel(struct wheel_timer_t* t)
+{
+	pthread_mutex_lock(&wheel.mutex);
+	if (t->slot) {
+		unlink_timer(t);
+	}
+
+	pthread_mutex_unlock(&wheel.mutex);
+}
@@ -0,0 +1,33 @@
+#ifndef TIMERS_H_
+#define TIMERS_H_
+
+#include <stdint.h>
+
+struct globals_t;
+
+/* No deadline: the timer only fires on shutdown */
+#define TIMER_NEVER UINT64_MAX
+
+/*
+ * Embedded into its owner. fire() runs with the wheel locked, on the timer thread
+ * (or in timer_set() once the wheel has been stopped): it must not call timer_set()
+ * or timer_cancel(), nor take a lock that is held around them.
+ */
+struct wheel_timer_t {
+	struct wheel_timer_t* prev;
+	struct wheel_timer_t* next;
+	uint64_t expires;               /* tick */
+	struct wheel_timer_t** slot;    /* the list the timer is in, NULL unless pending */
+	int tag;
+	void (*fire)(void* data, int tag, int shutdown);
+	void* data;
+};
+
+int timers_start(struct globals_t* g);
+void timers_stop(struct globals_t* g);
+
+void timer_init(struct wheel_timer_t* t, void (*fire)(void* data, int tag, int shutdown), void* data);
+void timer_set(struct wheel_timer_t* t, uint64_t deadline, int tag);
+void timer_cancel(struct wheel_timer_t* t);
+
+#endif /* TIMERS_H_ */
@@ -2,6 +2,8 @@
 #include <stdio.h>
 #include <assert.h>
 #include <string.h>
+#include <time.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <libssh/libssh.h>
@@ -10,6 +12,18 @@
 #include "worker.h"
 #include "globals.h"
 #include "log.h"
+#include "events.h"
+#include "capture.h"
+#include "aggregate.h"
+#include "iplimit.h"
+#include "registry.h"
+#include "metrics.h"
+#include "sniff.h"
+#include "kexlimit.h"
+#include "evloop.h"
+#include "timers.h"
+#include "listener.h"
+#include "probes.h"
 
 static void get_ip_port(const struct sockaddr_storage* addr, char* ipstr, int* port)
 {
@@ -37,110 +51,361 @@ static int auth_password(ssh_session session, const char* user, const char* pass
 {
 	struct connection_info_t* conn = (struct connection_info_t*)userdata;
 
-	my_log(
-		LOG_WARNING,
-		"Failed password for %s from %s port %d ssh%d (target: %s:%d, password: %s)",
+	struct event_auth_password_t e = {
 		user,
 		conn->ipstr,
 		conn->port,
 		ssh_get_version(conn->session),
 		conn->my_ipstr,
 		conn->my_port,
+		conn->listener,
 		pass
-	);
+	};
 
+	PROBE5(auth_password, conn, (const char*)conn->ipstr, conn->port, user, conn->started_ns);
+	conn->last_activity = monotonic_time();
+	metrics_inc(METRIC_password_attempts_total);
+	if (!conn->auth_seen) {
+		conn->auth_seen = 1;
+		metrics_observe(METRIC_first_auth, monotonic_ns() - conn->started_ns);
+	}
+
+	update_session_timer(conn);
+
+	if (!aggregate_auth(conn, user, pass)) {
+		emit_auth_password(&e);
+	}
+
+	capture_auth_password(conn, user, pass);
 	return SSH_AUTH_DENIED;
 }
 
-static void handle_session(struct connection_info_t* conn)
+time_t monotonic_time(void)
 {
-	conn->event = ssh_event_new();
-	if (!conn->event) {
-		my_log(LOG_ALERT, "Could not create polling context");
-		return;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+uint64_t monotonic_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+void drop_session(ssh_session session, const struct sockaddr_storage* addr, int ip_tracked)
+{
+	if (ip_tracked) {
+		iplimit_release(&globals, addr);
+	}
+
+	ssh_disconnect(session);
+	ssh_free(session);
+}
+
+struct connection_info_t* alloc_connection(ssh_session session, const struct sockaddr_storage* addr, int ip_tracked)
+{
+	struct connection_info_t* conn = calloc(1, sizeof(struct connection_info_t));
+	if (!conn) {
+		my_log(LOG_ALERT, "malloc() failed, out of memory");
+		drop_session(session, addr, ip_tracked);
+		return NULL;
+	}
+
+	conn->next        = NULL;
+	conn->event       = NULL;
+	conn->session     = session;
+	conn->addr        = *addr;
+	conn->slot        = -1;
+	conn->ip_tracked  = ip_tracked;
+	conn->started_ns  = monotonic_ns();
+
+	conn->port        = -1;
+	conn->ipstr[0]    = '?';
+	conn->ipstr[1]    = 0;
+
+	conn->my_port     = -1;
+	conn->my_ipstr[0] = '?';
+	conn->my_ipstr[1] = 0;
+	conn->listener    = "?";
+
+	return conn;
+}
+
+void get_connection_info(struct connection_info_t* conn)
+{
+	socket_t sock = ssh_get_fd(conn->session);
+	socklen_t len = sizeof(conn->my_addr);
+
+	/* The peer address is known since accept() */
+	get_ip_port(&conn->addr, conn->ipstr, &conn->port);
+	if (!getsockname(sock, (struct sockaddr*)&conn->my_addr, &len)) {
+		get_ip_port(&conn->my_addr, conn->my_ipstr, &conn->my_port);
+		conn->listener = listener_name(&globals, &conn->my_addr);
 	}
 
-	struct ssh_server_callbacks_struct server_cb;
-	memset(&server_cb, 0, sizeof(server_cb));
-	ssh_callbacks_init(&server_cb);
-	server_cb.userdata               = conn;
-	server_cb.auth_password_function = auth_password;
+	conn->started       = monotonic_time();
+	conn->last_activity = conn->started;
+	conn->connected     = 1;
+	metrics_observe(METRIC_accept, monotonic_ns() - conn->started_ns);
+
+	struct event_connect_t e = { conn->ipstr, conn->port, conn->my_ipstr, conn->my_port, conn->listener };
+	emit_connect(&e);
+}
+
+void set_session_callbacks(struct connection_info_t* conn)
+{
+	memset(&conn->server_cb, 0, sizeof(conn->server_cb));
+	ssh_callbacks_init(&conn->server_cb);
+	conn->server_cb.userdata               = conn;
+	conn->server_cb.auth_password_function = auth_password;
 
 	ssh_set_auth_methods(conn->session, SSH_AUTH_METHOD_PASSWORD);
-	ssh_set_server_callbacks(conn->session, &server_cb);
+	ssh_set_server_callbacks(conn->session, &conn->server_cb);
+}
 
-	if (SSH_OK != ssh_handle_key_exchange(conn->session)) {
-		my_log(
-			LOG_WARNING,
-			"Did not receive identification string from %s:%d (target: %s:%d): %s",
+void log_kex_failure(struct connection_info_t* conn)
+{
+	struct event_kex_failed_t e = {
+		conn->ipstr,
+		conn->port,
+		conn->my_ipstr,
+		conn->my_port,
+		conn->listener,
+		ssh_get_error(conn->session)
+	};
+
+	PROBE5(kex_end, conn, (const char*)conn->ipstr, conn->port, 0, conn->started_ns);
+	metrics_inc(METRIC_kex_failures_total);
+	emit_kex_failed(&e);
+}
+
+void kex_completed(struct connection_info_t* conn)
+{
+	PROBE5(kex_end, conn, (const char*)conn->ipstr, conn->port, 1, conn->started_ns);
+	kexlimit_leave(conn);
+	conn->kex_done      = 1;
+	conn->last_activity = monotonic_time();
+	metrics_observe(METRIC_kex, monotonic_ns() - conn->started_ns);
+	update_session_timer(conn);
+}
+
+static void earliest(uint64_t* deadline, int* reason, uint64_t candidate, int why)
+{
+	if (candidate < *deadline) {
+		*deadline = candidate;
+		*reason   = why;
+	}
+}
+
+/* The earliest deadline of the session in its current state (TIMER_NEVER if none), and what it is for */
+uint64_t session_deadline(struct connection_info_t* conn, int* reason)
+{
+	uint64_t deadline = TIMER_NEVER;
+
+	*reason = EXPIRED_SHUTDOWN;
+	if (conn->sniffing) {
+		earliest(&deadline, reason, conn->started_ns + (uint64_t)globals.sniff_timeout * 1000000, EXPIRED_SNIFF);
+	}
+
+	/* Blocking waiters keep the kex wait deadline themselves */
+	if (conn->loop && kexlimit_queued(conn)) {
+		earliest(&deadline, reason, conn->kex_since + (uint64_t)globals.kex_wait * 1000000, EXPIRED_KEX_WAIT);
+	}
+
+	if (globals.auth_timeout && !conn->auth_seen) {
+		earliest(&deadline, reason, conn->started_ns + (uint64_t)globals.auth_timeout * 1000000000, EXPIRED_AUTH);
+	}
+
+	if (globals.idle_timeout) {
+		earliest(&deadline, reason, (uint64_t)(conn->last_activity + globals.idle_timeout) * 1000000000, EXPIRED_IDLE);
+	}
+
+	if (globals.session_lifetime) {
+		earliest(&deadline, reason, conn->started_ns + (uint64_t)globals.session_lifetime * 1000000000, EXPIRED_LIFETIME);
+	}
+
+	return deadline;
+}
+
+/*
+ * Runs on the timer thread. A blocked session thread is woken by shutting its socket down,
+ * which makes every libssh call on it fail at once; event-loop sessions are handed back to their loop.
+ */
+static void session_expired(void* data, int reason, int stopping)
+{
+	struct connection_info_t* conn = (struct connection_info_t*)data;
+
+	if (stopping) {
+		reason = EXPIRED_SHUTDOWN;
+	}
+
+	if (conn->loop) {
+		evloop_expired(conn, reason);
+		return;
+	}
+
+	conn->expired = reason;
+	shutdown(conn->fd, SHUT_RDWR);
+	kexlimit_interrupt(conn);
+}
+
+void start_session_timer(struct connection_info_t* conn)
+{
+	conn->fd = ssh_get_fd(conn->session);
+	timer_init(&conn->timer, session_expired, conn);
+	update_session_timer(conn);
+}
+
+/* Called by the thread that owns the session whenever a deadline may have changed */
+void update_session_timer(struct connection_info_t* conn)
+{
+	int reason;
+	uint64_t deadline = session_deadline(conn, &reason);
+
+	timer_set(&conn->timer, deadline, reason);
+}
+
+/* Expired sniffs and kex waits have counters of their own */
+void count_timeout(int reason)
+{
+	switch (reason) {
+		case EXPIRED_AUTH:
+			metrics_inc(METRIC_auth_timeouts_total);
+			break;
+
+		case EXPIRED_IDLE:
+			metrics_inc(METRIC_idle_timeouts_total);
+			break;
+
+		case EXPIRED_LIFETIME:
+			metrics_inc(METRIC_lifetime_timeouts_total);
+			break;
+
+		default:
+			break;
+	}
+}
+
+void log_disconnect(struct connection_info_t* conn)
+{
+	if (conn->connected) {
+		metrics_observe(METRIC_session, monotonic_ns() - conn->started_ns);
+
+		struct event_disconnect_t e = {
 			conn->ipstr,
 			conn->port,
 			conn->my_ipstr,
 			conn->my_port,
-			ssh_get_error(conn->session)
-		);
+			conn->listener,
+			(int)(monotonic_time() - conn->started)
+		};
+
+		emit_disconnect(&e);
+	}
+}
+
+static int shutdown_callback(socket_t fd, int revents, void* userdata)
+{
+	/* Never reset: the loop owning the event checks globals.terminate once ssh_event_dopoll() returns */
+	return 0;
+}
+
+/* Makes ssh_event_dopoll() on the event return as soon as the daemon starts shutting down */
+int watch_shutdown(ssh_event event)
+{
+	return ssh_event_add_fd(event, globals.shutdown_fd, POLLIN, shutdown_callback, NULL) == SSH_OK ? 0 : -1;
+}
+
+static void handle_session(struct connection_info_t* conn)
+{
+	conn->sniffing = globals.sniff_timeout != 0;
+	start_session_timer(conn);
+	if (conn->sniffing) {
+		int rc = sniff_wait(conn);
+
+		conn->sniffing = 0;
+		if (rc != SNIFF_SSH || conn->expired) {
+			return;
+		}
+
+		update_session_timer(conn);
+	}
+
+	conn->event = ssh_event_new();
+	if (!conn->event || watch_shutdown(conn->event)) {
+		my_log(LOG_ALERT, "Could not create polling context");
+		return;
+	}
+
+	set_session_callbacks(conn);
+	if (!kexlimit_enter(conn)) {
+		return;
+	}
+
+	PROBE4(kex_begin, conn, (const char*)conn->ipstr, conn->port, conn->started_ns);
+	if (SSH_OK != ssh_handle_key_exchange(conn->session)) {
+		kexlimit_leave(conn);
+		if (conn->expired != EXPIRED_SHUTDOWN) {
+			log_kex_failure(conn);
+		}
 
 		return;
 	}
 
+	kex_completed(conn);
 	ssh_event_add_session(conn->event, conn->session);
-	while (!globals.terminate && ssh_event_dopoll(conn->event, 100) != SSH_ERROR) {
+
+	/* No polling timeout: the session timer shuts the socket down when the session is over, and shutdown_fd wakes the loop up on shutdown */
+	while (!conn->expired && !globals.terminate && ssh_event_dopoll(conn->event, -1) != SSH_ERROR) {
 		;
 	}
 }
 
 void* worker(void* arg)
 {
-	struct sockaddr_storage addr;
 	struct connection_info_t* conn = (struct connection_info_t*)arg;
 
-	socket_t sock = ssh_get_fd(conn->session);
-	socklen_t len = sizeof(addr);
-
-	if (!getpeername(sock, (struct sockaddr*)&addr, &len)) {
-		get_ip_port(&addr, conn->ipstr, &conn->port);
-	}
-
-	if (!getsockname(sock, (struct sockaddr*)&addr, &len)) {
-		get_ip_port(&addr, conn->my_ipstr, &conn->my_port);
-	}
-
+	get_connection_info(conn);
+	PROBE5(worker_start, conn, conn->session, (const char*)conn->ipstr, conn->port, conn->started_ns);
 	handle_session(conn);
 	finalize_connection(conn);
 	return 0;
 }
 
+/* Returns -1 when every slot of the registry is taken */
+int register_connection(struct connection_info_t* conn)
+{
+	conn->slot = registry_add(globals.registry);
+	return conn->slot < 0 ? -1 : 0;
+}
+
 void finalize_connection(struct connection_info_t* conn)
 {
 	ssh_session session = conn->session;
+	uint64_t start      = monotonic_ns();
+	long int slot       = conn->slot;
 
-	pthread_mutex_lock(&globals.mutex);
-	{
-		if (conn->prev) {
-			conn->prev->next = conn->next;
-		}
-
-		if (conn->next) {
-			conn->next->prev = conn->prev;
-		}
-
-		if (globals.tail == conn) {
-			globals.tail = conn->prev;
-		}
-
-		if (globals.head == conn) {
-			globals.head = conn->next;
-		}
-
-		--globals.n_threads;
-	}
-	pthread_mutex_unlock(&globals.mutex);
+	PROBE5(finalize, conn, (const char*)conn->ipstr, conn->port, (int)conn->expired, conn->started_ns);
 
+	/* The socket is closed below, and the timer must not shut down a descriptor that has been reused */
+	timer_cancel(&conn->timer);
+	count_timeout(conn->expired);
 	if (conn->event) {
 		ssh_event_free(conn->event);
 	}
 
-	ssh_disconnect(session);
-	ssh_free(session);
+	log_disconnect(conn);
+	drop_session(session, &conn->addr, conn->ip_tracked);
 	free(conn);
+	metrics_observe(METRIC_teardown, monotonic_ns() - start);
+
+	/*
+	 * Last: the shutdown waits for the registry to empty, and then tears down the log,
+	 * the per-IP limits and libssh, which the steps above still use
+	 */
+	if (slot >= 0) {
+		registry_remove(globals.registry, slot);
+	}
 }
@@ -1,9 +1,35 @@
 #ifndef WORKER_H_
 #define WORKER_H_
 
+#include <stdint.h>
+#include <time.h>
 #include "globals.h"
 
+/* connection_info_t.expired: why the session timer has fired */
+#define EXPIRED_SHUTDOWN 1
+#define EXPIRED_SNIFF    2
+#define EXPIRED_KEX_WAIT 3
+#define EXPIRED_AUTH     4
+#define EXPIRED_IDLE     5
+#define EXPIRED_LIFETIME 6
+
+struct connection_info_t* alloc_connection(ssh_session session, const struct sockaddr_storage* addr, int ip_tracked);
+void drop_session(ssh_session session, const struct sockaddr_storage* addr, int ip_tracked);
+void get_connection_info(struct connection_info_t* conn);
+void set_session_callbacks(struct connection_info_t* conn);
+void log_kex_failure(struct connection_info_t* conn);
+void log_disconnect(struct connection_info_t* conn);
+void kex_completed(struct connection_info_t* conn);
+uint64_t session_deadline(struct connection_info_t* conn, int* reason);
+void start_session_timer(struct connection_info_t* conn);
+void update_session_timer(struct connection_info_t* conn);
+void count_timeout(int reason);
+int watch_shutdown(ssh_event event);
+time_t monotonic_time(void);
+uint64_t monotonic_ns(void);
+
 void* worker(void* arg);
+int register_connection(struct connection_info_t* conn);
 void finalize_connection(struct connection_info_t* conn);
 
 #endif /* WORKER_H_ */